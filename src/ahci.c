@@ -61,6 +61,26 @@ static void sata_prep_readwrite(struct sata_cmd_fis *fis,
     SET_FLATPTR(fis->device,       ((lba >> 24) & 0xf) | ATA_CB_DH_LBA);
 }
 
+static void sata_prep_ncq(struct sata_cmd_fis *fis,
+                          struct disk_op_s *op, int iswrite, int tag)
+{
+    u64 lba = op->lba;
+
+    memset_fl(fis, 0, sizeof(*fis));
+    SET_FLATPTR(fis->command,      (iswrite ? ATA_CMD_WRITE_FPDMA_QUEUED
+                                    : ATA_CMD_READ_FPDMA_QUEUED));
+    SET_FLATPTR(fis->feature,      op->count);
+    SET_FLATPTR(fis->feature2,     op->count >> 8);
+    SET_FLATPTR(fis->sector_count, tag << 3);
+    SET_FLATPTR(fis->lba_low,      lba);
+    SET_FLATPTR(fis->lba_mid,      lba >> 8);
+    SET_FLATPTR(fis->lba_high,     lba >> 16);
+    SET_FLATPTR(fis->lba_low2,     lba >> 24);
+    SET_FLATPTR(fis->lba_mid2,     lba >> 32);
+    SET_FLATPTR(fis->lba_high2,    lba >> 40);
+    SET_FLATPTR(fis->device,       ATA_CB_DH_LBA);
+}
+
 static void sata_prep_atapi(struct sata_cmd_fis *fis, u16 blocksize)
 {
     memset_fl(fis, 0, sizeof(*fis));
@@ -103,68 +123,155 @@ static void ahci_port_writel(struct ahci_ctrl_s *ctrl, u32 pnr, u32 reg, u32 val
     ahci_ctrl_writel(ctrl, ctrl_reg, val);
 }
 
-// submit ahci command + wait for result
-static int ahci_command(struct ahci_port_s *port, int iswrite, int isatapi,
-                        void *buffer, u32 bsize)
+// fill in the command list entry and prd table of a command slot
+static void ahci_prep_slot(struct ahci_port_s *port, int slot, int iswrite,
+                           int isatapi, void *buffer, u32 bsize)
 {
-    u32 val, status, success, flags, intbits, error;
-    struct ahci_ctrl_s *ctrl = GET_GLOBAL(port->ctrl);
-    struct ahci_cmd_s  *cmd  = GET_GLOBAL(port->cmd);
-    struct ahci_fis_s  *fis  = GET_GLOBAL(port->fis);
+    struct ahci_cmd_s  *cmd  = &GET_GLOBAL(port->cmd)[slot];
     struct ahci_list_s *list = GET_GLOBAL(port->list);
-    u32 pnr                  = GET_GLOBAL(port->pnr);
-    u64 end;
+    u32 addr = (u32)buffer, flags, prds = 0;
 
     SET_FLATPTR(cmd->fis.reg,       0x27);
     SET_FLATPTR(cmd->fis.pmp_type,  (1 << 7)); /* cmd fis */
-    SET_FLATPTR(cmd->prdt[0].base,  ((u32)buffer));
-    SET_FLATPTR(cmd->prdt[0].baseu, 0);
-    SET_FLATPTR(cmd->prdt[0].flags, bsize-1);
 
-    flags = ((1 << 16) | /* one prd entry */
-             (iswrite ? (1 << 6) : 0) |
-             (isatapi ? (1 << 5) : 0) |
+    // Callers never pass more than AHCI_MAX_PRD * AHCI_PRD_MAX_BYTES.
+    while (bsize && prds < AHCI_MAX_PRD) {
+        u32 len = bsize > AHCI_PRD_MAX_BYTES ? AHCI_PRD_MAX_BYTES : bsize;
+        SET_FLATPTR(cmd->prdt[prds].base,  addr);
+        SET_FLATPTR(cmd->prdt[prds].baseu, 0);
+        SET_FLATPTR(cmd->prdt[prds].flags, len-1);
+        addr += len;
+        bsize -= len;
+        prds++;
+    }
+
+    flags = ((prds << 16) | /* prd entries */
+             (iswrite ? AHCI_CMD_WRITE : 0) |
+             (isatapi ? AHCI_CMD_ATAPI : 0) |
              (5 << 0)); /* fis length (dwords) */
-    SET_FLATPTR(list[0].flags,  flags);
-    SET_FLATPTR(list[0].bytes,  0);
-    SET_FLATPTR(list[0].base,   ((u32)(cmd)));
-    SET_FLATPTR(list[0].baseu,  0);
+    SET_FLATPTR(list[slot].flags,  flags);
+    SET_FLATPTR(list[slot].bytes,  0);
+    SET_FLATPTR(list[slot].base,   ((u32)(cmd)));
+    SET_FLATPTR(list[slot].baseu,  0);
+}
 
-    dprintf(2, "AHCI/%d: send cmd ...\n", pnr);
-    intbits = ahci_port_readl(ctrl, pnr, PORT_IRQ_STAT);
-    if (intbits)
-        ahci_port_writel(ctrl, pnr, PORT_IRQ_STAT, intbits);
-    ahci_port_writel(ctrl, pnr, PORT_SCR_ACT, 1);
-    ahci_port_writel(ctrl, pnr, PORT_CMD_ISSUE, 1);
+static void ahci_port_comreset(struct ahci_ctrl_s *ctrl, u32 pnr)
+{
+    dprintf(2, "AHCI/%d: issue comreset\n", pnr);
+    u32 val = ahci_port_readl(ctrl, pnr, PORT_SCR_CTL);
+    // set Device Detection Initialization (DET) to 1 for 1 ms for comreset
+    ahci_port_writel(ctrl, pnr, PORT_SCR_CTL, val | 1);
+    mdelay (1);
+    ahci_port_writel(ctrl, pnr, PORT_SCR_CTL, val);
+}
 
-    end = calc_future_tsc(AHCI_REQUEST_TIMEOUT);
-    do {
-        for (;;) {
-            intbits = ahci_port_readl(ctrl, pnr, PORT_IRQ_STAT);
-            if (intbits) {
-                ahci_port_writel(ctrl, pnr, PORT_IRQ_STAT, intbits);
-                if (intbits & 0x02) {
-                    status = GET_FLATPTR(fis->psfis[2]);
-                    error  = GET_FLATPTR(fis->psfis[3]);
-                    break;
-                }
-                if (intbits & 0x01) {
-                    status = GET_FLATPTR(fis->rfis[2]);
-                    error  = GET_FLATPTR(fis->rfis[3]);
-                    break;
-                }
+// error recovery (AHCI 1.3 section 6.2.2.1)
+static void ahci_port_recover(struct ahci_ctrl_s *ctrl, u32 pnr, int comreset)
+{
+    u32 val;
+
+    // Clears PxCMD.ST to 0 to reset the PxCI register
+    val = ahci_port_readl(ctrl, pnr, PORT_CMD);
+    ahci_port_writel(ctrl, pnr, PORT_CMD, val & ~PORT_CMD_START);
+
+    // waits for PxCMD.CR to clear to 0
+    while (1) {
+        val = ahci_port_readl(ctrl, pnr, PORT_CMD);
+        if ((val & PORT_CMD_LIST_ON) == 0)
+            break;
+        yield();
+    }
+
+    // Clears any error bits in PxSERR to enable capturing new errors
+    val = ahci_port_readl(ctrl, pnr, PORT_SCR_ERR);
+    ahci_port_writel(ctrl, pnr, PORT_SCR_ERR, val);
+
+    // Clears status bits in PxIS as appropriate
+    val = ahci_port_readl(ctrl, pnr, PORT_IRQ_STAT);
+    ahci_port_writel(ctrl, pnr, PORT_IRQ_STAT, val);
+
+    // If PxTFD.STS.BSY or PxTFD.STS.DRQ is set to 1, issue
+    // a COMRESET to the device to put it in an idle state.  A failed
+    // queued command also needs one to leave the NCQ error state.
+    val = ahci_port_readl(ctrl, pnr, PORT_TFDATA);
+    if (comreset || val & (ATA_CB_STAT_BSY | ATA_CB_STAT_DRQ)) {
+        ahci_port_comreset(ctrl, pnr);
+
+        // Wait for the link to come back (PxSSTS.DET = 3), clear the
+        // errors the reset collected in PxSERR and wait for the device
+        // to become idle before restarting the port (section 10.4.2).
+        u64 end = calc_future_tsc(AHCI_RESET_TIMEOUT);
+        while ((ahci_port_readl(ctrl, pnr, PORT_SCR_STAT)
+                & PORT_SCR_STAT_DET_MASK) != PORT_SCR_STAT_DET_PHY) {
+            if (check_tsc(end)) {
+                warn_timeout();
+                break;
             }
+            yield();
+        }
+        val = ahci_port_readl(ctrl, pnr, PORT_SCR_ERR);
+        ahci_port_writel(ctrl, pnr, PORT_SCR_ERR, val);
+        end = calc_future_tsc(AHCI_REQUEST_TIMEOUT);
+        while (ahci_port_readl(ctrl, pnr, PORT_TFDATA)
+               & (ATA_CB_STAT_BSY | ATA_CB_STAT_DRQ)) {
             if (check_tsc(end)) {
                 warn_timeout();
-                return -1;
+                break;
             }
             yield();
         }
-        dprintf(2, "AHCI/%d: ... intbits 0x%x, status 0x%x ...\n",
-                pnr, intbits, status);
-    } while (status & ATA_CB_STAT_BSY);
+    }
+
+    // Sets PxCMD.ST to 1 to enable issuing new commands
+    val = ahci_port_readl(ctrl, pnr, PORT_CMD);
+    ahci_port_writel(ctrl, pnr, PORT_CMD, val | PORT_CMD_START);
+}
+
+// issue the prepared commands in the slots bitmask + wait for all of them
+static int ahci_issue(struct ahci_port_s *port, u32 slots, int ncq)
+{
+    u32 status, error, success, intbits, busy, tf;
+    struct ahci_ctrl_s *ctrl = GET_GLOBAL(port->ctrl);
+    u32 pnr                  = GET_GLOBAL(port->pnr);
+    u64 end;
+
+    dprintf(2, "AHCI/%d: send cmd (slots 0x%x%s) ...\n", pnr, slots,
+            ncq ? ", ncq" : "");
+    intbits = ahci_port_readl(ctrl, pnr, PORT_IRQ_STAT);
+    if (intbits)
+        ahci_port_writel(ctrl, pnr, PORT_IRQ_STAT, intbits);
+    if (ncq)
+        ahci_port_writel(ctrl, pnr, PORT_SCR_ACT, slots);
+    ahci_port_writel(ctrl, pnr, PORT_CMD_ISSUE, slots);
+
+    // A slot is done once the HBA clears its PxCI bit (and, for queued
+    // commands, the device clears its PxSACT bit).
+    end = calc_future_tsc(AHCI_REQUEST_TIMEOUT);
+    for (;;) {
+        intbits = ahci_port_readl(ctrl, pnr, PORT_IRQ_STAT);
+        busy = ahci_port_readl(ctrl, pnr, PORT_CMD_ISSUE);
+        if (ncq)
+            busy |= ahci_port_readl(ctrl, pnr, PORT_SCR_ACT);
+        if (!(busy & slots) || (intbits & PORT_IRQ_ERROR))
+            break;
+        if (check_tsc(end)) {
+            warn_timeout();
+            // Stop the port to clear PxCI/PxSACT before any retry.
+            ahci_port_recover(ctrl, pnr, 1);
+            return -1;
+        }
+        yield();
+    }
+    if (intbits)
+        ahci_port_writel(ctrl, pnr, PORT_IRQ_STAT, intbits);
 
-    success = (0x00 == (status & (ATA_CB_STAT_BSY | ATA_CB_STAT_DF |
+    tf = ahci_port_readl(ctrl, pnr, PORT_TFDATA);
+    status = tf & 0xff;
+    error = (tf >> 8) & 0xff;
+    dprintf(2, "AHCI/%d: ... intbits 0x%x, status 0x%x ...\n",
+            pnr, intbits, status);
+    success = (!(intbits & PORT_IRQ_ERROR) &&
+               0x00 == (status & (ATA_CB_STAT_BSY | ATA_CB_STAT_DF |
                                   ATA_CB_STAT_ERR)) &&
                ATA_CB_STAT_RDY == (status & (ATA_CB_STAT_RDY)));
     if (success) {
@@ -173,47 +280,19 @@ static int ahci_command(struct ahci_port_s *port, int iswrite, int isatapi,
     } else {
         dprintf(2, "AHCI/%d: ... finished, status 0x%x, ERROR 0x%x\n", pnr,
                 status, error);
-
-        // non-queued error recovery (AHCI 1.3 section 6.2.2.1)
-        // Clears PxCMD.ST to 0 to reset the PxCI register
-        val = ahci_port_readl(ctrl, pnr, PORT_CMD);
-        ahci_port_writel(ctrl, pnr, PORT_CMD, val & ~PORT_CMD_START);
-
-        // waits for PxCMD.CR to clear to 0
-        while (1) {
-            val = ahci_port_readl(ctrl, pnr, PORT_CMD);
-            if ((val & PORT_CMD_LIST_ON) == 0)
-                break;
-            yield();
-        }
-
-        // Clears any error bits in PxSERR to enable capturing new errors
-        val = ahci_port_readl(ctrl, pnr, PORT_SCR_ERR);
-        ahci_port_writel(ctrl, pnr, PORT_SCR_ERR, val);
-
-        // Clears status bits in PxIS as appropriate
-        val = ahci_port_readl(ctrl, pnr, PORT_IRQ_STAT);
-        ahci_port_writel(ctrl, pnr, PORT_IRQ_STAT, val);
-
-        // If PxTFD.STS.BSY or PxTFD.STS.DRQ is set to 1, issue
-        // a COMRESET to the device to put it in an idle state
-        val = ahci_port_readl(ctrl, pnr, PORT_TFDATA);
-        if (val & (ATA_CB_STAT_BSY | ATA_CB_STAT_DRQ)) {
-            dprintf(2, "AHCI/%d: issue comreset\n", pnr);
-            val = ahci_port_readl(ctrl, pnr, PORT_SCR_CTL);
-            // set Device Detection Initialization (DET) to 1 for 1 ms for comreset
-            ahci_port_writel(ctrl, pnr, PORT_SCR_CTL, val | 1);
-            mdelay (1);
-            ahci_port_writel(ctrl, pnr, PORT_SCR_CTL, val);
-        }
-
-        // Sets PxCMD.ST to 1 to enable issuing new commands
-        val = ahci_port_readl(ctrl, pnr, PORT_CMD);
-        ahci_port_writel(ctrl, pnr, PORT_CMD, val | PORT_CMD_START);
+        ahci_port_recover(ctrl, pnr, ncq);
     }
     return success ? 0 : -1;
 }
 
+// submit ahci command (in slot 0) + wait for result
+static int ahci_command(struct ahci_port_s *port, int iswrite, int isatapi,
+                        void *buffer, u32 bsize)
+{
+    ahci_prep_slot(port, 0, iswrite, isatapi, buffer, bsize);
+    return ahci_issue(port, 1, 0);
+}
+
 #define CDROM_CDB_SIZE 12
 
 int ahci_cmd_data(struct disk_op_s *op, void *cdbcmd, u16 blocksize)
@@ -238,22 +317,62 @@ int ahci_cmd_data(struct disk_op_s *op, void *cdbcmd, u16 blocksize)
     return DISK_RET_SUCCESS;
 }
 
-// read/write count blocks from a harddrive, op->buf_fl must be word aligned
+// Largest transfer of a single read/write command.
+#define AHCI_MAX_SECTORS_LBA28 255
+#define AHCI_MAX_SECTORS       65535
+
+// read/write count blocks from a harddrive, op->buf_fl must be word aligned.
+// The request is split over the available command slots, which are
+// issued together (as queued commands if the drive supports NCQ).
 static int
 ahci_disk_readwrite_aligned(struct disk_op_s *op, int iswrite)
 {
     struct ahci_port_s *port = container_of(
         op->drive_g, struct ahci_port_s, drive);
     struct ahci_cmd_s *cmd = GET_GLOBAL(port->cmd);
+    int slots = GET_GLOBAL(port->slots);
+    int ncq = GET_GLOBAL(port->ncq);
+    u16 maxcount = (GET_GLOBAL(port->lba48) ? AHCI_MAX_SECTORS
+                    : AHCI_MAX_SECTORS_LBA28);
+    struct disk_op_s chunk = *op;
+    u16 done = 0;
     int rc;
 
-    sata_prep_readwrite(&cmd->fis, op, iswrite);
-    rc = ahci_command(port, iswrite, 0, op->buf_fl,
-                      op->count * DISK_SECTOR_SIZE);
-    dprintf(2, "ahci disk %s, lba %6x, count %3x, buf %p, rc %d\n",
-            iswrite ? "write" : "read", (u32)op->lba, op->count, op->buf_fl, rc);
-    if (rc < 0)
-        return DISK_RET_EBADTRACK;
+    while (done < op->count) {
+        u32 mask = 0;
+        u16 batch = 0;
+        int slot;
+        for (slot = 0; slot < slots && done + batch < op->count; slot++) {
+            u16 count = op->count - done - batch;
+            if (count > maxcount)
+                count = maxcount;
+            chunk.lba = op->lba + done + batch;
+            chunk.count = count;
+            if (ncq)
+                sata_prep_ncq(&cmd[slot].fis, &chunk, iswrite, slot);
+            else
+                sata_prep_readwrite(&cmd[slot].fis, &chunk, iswrite);
+            ahci_prep_slot(port, slot, iswrite, 0,
+                           op->buf_fl + (u32)(done + batch) * DISK_SECTOR_SIZE,
+                           (u32)count * DISK_SECTOR_SIZE);
+            mask |= 1 << slot;
+            batch += count;
+        }
+        rc = ahci_issue(port, mask, ncq);
+        dprintf(2, "ahci disk %s, lba %6x, count %3x, buf %p, rc %d\n",
+                iswrite ? "write" : "read", (u32)op->lba + done, batch,
+                op->buf_fl + (u32)done * DISK_SECTOR_SIZE, rc);
+        if (rc < 0) {
+            if (ncq) {
+                // Retry the batch with non-queued commands.
+                ncq = 0;
+                continue;
+            }
+            op->count = done;
+            return DISK_RET_EBADTRACK;
+        }
+        done += batch;
+    }
     return DISK_RET_SUCCESS;
 }
 
@@ -266,36 +385,35 @@ ahci_disk_readwrite(struct disk_op_s *op, int iswrite)
         return ahci_disk_readwrite_aligned(op, iswrite);
 
     // Use a word aligned buffer for AHCI I/O
-    int rc;
+    u8 *alignedbuf_fl = bounce_buf_get();
+    if (!alignedbuf_fl)
+        return DISK_RET_EBOUNDARY;
     struct disk_op_s localop = *op;
-    u8 *alignedbuf_fl = GET_GLOBAL(bounce_buf_fl);
     u8 *position = op->buf_fl;
+    u16 todo = op->count;
+    int rc = DISK_RET_SUCCESS;
 
     localop.buf_fl = alignedbuf_fl;
-    localop.count = 1;
-
-    if (iswrite) {
-        u16 block;
-        for (block = 0; block < op->count; block++) {
-            memcpy_fl (alignedbuf_fl, position, DISK_SECTOR_SIZE);
-            rc = ahci_disk_readwrite_aligned (&localop, 1);
-            if (rc)
-                return rc;
-            position += DISK_SECTOR_SIZE;
-            localop.lba++;
-        }
-    } else { // read
-        u16 block;
-        for (block = 0; block < op->count; block++) {
-            rc = ahci_disk_readwrite_aligned (&localop, 0);
-            if (rc)
-                return rc;
-            memcpy_fl (position, alignedbuf_fl, DISK_SECTOR_SIZE);
-            position += DISK_SECTOR_SIZE;
-            localop.lba++;
-        }
+    while (todo) {
+        u16 count = todo;
+        if (count > BOUNCE_BUF_SIZE / DISK_SECTOR_SIZE)
+            count = BOUNCE_BUF_SIZE / DISK_SECTOR_SIZE;
+        u32 len = count * DISK_SECTOR_SIZE;
+        localop.count = count;
+        if (iswrite)
+            memcpy_fl(alignedbuf_fl, position, len);
+        rc = ahci_disk_readwrite_aligned(&localop, iswrite);
+        if (rc)
+            break;
+        if (!iswrite)
+            memcpy_fl(position, alignedbuf_fl, len);
+        position += len;
+        localop.lba += count;
+        todo -= count;
     }
-    return DISK_RET_SUCCESS;
+    bounce_buf_put(alignedbuf_fl);
+    op->count -= todo;
+    return rc;
 }
 
 // command demuxer
@@ -389,18 +507,19 @@ ahci_port_alloc(struct ahci_ctrl_s *ctrl, u32 pnr)
         warn_noalloc();
         return NULL;
     }
+    memset(port, 0, sizeof(*port));
     port->pnr = pnr;
     port->ctrl = ctrl;
     port->list = memalign_tmp(1024, 1024);
     port->fis = memalign_tmp(256, 256);
-    port->cmd = memalign_tmp(256, 256);
+    port->cmd = memalign_tmp(256, AHCI_MAX_SLOTS * sizeof(*port->cmd));
     if (port->list == NULL || port->fis == NULL || port->cmd == NULL) {
         warn_noalloc();
         return NULL;
     }
     memset(port->list, 0, 1024);
     memset(port->fis, 0, 256);
-    memset(port->cmd, 0, 256);
+    memset(port->cmd, 0, AHCI_MAX_SLOTS * sizeof(*port->cmd));
 
     ahci_port_writel(ctrl, pnr, PORT_LST_ADDR, (u32)port->list);
     ahci_port_writel(ctrl, pnr, PORT_FIS_ADDR, (u32)port->fis);
@@ -424,7 +543,7 @@ static struct ahci_port_s* ahci_port_realloc(struct ahci_port_s *port)
     free(port->cmd);
     port->list = memalign_low(1024, 1024);
     port->fis = memalign_low(256, 256);
-    port->cmd = memalign_low(256, 256);
+    port->cmd = memalign_low(256, AHCI_MAX_SLOTS * sizeof(*port->cmd));
 
     ahci_port_writel(port->ctrl, port->pnr, PORT_LST_ADDR, (u32)port->list);
     ahci_port_writel(port->ctrl, port->pnr, PORT_FIS_ADDR, (u32)port->fis);
@@ -454,45 +573,27 @@ static int ahci_port_init(struct ahci_port_s *port)
     u32 pnr = port->pnr;
     char model[MAXMODEL+1];
     u16 buffer[256];
-    u32 cmd, stat, err, tf;
-    u64 end;
+    u32 cmd, err, tf, sig;
     int rc;
 
-    /* enable FIS recv */
+    /* enable FIS recv (the link was already brought up by
+     * ahci_link_ports) */
     cmd = ahci_port_readl(ctrl, pnr, PORT_CMD);
     cmd |= PORT_CMD_FIS_RX;
     ahci_port_writel(ctrl, pnr, PORT_CMD, cmd);
 
-    /* spin up */
-    cmd |= PORT_CMD_SPIN_UP;
-    ahci_port_writel(ctrl, pnr, PORT_CMD, cmd);
-    end = calc_future_tsc(AHCI_LINK_TIMEOUT);
-    for (;;) {
-        stat = ahci_port_readl(ctrl, pnr, PORT_SCR_STAT);
-        if ((stat & 0x07) == 0x03) {
-            dprintf(1, "AHCI/%d: link up\n", port->pnr);
-            break;
-        }
-        if (check_tsc(end)) {
-            dprintf(1, "AHCI/%d: link down\n", port->pnr);
-            return -1;
-        }
-        yield();
-    }
-
     /* clear error status */
     err = ahci_port_readl(ctrl, pnr, PORT_SCR_ERR);
     if (err)
         ahci_port_writel(ctrl, pnr, PORT_SCR_ERR, err);
 
     /* wait for device becoming ready */
-    end = calc_future_tsc(AHCI_REQUEST_TIMEOUT);
     for (;;) {
         tf = ahci_port_readl(ctrl, pnr, PORT_TFDATA);
         if (!(tf & (ATA_CB_STAT_BSY |
                     ATA_CB_STAT_DRQ)))
             break;
-        if (check_tsc(end)) {
+        if (check_tsc(ctrl->probe_end)) {
             warn_timeout();
             dprintf(1, "AHCI/%d: device not ready (tf 0x%x)\n", port->pnr, tf);
             return -1;
@@ -504,8 +605,14 @@ static int ahci_port_init(struct ahci_port_s *port)
     cmd |= PORT_CMD_START;
     ahci_port_writel(ctrl, pnr, PORT_CMD, cmd);
 
-    sata_prep_simple(&port->cmd->fis, ATA_CMD_IDENTIFY_PACKET_DEVICE);
-    rc = ahci_command(port, 0, 0, buffer, sizeof(buffer));
+    /* the signature tells which identify command the device takes */
+    sig = ahci_port_readl(ctrl, pnr, PORT_SIG);
+    dprintf(2, "AHCI/%d: signature 0x%x\n", pnr, sig);
+    rc = -1;
+    if (sig != SATA_SIG_ATA) {
+        sata_prep_simple(&port->cmd->fis, ATA_CMD_IDENTIFY_PACKET_DEVICE);
+        rc = ahci_command(port, 0, 0, buffer, sizeof(buffer));
+    }
     if (rc == 0) {
         port->atapi = 1;
     } else {
@@ -533,6 +640,23 @@ static int ahci_port_init(struct ahci_port_s *port)
         else
             sectors = *(u32*)&buffer[60]; // word 60 and word 61
         port->drive.sectors = sectors;
+        port->lba48 = (buffer[83] & (1 << 10)) ? 1 : 0;
+
+        // Use as many command slots as the controller (and, for
+        // queued commands, the drive) supports.
+        u32 slots = ((ctrl->caps >> 8) & 0x1f) + 1;
+        if ((ctrl->caps & HOST_CAP_NCQ) && (buffer[76] & (1 << 8))
+            && port->lba48) {
+            u32 depth = (buffer[75] & 0x1f) + 1;
+            if (slots > depth)
+                slots = depth;
+            port->ncq = 1;
+        }
+        if (slots > AHCI_MAX_SLOTS)
+            slots = AHCI_MAX_SLOTS;
+        port->slots = slots;
+        dprintf(2, "AHCI/%d: %d command slots%s\n", pnr, slots,
+                port->ncq ? ", ncq" : "");
         u64 adjsize = sectors >> 11;
         char adjprefix = 'M';
         if (adjsize >= (1 << 16)) {
@@ -565,11 +689,20 @@ static int ahci_port_init(struct ahci_port_s *port)
     return 0;
 }
 
+static void
+ahci_probe_done(struct ahci_ctrl_s *ctrl)
+{
+    dprintf(1, "AHCI controller at %02x.%x initialized in %u ms\n"
+            , ctrl->pci_bdf >> 3, ctrl->pci_bdf & 7
+            , calc_elapsed_msecs(ctrl->probe_start));
+}
+
 // Detect any drives attached to a given controller.
 static void
 ahci_port_detect(void *data)
 {
     struct ahci_port_s *port = data;
+    struct ahci_ctrl_s *ctrl = port->ctrl;
     int rc;
 
     dprintf(2, "AHCI/%d: probing\n", port->pnr);
@@ -588,6 +721,68 @@ ahci_port_detect(void *data)
             boot_add_cd(&port->drive, port->desc, port->prio);
         }
     }
+    if (!--ctrl->probing)
+        ahci_probe_done(ctrl);
+}
+
+// Spin up all implemented ports at once and wait for their links with a
+// single deadline for the whole controller.  Ports that see a device but
+// no phy communication get one COMRESET.  Returns the bitmask of ports
+// with an established link.
+static u32
+ahci_link_ports(struct ahci_ctrl_s *ctrl, u32 max)
+{
+    u32 pnr, cmd, det, pending = 0, linked = 0, reset = 0;
+    u64 end;
+
+    for (pnr = 0; pnr <= max; pnr++) {
+        if (!(ctrl->ports & (1 << pnr)))
+            continue;
+        cmd = ahci_port_readl(ctrl, pnr, PORT_CMD);
+        if (!(cmd & PORT_CMD_SPIN_UP))
+            ahci_port_writel(ctrl, pnr, PORT_CMD, cmd | PORT_CMD_SPIN_UP);
+        pending |= 1 << pnr;
+    }
+
+    end = calc_future_tsc(AHCI_LINK_TIMEOUT);
+    for (;;) {
+        for (pnr = 0; pnr <= max; pnr++) {
+            if (!(pending & (1 << pnr)))
+                continue;
+            det = (ahci_port_readl(ctrl, pnr, PORT_SCR_STAT)
+                   & PORT_SCR_STAT_DET_MASK);
+            if (det == PORT_SCR_STAT_DET_PHY) {
+                dprintf(1, "AHCI/%d: link up\n", pnr);
+                linked |= 1 << pnr;
+                pending &= ~(1 << pnr);
+            }
+        }
+        if (!pending)
+            break;
+        if (check_tsc(end)) {
+            u32 retry = 0;
+            for (pnr = 0; pnr <= max; pnr++) {
+                if (!(pending & (1 << pnr)) || (reset & (1 << pnr)))
+                    continue;
+                det = (ahci_port_readl(ctrl, pnr, PORT_SCR_STAT)
+                       & PORT_SCR_STAT_DET_MASK);
+                if (det != PORT_SCR_STAT_DET_NOPHY)
+                    continue;
+                ahci_port_comreset(ctrl, pnr);
+                retry |= 1 << pnr;
+            }
+            if (!retry)
+                break;
+            reset |= retry;
+            pending = retry;
+            end = calc_future_tsc(AHCI_LINK_TIMEOUT);
+            continue;
+        }
+        yield();
+    }
+    if (pending)
+        dprintf(1, "AHCI: link down on ports 0x%x\n", pending);
+    return linked;
 }
 
 // Initialize an ata controller and detect its drives.
@@ -597,7 +792,7 @@ ahci_init_controller(struct pci_device *pci)
     struct ahci_ctrl_s *ctrl = malloc_fseg(sizeof(*ctrl));
     struct ahci_port_s *port;
     u16 bdf = pci->bdf;
-    u32 val, pnr, max;
+    u32 val, pnr, max, linked;
 
     if (!ctrl) {
         warn_noalloc();
@@ -610,6 +805,8 @@ ahci_init_controller(struct pci_device *pci)
         return;
     }
 
+    ctrl->probe_start = rdtscll();
+    ctrl->probing = 0;
     ctrl->pci_tmp = pci;
     ctrl->pci_bdf = bdf;
     ctrl->iobase = pci_config_readl(bdf, PCI_BASE_ADDRESS_5);
@@ -629,12 +826,28 @@ ahci_init_controller(struct pci_device *pci)
             ctrl->caps, ctrl->ports);
 
     max = ctrl->caps & 0x1f;
+    linked = ahci_link_ports(ctrl, max);
+
+    // Only probe ports with a device.  Count them all first so that
+    // the last probe to finish (threads may run inline) reports the
+    // controller init time.
+    ctrl->probe_end = calc_future_tsc(AHCI_REQUEST_TIMEOUT);
+    for (pnr = 0; pnr <= max; pnr++)
+        if (linked & (1 << pnr))
+            ctrl->probing++;
+    if (!ctrl->probing) {
+        ahci_probe_done(ctrl);
+        return;
+    }
     for (pnr = 0; pnr <= max; pnr++) {
-        if (!(ctrl->ports & (1 << pnr)))
+        if (!(linked & (1 << pnr)))
             continue;
         port = ahci_port_alloc(ctrl, pnr);
-        if (port == NULL)
+        if (port == NULL) {
+            if (!--ctrl->probing)
+                ahci_probe_done(ctrl);
             continue;
+        }
         run_thread(ahci_port_detect, port);
     }
 }
@@ -32,8 +32,15 @@ struct ahci_ctrl_s {
     u32 iobase;
     u32 caps;
     u32 ports;
+    u64 probe_start;    /* tsc when the controller was found */
+    u64 probe_end;      /* deadline shared by all port probes */
+    u8  probing;        /* port probes still running */
 };
 
+#define AHCI_MAX_PRD      8                 /* prd entries per command */
+#define AHCI_PRD_MAX_BYTES (4 * 1024 * 1024) /* bytes per prd entry */
+#define AHCI_MAX_SLOTS    4                 /* command slots per port */
+
 struct ahci_cmd_s {
     struct sata_cmd_fis fis;
     u8 atapi[0x20];
@@ -43,7 +50,7 @@ struct ahci_cmd_s {
         u32 baseu;
         u32 res;
         u32 flags;
-    } prdt[];
+    } prdt[AHCI_MAX_PRD];
 };
 
 /* command list */
@@ -72,9 +79,12 @@ struct ahci_port_s {
     struct ahci_ctrl_s *ctrl;
     struct ahci_list_s *list;
     struct ahci_fis_s  *fis;
-    struct ahci_cmd_s  *cmd;
+    struct ahci_cmd_s  *cmd;   /* one command table per slot */
     u32                pnr;
     u32                atapi;
+    u8                 slots;
+    u8                 lba48;
+    u8                 ncq;
     char               *desc;
     int                prio;
 };
@@ -170,6 +180,15 @@ int ahci_cmd_data(struct disk_op_s *op, void *cdbcmd, u16 blocksize);
 #define PORT_CMD_SPIN_UP          (1 << 1) /* Spin up device */
 #define PORT_CMD_START            (1 << 0) /* Enable port DMA engine */
 
+/* PORT_SCR_STAT bits */
+#define PORT_SCR_STAT_DET_MASK    0x0f /* device detection */
+#define PORT_SCR_STAT_DET_NOPHY   0x01 /* device present, no phy comm */
+#define PORT_SCR_STAT_DET_PHY     0x03 /* device present, phy comm */
+
+/* PORT_SIG values */
+#define SATA_SIG_ATA              0x00000101 /* SATA drive */
+#define SATA_SIG_ATAPI            0xeb140101 /* SATAPI drive */
+
 #define PORT_CMD_ICC_MASK         (0xf << 28) /* i/f ICC state mask */
 #define PORT_CMD_ICC_ACTIVE       (0x1 << 28) /* Put i/f in active state */
 #define PORT_CMD_ICC_PARTIAL      (0x2 << 28) /* Put i/f in partial state */
@@ -18,6 +18,7 @@
 #include "disk.h" // struct ata_s
 #include "ata.h" // ATA_CB_STAT
 #include "blockcmd.h" // CDB_CMD_READ_10
+#include "memmap.h" // PAGE_SIZE
 
 #define IDE_TIMEOUT 32000 //32 seconds max for IDE ops
 
@@ -26,11 +27,10 @@
  * Helper functions
  ****************************************************************/
 
-// Wait for the specified ide state
+// Wait for the specified ide state (or the deadline 'end' to pass)
 static inline int
-await_ide(u8 mask, u8 flags, u16 base, u16 timeout)
+await_ide(u8 mask, u8 flags, u16 base, u64 end)
 {
-    u64 end = calc_future_tsc(timeout);
     for (;;) {
         u8 status = inb(base+ATA_CB_STAT);
         if ((status & mask) == flags)
@@ -47,14 +47,7 @@ await_ide(u8 mask, u8 flags, u16 base, u16 timeout)
 static int
 await_not_bsy(u16 base)
 {
-    return await_ide(ATA_CB_STAT_BSY, 0, base, IDE_TIMEOUT);
-}
-
-// Wait for the device to be ready.
-static int
-await_rdy(u16 base)
-{
-    return await_ide(ATA_CB_STAT_RDY, ATA_CB_STAT_RDY, base, IDE_TIMEOUT);
+    return await_ide(ATA_CB_STAT_BSY, 0, base, calc_future_tsc(IDE_TIMEOUT));
 }
 
 // Wait for ide state - pauses for one ata cycle first.
@@ -75,9 +68,9 @@ ndelay_await_not_bsy(u16 iobase1)
     return await_not_bsy(iobase1);
 }
 
-// Reset a drive
+// Reset a drive - all waits end at the deadline 'end'.
 static void
-ata_reset(struct atadrive_s *adrive_g)
+ata_reset(struct atadrive_s *adrive_g, u64 end)
 {
     struct ata_channel_s *chan_gf = GET_GLOBAL(adrive_g->chan_gf);
     u8 slave = GET_GLOBAL(adrive_g->slave);
@@ -92,15 +85,15 @@ ata_reset(struct atadrive_s *adrive_g)
     msleep(2);
 
     // wait for device to become not busy.
-    int status = await_not_bsy(iobase1);
+    int status = await_ide(ATA_CB_STAT_BSY, 0, iobase1, end);
     if (status < 0)
         goto done;
     if (slave) {
         // Change device.
-        u64 end = calc_future_tsc(IDE_TIMEOUT);
         for (;;) {
             outb(ATA_CB_DH_DEV1, iobase1 + ATA_CB_DH);
-            status = ndelay_await_not_bsy(iobase1);
+            ndelay(400);
+            status = await_ide(ATA_CB_STAT_BSY, 0, iobase1, end);
             if (status < 0)
                 goto done;
             if (inb(iobase1 + ATA_CB_DH) == ATA_CB_DH_DEV1)
@@ -119,7 +112,7 @@ ata_reset(struct atadrive_s *adrive_g)
     // On a user-reset request, wait for RDY if it is an ATA device.
     u8 type=GET_GLOBAL(adrive_g->drive.type);
     if (type == DTYPE_ATA)
-        status = await_rdy(iobase1);
+        status = await_ide(ATA_CB_STAT_RDY, ATA_CB_STAT_RDY, iobase1, end);
 
 done:
     // Enable interrupts
@@ -152,7 +145,7 @@ process_ata_misc_op(struct disk_op_s *op)
         op->drive_g, struct atadrive_s, drive);
     switch (op->command) {
     case CMD_RESET:
-        ata_reset(adrive_g);
+        ata_reset(adrive_g, calc_future_tsc(IDE_TIMEOUT));
         return DISK_RET_SUCCESS;
     case CMD_ISREADY:
         return isready(adrive_g);
@@ -210,8 +203,9 @@ send_cmd(struct atadrive_s *adrive_g, struct ata_pio_command *cmd)
             return status;
     }
 
-    // Check for ATA_CMD_(READ|WRITE)_(SECTORS|DMA)_EXT commands.
-    if ((cmd->command & ~0x11) == ATA_CMD_READ_SECTORS_EXT) {
+    // Check for ATA_CMD_(READ|WRITE)_(SECTORS|DMA|MULTIPLE)_EXT commands.
+    if ((cmd->command & ~0x11) == ATA_CMD_READ_SECTORS_EXT
+        || (cmd->command & ~0x10) == ATA_CMD_READ_MULTIPLE_EXT) {
         outb(cmd->feature2, iobase1 + ATA_CB_FR);
         outb(cmd->sector_count2, iobase1 + ATA_CB_SC);
         outb(cmd->lba_low2, iobase1 + ATA_CB_SN);
@@ -230,9 +224,10 @@ send_cmd(struct atadrive_s *adrive_g, struct ata_pio_command *cmd)
 
 // Wait for data after calling 'send_cmd'.
 static int
-ata_wait_data(u16 iobase1)
+ata_wait_data(u16 iobase1, u64 end)
 {
-    int status = ndelay_await_not_bsy(iobase1);
+    ndelay(400);
+    int status = await_ide(ATA_CB_STAT_BSY, 0, iobase1, end);
     if (status < 0)
         return status;
 
@@ -292,9 +287,10 @@ fail:
  ****************************************************************/
 
 // Transfer 'op->count' blocks (of 'blocksize' bytes) to/from drive
-// 'op->drive_g'.
+// 'op->drive_g'.  The drive transfers 'multcount' blocks per DRQ.
 static int
-ata_pio_transfer(struct disk_op_s *op, int iswrite, int blocksize)
+ata_pio_transfer(struct disk_op_s *op, int iswrite, int blocksize
+                 , int multcount)
 {
     dprintf(16, "ata_pio_transfer id=%p write=%d count=%d bs=%d buf=%p\n"
             , op->drive_g, iswrite, op->count, blocksize, op->buf_fl);
@@ -308,22 +304,24 @@ ata_pio_transfer(struct disk_op_s *op, int iswrite, int blocksize)
     void *buf_fl = op->buf_fl;
     int status;
     for (;;) {
+        int thiscount = count < multcount ? count : multcount;
+        u32 bytes = thiscount * blocksize;
         if (iswrite) {
             // Write data to controller
             dprintf(16, "Write sector id=%p dest=%p\n", op->drive_g, buf_fl);
             if (CONFIG_ATA_PIO32)
-                outsl_fl(iobase1, buf_fl, blocksize / 4);
+                outsl_fl(iobase1, buf_fl, bytes / 4);
             else
-                outsw_fl(iobase1, buf_fl, blocksize / 2);
+                outsw_fl(iobase1, buf_fl, bytes / 2);
         } else {
             // Read data from controller
             dprintf(16, "Read sector id=%p dest=%p\n", op->drive_g, buf_fl);
             if (CONFIG_ATA_PIO32)
-                insl_fl(iobase1, buf_fl, blocksize / 4);
+                insl_fl(iobase1, buf_fl, bytes / 4);
             else
-                insw_fl(iobase1, buf_fl, blocksize / 2);
+                insw_fl(iobase1, buf_fl, bytes / 2);
         }
-        buf_fl += blocksize;
+        buf_fl += bytes;
 
         status = pause_await_not_bsy(iobase1, iobase2);
         if (status < 0) {
@@ -332,7 +330,7 @@ ata_pio_transfer(struct disk_op_s *op, int iswrite, int blocksize)
             return status;
         }
 
-        count--;
+        count -= thiscount;
         if (!count)
             break;
         status &= (ATA_CB_STAT_BSY | ATA_CB_STAT_DRQ | ATA_CB_STAT_ERR);
@@ -365,16 +363,13 @@ ata_pio_transfer(struct disk_op_s *op, int iswrite, int blocksize)
 #define  BM_CMD_MEMWRITE  0x08
 #define  BM_CMD_START     0x01
 #define BM_STATUS 2
+#define  BM_STATUS_DRV1_DMA 0x40
+#define  BM_STATUS_DRV0_DMA 0x20
 #define  BM_STATUS_IRQ    0x04
 #define  BM_STATUS_ERROR  0x02
 #define  BM_STATUS_ACTIVE 0x01
 #define BM_TABLE  4
 
-struct sff_dma_prd {
-    u32 buf_fl;
-    u32 count;
-};
-
 // Check if DMA available and setup transfer if so.
 static int
 ata_try_dma(struct disk_op_s *op, int iswrite, int blocksize)
@@ -389,19 +384,17 @@ ata_try_dma(struct disk_op_s *op, int iswrite, int blocksize)
         op->drive_g, struct atadrive_s, drive);
     struct ata_channel_s *chan_gf = GET_GLOBAL(adrive_g->chan_gf);
     u16 iomaster = GET_GLOBALFLAT(chan_gf->iomaster);
-    if (! iomaster)
+    if (! iomaster || ! GET_GLOBAL(adrive_g->dmamode))
         return -1;
     u32 bytes = op->count * blocksize;
-    if (! bytes)
+    if (! bytes || bytes & 1)
         return -1;
 
     // Build PRD dma structure.
-    struct sff_dma_prd *dma = MAKE_FLATPTR(
-        get_ebda_seg()
-        , (void*)offsetof(struct extended_bios_data_area_s, extra_stack));
+    struct sff_dma_prd *dma = GET_GLOBALFLAT(chan_gf->prdt);
     struct sff_dma_prd *origdma = dma;
     while (bytes) {
-        if (dma >= &origdma[16])
+        if (dma >= &origdma[ATA_MAX_PRD])
             // Too many descriptors..
             return -1;
         u32 count = bytes;
@@ -486,7 +479,8 @@ ata_dma_transfer(struct disk_op_s *op)
 
 // Transfer data to harddrive using PIO protocol.
 static int
-ata_pio_cmd_data(struct disk_op_s *op, int iswrite, struct ata_pio_command *cmd)
+ata_pio_cmd_data(struct disk_op_s *op, int iswrite, struct ata_pio_command *cmd
+                 , int multcount)
 {
     struct atadrive_s *adrive_g = container_of(
         op->drive_g, struct atadrive_s, drive);
@@ -500,10 +494,10 @@ ata_pio_cmd_data(struct disk_op_s *op, int iswrite, struct ata_pio_command *cmd)
     int ret = send_cmd(adrive_g, cmd);
     if (ret)
         goto fail;
-    ret = ata_wait_data(iobase1);
+    ret = ata_wait_data(iobase1, calc_future_tsc(IDE_TIMEOUT));
     if (ret)
         goto fail;
-    ret = ata_pio_transfer(op, iswrite, DISK_SECTOR_SIZE);
+    ret = ata_pio_transfer(op, iswrite, DISK_SECTOR_SIZE, multcount);
 
 fail:
     // Enable interrupts
@@ -532,6 +526,9 @@ ata_readwrite(struct disk_op_s *op, int iswrite)
     u64 lba = op->lba;
 
     int usepio = ata_try_dma(op, iswrite, DISK_SECTOR_SIZE);
+    struct atadrive_s *adrive_g = container_of(
+        op->drive_g, struct atadrive_s, drive);
+    int multcount = GET_GLOBAL(adrive_g->multcount);
 
     struct ata_pio_command cmd;
     memset(&cmd, 0, sizeof(cmd));
@@ -543,14 +540,20 @@ ata_readwrite(struct disk_op_s *op, int iswrite)
         cmd.lba_high2 = lba >> 40;
         lba &= 0xffffff;
 
-        if (usepio)
+        if (usepio && multcount)
+            cmd.command = (iswrite ? ATA_CMD_WRITE_MULTIPLE_EXT
+                           : ATA_CMD_READ_MULTIPLE_EXT);
+        else if (usepio)
             cmd.command = (iswrite ? ATA_CMD_WRITE_SECTORS_EXT
                            : ATA_CMD_READ_SECTORS_EXT);
         else
             cmd.command = (iswrite ? ATA_CMD_WRITE_DMA_EXT
                            : ATA_CMD_READ_DMA_EXT);
     } else {
-        if (usepio)
+        if (usepio && multcount)
+            cmd.command = (iswrite ? ATA_CMD_WRITE_MULTIPLE
+                           : ATA_CMD_READ_MULTIPLE);
+        else if (usepio)
             cmd.command = (iswrite ? ATA_CMD_WRITE_SECTORS
                            : ATA_CMD_READ_SECTORS);
         else
@@ -566,7 +569,7 @@ ata_readwrite(struct disk_op_s *op, int iswrite)
 
     int ret;
     if (usepio)
-        ret = ata_pio_cmd_data(op, iswrite, &cmd);
+        ret = ata_pio_cmd_data(op, iswrite, &cmd, multcount ? multcount : 1);
     else
         ret = ata_dma_cmd_data(op, &cmd);
     if (ret)
@@ -598,13 +601,12 @@ process_ata_op(struct disk_op_s *op)
 
 #define CDROM_CDB_SIZE 12
 
-// Low-level atapi command transmit function.
-int
-atapi_cmd_data(struct disk_op_s *op, void *cdbcmd, u16 blocksize)
+// Send a packet command and transfer its data by PIO (or by DMA if
+// 'usepio' is not set - the bus master must already be set up).
+static int
+atapi_send_packet(struct disk_op_s *op, void *cdbcmd, u16 blocksize
+                  , int usepio)
 {
-    if (! CONFIG_ATA)
-        return 0;
-
     struct atadrive_s *adrive_g = container_of(
         op->drive_g, struct atadrive_s, drive);
     struct ata_channel_s *chan_gf = GET_GLOBAL(adrive_g->chan_gf);
@@ -616,20 +618,29 @@ atapi_cmd_data(struct disk_op_s *op, void *cdbcmd, u16 blocksize)
     cmd.lba_mid = blocksize;
     cmd.lba_high = blocksize >> 8;
     cmd.command = ATA_CMD_PACKET;
+    if (!usepio)
+        cmd.feature = 1; /* dma */
 
-    // Disable interrupts
-    outb(ATA_CB_DC_HD15 | ATA_CB_DC_NIEN, iobase2 + ATA_CB_DC);
+    // Disable interrupts for pio - dma completion is detected through
+    // the bus master irq status, which needs INTRQ.
+    if (usepio)
+        outb(ATA_CB_DC_HD15 | ATA_CB_DC_NIEN, iobase2 + ATA_CB_DC);
 
     int ret = send_cmd(adrive_g, &cmd);
     if (ret)
         goto fail;
-    ret = ata_wait_data(iobase1);
+    ret = ata_wait_data(iobase1, calc_future_tsc(IDE_TIMEOUT));
     if (ret)
         goto fail;
 
     // Send command to device
     outsw_fl(iobase1, MAKE_FLATPTR(GET_SEG(SS), cdbcmd), CDROM_CDB_SIZE / 2);
 
+    if (!usepio) {
+        ret = ata_dma_transfer(op);
+        goto fail;
+    }
+
     int status = pause_await_not_bsy(iobase1, iobase2);
     if (status < 0) {
         ret = status;
@@ -651,11 +662,36 @@ atapi_cmd_data(struct disk_op_s *op, void *cdbcmd, u16 blocksize)
         goto fail;
     }
 
-    ret = ata_pio_transfer(op, 0, blocksize);
+    ret = ata_pio_transfer(op, 0, blocksize, 1);
 
 fail:
     // Enable interrupts
     outb(ATA_CB_DC_HD15, iobase2+ATA_CB_DC);
+    return ret;
+}
+
+// Low-level atapi command transmit function.
+int
+atapi_cmd_data(struct disk_op_s *op, void *cdbcmd, u16 blocksize)
+{
+    if (! CONFIG_ATA)
+        return 0;
+
+    // Only the data reads use dma - the other packet commands are short
+    // and some drives handle them poorly in dma mode.
+    u8 opcode = *(u8*)cdbcmd;
+    int isread = opcode == CDB_CMD_READ_10 || opcode == CDB_CMD_READ_12;
+    u16 count = op->count;
+    int ret;
+    if (isread && !ata_try_dma(op, 0, blocksize)) {
+        ret = atapi_send_packet(op, cdbcmd, blocksize, 0);
+        if (!ret)
+            return DISK_RET_SUCCESS;
+        // Retry the command using PIO.
+        dprintf(6, "atapi dma failed (%d) - retrying with pio\n", ret);
+        op->count = count;
+    }
+    ret = atapi_send_packet(op, cdbcmd, blocksize, 1);
     if (ret)
         return DISK_RET_EBADTRACK;
     return DISK_RET_SUCCESS;
@@ -683,9 +719,11 @@ process_atapi_op(struct disk_op_s *op)
  * ATA detect and init
  ****************************************************************/
 
-// Send an identify device or identify device packet command.
+// Send an identify device or identify device packet command.  The wait
+// for the identify data ends at the probe deadline 'end'.
 static int
-send_ata_identity(struct atadrive_s *adrive_g, u16 *buffer, int command)
+send_ata_identity(struct atadrive_s *adrive_g, u16 *buffer, int command
+                  , u64 end)
 {
     memset(buffer, 0, DISK_SECTOR_SIZE);
 
@@ -700,7 +738,25 @@ send_ata_identity(struct atadrive_s *adrive_g, u16 *buffer, int command)
     memset(&cmd, 0, sizeof(cmd));
     cmd.command = command;
 
-    return ata_pio_cmd_data(&dop, 0, &cmd);
+    struct ata_channel_s *chan_gf = adrive_g->chan_gf;
+    u16 iobase1 = chan_gf->iobase1;
+    u16 iobase2 = chan_gf->iobase2;
+
+    // Disable interrupts
+    outb(ATA_CB_DC_HD15 | ATA_CB_DC_NIEN, iobase2 + ATA_CB_DC);
+
+    int ret = send_cmd(adrive_g, &cmd);
+    if (ret)
+        goto fail;
+    ret = ata_wait_data(iobase1, end);
+    if (ret)
+        goto fail;
+    ret = ata_pio_transfer(&dop, 0, DISK_SECTOR_SIZE, 1);
+
+fail:
+    // Enable interrupts
+    outb(ATA_CB_DC_HD15, iobase2+ATA_CB_DC);
+    return ret;
 }
 
 // Extract the ATA/ATAPI version info.
@@ -748,12 +804,189 @@ init_atadrive(struct atadrive_s *dummy, u16 *buffer)
     return adrive_g;
 }
 
+// Intel PIIX3/PIIX4 IDE timing registers (pci config space).
+#define PIIX_IDETIM    0x40     // 16bit per channel - secondary at 0x42
+#define  PIIX_IDETIM_SITRE 0x4000
+#define  PIIX_IDETIM_TIME  0x01 // fast timing (shifted by 4 for slave)
+#define  PIIX_IDETIM_IE    0x02
+#define  PIIX_IDETIM_PPE   0x04
+#define  PIIX_IDETIM_DTE   0x08
+#define PIIX_SIDETIM   0x44     // slave ISP/RTC - secondary in bits 4-7
+#define PIIX_UDMACTL   0x48     // PIIX4 only
+#define PIIX_UDMATIM   0x4a     // PIIX4 only
+
+// Return the highest UDMA mode the controller can be programmed for
+// (-1 if only MWDMA), or -2 if the controller timing is not known.
+static int
+ata_chipset_max_udma(struct pci_device *pci)
+{
+    if (!pci || pci->vendor != PCI_VENDOR_ID_INTEL)
+        return -2;
+    if (pci->device == PCI_DEVICE_ID_INTEL_82371SB_1)
+        return -1;
+    if (pci->device == PCI_DEVICE_ID_INTEL_82371AB)
+        return 2;
+    return -2;
+}
+
+// Program the PIIX timing registers for the given transfer mode.
+static void
+ata_chipset_set_mode(struct atadrive_s *adrive_g, u8 mode)
+{
+    struct ata_channel_s *chan_gf = adrive_g->chan_gf;
+    u16 bdf = chan_gf->pci_bdf;
+    // The secondary channel's bus master registers are at BAR4+8.
+    int port = (chan_gf->iomaster & 0x08) ? 1 : 0;
+    int slave = adrive_g->slave;
+    int devid = port * 2 + slave;
+
+    if (!(mode & ATA_XFER_UDMA)) {
+        // Fast timing for dma only (pio keeps compatible timing): ISP
+        // and RTC (isp<<2 | rtc) of the pio mode matching the MWDMA mode.
+        static const u8 isprtc[] = { 0x00, 0x09, 0x0b };
+        u8 timing = isprtc[mode & 0x03];
+        u16 ctl = PIIX_IDETIM_TIME | PIIX_IDETIM_IE | PIIX_IDETIM_DTE;
+        if (adrive_g->drive.type == DTYPE_ATA)
+            ctl |= PIIX_IDETIM_PPE;
+        u16 idetim = pci_config_readw(bdf, PIIX_IDETIM + port * 2);
+        if (slave) {
+            idetim = (idetim & 0xff0f) | (ctl << 4) | PIIX_IDETIM_SITRE;
+            int shift = port * 4;
+            u8 sidetim = pci_config_readb(bdf, PIIX_SIDETIM);
+            sidetim = (sidetim & ~(0x0f << shift)) | (timing << shift);
+            pci_config_writeb(bdf, PIIX_SIDETIM, sidetim);
+        } else {
+            idetim = ((idetim & 0xccf0) | ctl | ((timing & 0x0c) << 10)
+                      | ((timing & 0x03) << 8));
+        }
+        pci_config_writew(bdf, PIIX_IDETIM + port * 2, idetim);
+    }
+
+    if (chan_gf->pci_tmp->device != PCI_DEVICE_ID_INTEL_82371AB)
+        return;
+    u8 udmactl = pci_config_readb(bdf, PIIX_UDMACTL) & ~(1 << devid);
+    if (mode & ATA_XFER_UDMA) {
+        udmactl |= 1 << devid;
+        u16 udmatim = pci_config_readw(bdf, PIIX_UDMATIM);
+        udmatim &= ~(0x03 << (devid * 4));
+        udmatim |= (mode & 0x03) << (devid * 4);
+        pci_config_writew(bdf, PIIX_UDMATIM, udmatim);
+    }
+    pci_config_writeb(bdf, PIIX_UDMACTL, udmactl);
+}
+
+// Return the dma mode the drive currently has selected (0 if none).
+static u8
+ata_current_dma_mode(u16 *buffer)
+{
+    u8 udma = (buffer[88] >> 8) & 0x7f;
+    if (buffer[53] & (1 << 2) && udma) // word 53 - word 88 valid
+        return ATA_XFER_UDMA | __fls(udma);
+    u8 mwdma = (buffer[63] >> 8) & 0x07;
+    if (mwdma)
+        return ATA_XFER_MWDMA | __fls(mwdma);
+    return 0;
+}
+
+// Select the fastest DMA mode supported by the drive, cable and
+// controller.  The mode is only changed on controllers whose timing
+// registers are known; elsewhere the mode the platform set up is kept.
+static void
+ata_set_dma_mode(struct atadrive_s *adrive_g, u16 *buffer)
+{
+    u16 iomaster = adrive_g->chan_gf->iomaster;
+    if (!CONFIG_ATA_DMA || !iomaster)
+        return;
+    if (!(buffer[49] & (1 << 8))) // word 49 - dma supported
+        return;
+
+    u8 status = inb(iomaster + BM_STATUS) & ~(BM_STATUS_IRQ|BM_STATUS_ERROR);
+    u8 drvdma = adrive_g->slave ? BM_STATUS_DRV1_DMA : BM_STATUS_DRV0_DMA;
+    u8 curmode = ata_current_dma_mode(buffer);
+    int maxudma = ata_chipset_max_udma(adrive_g->chan_gf->pci_tmp);
+    u8 mode = 0;
+    if (maxudma == -2) {
+        // Unknown controller - only use dma if the platform enabled it.
+        if (!(status & drvdma))
+            return;
+        mode = curmode;
+    } else {
+        u8 udma = buffer[88] & 0x7f;
+        if (buffer[53] & (1 << 2) && udma && maxudma >= 0) {
+            int best = __fls(udma);
+            if (best > 2 && !(buffer[93] & (1 << 13)))
+                // No 80 wire cable detected - limit to UDMA/33.
+                best = 2;
+            if (best > maxudma)
+                best = maxudma;
+            mode = ATA_XFER_UDMA | best;
+        } else if (buffer[63] & 0x07) {
+            mode = ATA_XFER_MWDMA | __fls(buffer[63] & 0x07);
+        }
+        if (mode && mode != curmode) {
+            struct ata_pio_command cmd;
+            memset(&cmd, 0, sizeof(cmd));
+            cmd.command = ATA_CMD_SET_FEATURES;
+            cmd.feature = ATA_SET_FEATURES_XFER;
+            cmd.sector_count = mode;
+            int ret = ata_cmd_nondata(adrive_g, &cmd);
+            if (ret < 0) {
+                dprintf(1, "ata%d-%d: unable to set transfer mode %x\n"
+                        , adrive_g->chan_gf->chanid, adrive_g->slave, mode);
+                // The drive keeps its previous mode.
+                mode = curmode;
+                if (mode & ATA_XFER_UDMA && (mode & 0x07) > maxudma)
+                    mode = 0;
+            }
+        }
+        if (mode)
+            ata_chipset_set_mode(adrive_g, mode);
+    }
+    if (!mode)
+        return;
+    adrive_g->dmamode = mode;
+
+    // Flag the drive as dma capable in the bus master status register.
+    outb(status | drvdma, iomaster + BM_STATUS);
+    dprintf(3, "ata%d-%d: using %s mode %d\n"
+            , adrive_g->chan_gf->chanid, adrive_g->slave
+            , (mode & ATA_XFER_UDMA) ? "UDMA" : "MWDMA", mode & 0x07);
+}
+
+// Enable READ/WRITE MULTIPLE with the largest block the drive supports.
+static void
+ata_set_multiple_mode(struct atadrive_s *adrive_g, u16 *buffer)
+{
+    u8 max = buffer[47] & 0xff; // word 47 - max sectors per drq block
+    if (max <= 1 || (max & (max - 1)))
+        return;
+    if (max > 64)
+        // Keep each drq block's string i/o (insw_fl/outsw_fl) below
+        // 64K so its segment offset can not wrap in 16bit mode.
+        max = 64;
+
+    struct ata_pio_command cmd;
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.command = ATA_CMD_SET_MULTIPLE_MODE;
+    cmd.sector_count = max;
+    int ret = ata_cmd_nondata(adrive_g, &cmd);
+    if (ret < 0) {
+        dprintf(1, "ata%d-%d: unable to set multiple mode %d\n"
+                , adrive_g->chan_gf->chanid, adrive_g->slave, max);
+        return;
+    }
+    adrive_g->multcount = max;
+    dprintf(3, "ata%d-%d: using %d sectors per pio block\n"
+            , adrive_g->chan_gf->chanid, adrive_g->slave, max);
+}
+
 // Detect if the given drive is an atapi - initialize it if so.
 static struct atadrive_s *
-init_drive_atapi(struct atadrive_s *dummy, u16 *buffer)
+init_drive_atapi(struct atadrive_s *dummy, u16 *buffer, u64 end)
 {
     // Send an IDENTIFY_DEVICE_PACKET command to device
-    int ret = send_ata_identity(dummy, buffer, ATA_CMD_IDENTIFY_PACKET_DEVICE);
+    int ret = send_ata_identity(dummy, buffer, ATA_CMD_IDENTIFY_PACKET_DEVICE
+                                , end);
     if (ret)
         return NULL;
 
@@ -764,6 +997,7 @@ init_drive_atapi(struct atadrive_s *dummy, u16 *buffer)
     adrive_g->drive.type = DTYPE_ATAPI;
     adrive_g->drive.blksize = CDROM_SECTOR_SIZE;
     adrive_g->drive.sectors = (u64)-1;
+    ata_set_dma_mode(adrive_g, buffer);
     u8 iscd = ((buffer[0] >> 8) & 0x1f) == 0x05;
     char model[MAXMODEL+1];
     char *desc = znprintf(MAXDESCSIZE
@@ -787,10 +1021,10 @@ init_drive_atapi(struct atadrive_s *dummy, u16 *buffer)
 
 // Detect if the given drive is a regular ata drive - initialize it if so.
 static struct atadrive_s *
-init_drive_ata(struct atadrive_s *dummy, u16 *buffer)
+init_drive_ata(struct atadrive_s *dummy, u16 *buffer, u64 end)
 {
     // Send an IDENTIFY_DEVICE command to device
-    int ret = send_ata_identity(dummy, buffer, ATA_CMD_IDENTIFY_DEVICE);
+    int ret = send_ata_identity(dummy, buffer, ATA_CMD_IDENTIFY_DEVICE, end);
     if (ret)
         return NULL;
 
@@ -800,6 +1034,8 @@ init_drive_ata(struct atadrive_s *dummy, u16 *buffer)
         return NULL;
     adrive_g->drive.type = DTYPE_ATA;
     adrive_g->drive.blksize = DISK_SECTOR_SIZE;
+    ata_set_dma_mode(adrive_g, buffer);
+    ata_set_multiple_mode(adrive_g, buffer);
 
     adrive_g->drive.pchs.cylinders = buffer[1];
     adrive_g->drive.pchs.heads = buffer[3];
@@ -835,11 +1071,9 @@ init_drive_ata(struct atadrive_s *dummy, u16 *buffer)
     return adrive_g;
 }
 
-static u64 SpinupEnd;
-
 // Wait for non-busy status and check for "floating bus" condition.
 static int
-powerup_await_non_bsy(u16 base)
+powerup_await_non_bsy(u16 base, u64 end)
 {
     u8 orstatus = 0;
     u8 status;
@@ -852,7 +1086,7 @@ powerup_await_non_bsy(u16 base)
             dprintf(4, "powerup IDE floating\n");
             return orstatus;
         }
-        if (check_tsc(SpinupEnd)) {
+        if (check_tsc(end)) {
             warn_timeout();
             return -1;
         }
@@ -862,6 +1096,42 @@ powerup_await_non_bsy(u16 base)
     return status;
 }
 
+// Check if a device position appears to be populated.
+static int
+ata_probe_position(struct ata_channel_s *chan_gf, u8 slave, u64 end)
+{
+    // Wait for not-bsy.
+    u16 iobase1 = chan_gf->iobase1;
+    int status = powerup_await_non_bsy(iobase1, end);
+    if (status < 0)
+        return status;
+    u8 newdh = slave ? ATA_CB_DH_DEV1 : ATA_CB_DH_DEV0;
+    outb(newdh, iobase1+ATA_CB_DH);
+    ndelay(400);
+    status = powerup_await_non_bsy(iobase1, end);
+    if (status < 0)
+        return status;
+    if (status == 0xff || status == 0x7f) {
+        // Nothing drives the bus at this position.
+        dprintf(6, "ata_detect ata%d-%d: floating (st=%x)\n"
+                , chan_gf->chanid, slave, status);
+        return -1;
+    }
+
+    // Check if ioport registers look valid.
+    outb(newdh, iobase1+ATA_CB_DH);
+    u8 dh = inb(iobase1+ATA_CB_DH);
+    outb(0x55, iobase1+ATA_CB_SC);
+    outb(0xaa, iobase1+ATA_CB_SN);
+    u8 sc = inb(iobase1+ATA_CB_SC);
+    u8 sn = inb(iobase1+ATA_CB_SN);
+    dprintf(6, "ata_detect ata%d-%d: sc=%x sn=%x dh=%x\n"
+            , chan_gf->chanid, slave, sc, sn, dh);
+    if (sc != 0x55 || sn != 0xaa || dh != newdh)
+        return -1;
+    return 0;
+}
+
 // Detect any drives attached to a given controller.
 static void
 ata_detect(void *data)
@@ -870,46 +1140,42 @@ ata_detect(void *data)
     struct atadrive_s dummy;
     memset(&dummy, 0, sizeof(dummy));
     dummy.chan_gf = chan_gf;
-    // Device detection
-    int didreset = 0;
-    u8 slave;
+    u16 iobase1 = chan_gf->iobase1;
+    u64 start = rdtscll();
+    // All waits of both positions (probe, reset and identify) share
+    // one deadline.
+    u64 end = calc_future_tsc(IDE_TIMEOUT);
+
+    // Check both positions before touching the drives, so that a
+    // single reset (and not-busy wait) covers master and slave.
+    u8 present = 0, slave;
     for (slave=0; slave<=1; slave++) {
-        // Wait for not-bsy.
-        u16 iobase1 = chan_gf->iobase1;
-        int status = powerup_await_non_bsy(iobase1);
-        if (status < 0)
-            continue;
-        u8 newdh = slave ? ATA_CB_DH_DEV1 : ATA_CB_DH_DEV0;
-        outb(newdh, iobase1+ATA_CB_DH);
-        ndelay(400);
-        status = powerup_await_non_bsy(iobase1);
-        if (status < 0)
-            continue;
+        if (ata_probe_position(chan_gf, slave, end) == 0)
+            present |= 1 << slave;
+        else if (!slave && inb(iobase1+ATA_CB_STAT) == 0xff)
+            // Floating bus - no drives on this channel.
+            break;
+    }
+    if (present) {
+        dummy.slave = !(present & 1);
+        ata_reset(&dummy, end);
+    }
 
-        // Check if ioport registers look valid.
-        outb(newdh, iobase1+ATA_CB_DH);
-        u8 dh = inb(iobase1+ATA_CB_DH);
-        outb(0x55, iobase1+ATA_CB_SC);
-        outb(0xaa, iobase1+ATA_CB_SN);
-        u8 sc = inb(iobase1+ATA_CB_SC);
-        u8 sn = inb(iobase1+ATA_CB_SN);
-        dprintf(6, "ata_detect ata%d-%d: sc=%x sn=%x dh=%x\n"
-                , chan_gf->chanid, slave, sc, sn, dh);
-        if (sc != 0x55 || sn != 0xaa || dh != newdh)
+    // Device detection
+    for (slave=0; slave<=1; slave++) {
+        if (!(present & (1 << slave)))
             continue;
 
         // Prepare new drive.
         dummy.slave = slave;
-
-        // reset the channel
-        if (!didreset) {
-            ata_reset(&dummy);
-            didreset = 1;
-        }
+        outb(slave ? ATA_CB_DH_DEV1 : ATA_CB_DH_DEV0, iobase1+ATA_CB_DH);
+        ndelay(400);
+        if (powerup_await_non_bsy(iobase1, end) < 0)
+            continue;
 
         // check for ATAPI
         u16 buffer[256];
-        struct atadrive_s *adrive_g = init_drive_atapi(&dummy, buffer);
+        struct atadrive_s *adrive_g = init_drive_atapi(&dummy, buffer, end);
         if (!adrive_g) {
             // Didn't find an ATAPI drive - look for ATA drive.
             u8 st = inb(iobase1+ATA_CB_STAT);
@@ -918,12 +1184,13 @@ ata_detect(void *data)
                 continue;
 
             // Wait for RDY.
-            int ret = await_rdy(iobase1);
+            int ret = await_ide(ATA_CB_STAT_BSY|ATA_CB_STAT_RDY
+                                , ATA_CB_STAT_RDY, iobase1, end);
             if (ret < 0)
                 continue;
 
             // check for ATA.
-            adrive_g = init_drive_ata(&dummy, buffer);
+            adrive_g = init_drive_ata(&dummy, buffer, end);
             if (!adrive_g)
                 // No ATA drive found
                 continue;
@@ -937,6 +1204,9 @@ ata_detect(void *data)
             // detection.
             break;
     }
+
+    dprintf(1, "ata%d: probed in %u ms\n"
+            , chan_gf->chanid, calc_elapsed_msecs(start));
 }
 
 // Initialize an ata controller and detect its drives.
@@ -956,6 +1226,16 @@ init_controller(struct pci_device *pci, int irq
     chan_gf->pci_tmp = pci;
     chan_gf->iobase1 = port1;
     chan_gf->iobase2 = port2;
+    chan_gf->prdt = NULL;
+    if (master) {
+        // A page aligned table never crosses a 64K boundary.
+        chan_gf->prdt = memalign_low(PAGE_SIZE
+                                     , ATA_MAX_PRD * sizeof(*chan_gf->prdt));
+        if (!chan_gf->prdt) {
+            warn_noalloc();
+            master = 0;
+        }
+    }
     chan_gf->iomaster = master;
     dprintf(1, "ATA controller %d at %x/%x/%x (irq %d dev %x)\n"
             , chanid, port1, port2, master, irq, chan_gf->pci_bdf);
@@ -1062,7 +1342,6 @@ ata_setup(void)
 
     dprintf(3, "init hard drives\n");
 
-    SpinupEnd = calc_future_tsc(IDE_TIMEOUT);
     ata_init();
 
     SET_BDA(disk_control_byte, 0xc0);
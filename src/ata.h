@@ -5,6 +5,14 @@
 #include "config.h" // CONFIG_MAX_ATA_INTERFACES
 #include "disk.h" // struct drive_s
 
+struct sff_dma_prd {
+    u32 buf_fl;
+    u32 count;
+};
+
+// Enough 64K descriptors for the largest LBA48 transfer (65536 sectors).
+#define ATA_MAX_PRD 512
+
 struct ata_channel_s {
     u16 iobase1;
     u16 iobase2;
@@ -13,12 +21,15 @@ struct ata_channel_s {
     u8  chanid;
     int pci_bdf;
     struct pci_device *pci_tmp;
+    struct sff_dma_prd *prdt;   // bus master descriptor table (low mem)
 };
 
 struct atadrive_s {
     struct drive_s drive;
     struct ata_channel_s *chan_gf;
     u8 slave;
+    u8 dmamode;                 // SET FEATURES transfer mode (0 = no dma)
+    u8 multcount;               // sectors per READ/WRITE MULTIPLE block
 };
 
 // ata.c
@@ -116,6 +127,8 @@ int process_atapi_op(struct disk_op_s *op);
 #define ATA_CMD_READ_VERIFY_SECTORS          0x40
 #define ATA_CMD_READ_VERIFY_SECTORS_EXT      0x42
 #define ATA_CMD_FORMAT_TRACK                 0x50
+#define ATA_CMD_READ_FPDMA_QUEUED            0x60
+#define ATA_CMD_WRITE_FPDMA_QUEUED           0x61
 #define ATA_CMD_SEEK                         0x70
 #define ATA_CMD_CFA_TRANSLATE_SECTOR         0x87
 #define ATA_CMD_EXECUTE_DEVICE_DIAGNOSTIC    0x90
@@ -148,6 +161,11 @@ int process_atapi_op(struct disk_op_s *op);
 #define ATA_CMD_WRITE_BUFFER                 0xE8
 #define ATA_CMD_IDENTIFY_DEVICE              0xEC
 #define ATA_CMD_SET_FEATURES                 0xEF
+
+// SET FEATURES subcommands and transfer mode values
+#define ATA_SET_FEATURES_XFER                0x03
+#define ATA_XFER_MWDMA                       0x20
+#define ATA_XFER_UDMA                        0x40
 #define ATA_CMD_READ_NATIVE_MAX_ADDRESS      0xF8
 #define ATA_CMD_SET_MAX                      0xF9
 
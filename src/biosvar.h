@@ -225,6 +225,7 @@ struct extended_bios_data_area_s {
     // 0x121 - Begin custom storage.
     u8 ps2ctr;
     struct usbkeyinfo usbkey_last;
+    u8 usbhid_idle;
 
     int RTCusers;
 
@@ -13,11 +13,12 @@
 #include "ahci.h" // process_ahci_op
 #include "virtio-blk.h" // process_virtio_blk_op
 #include "blockcmd.h" // cdb_*
+#include "paravirt.h" // romfile_loadint
+#include "memmap.h" // PAGE_SIZE
 
 u8 FloppyCount VAR16VISIBLE;
 u8 CDCount;
 struct drive_s *IDMap[3][CONFIG_MAX_EXTDRIVE] VAR16VISIBLE;
-u8 *bounce_buf_fl VAR16VISIBLE;
 
 struct drive_s *
 getDrive(u8 exttype, u8 extdriveoffset)
@@ -39,17 +40,106 @@ int getDriveId(u8 exttype, struct drive_s *drive_g)
     return -1;
 }
 
+
+
+/****************************************************************
+ * Bounce buffers
+ ****************************************************************/
+
+// Pool of page aligned buffers for drivers that can not transfer to
+// an arbitrary caller buffer.  A buffer may be held while calling
+// into another driver, so more than one is kept.
+struct bounce_pool_s {
+    u8 inuse;
+    u8 *bufs_fl[BOUNCE_BUF_COUNT];
+};
+
+struct bounce_pool_s *BouncePool VAR16VISIBLE;
+
 int bounce_buf_init(void)
 {
-    if (bounce_buf_fl)
+    ASSERT32FLAT();
+    if (BouncePool)
         return 0;
 
-    u8 *buf = malloc_low(CDROM_SECTOR_SIZE);
-    if (!buf) {
+    struct bounce_pool_s *pool = malloc_low(sizeof(*pool));
+    if (!pool) {
         warn_noalloc();
         return -1;
     }
-    bounce_buf_fl = buf;
+    memset(pool, 0, sizeof(*pool));
+    int i;
+    for (i = 0; i < BOUNCE_BUF_COUNT; i++) {
+        u8 *buf = memalign_low(PAGE_SIZE, BOUNCE_BUF_SIZE);
+        if (!buf) {
+            warn_noalloc();
+            while (i--)
+                free(pool->bufs_fl[i]);
+            free(pool);
+            return -1;
+        }
+        pool->bufs_fl[i] = buf;
+    }
+    BouncePool = pool;
+    return 0;
+}
+
+// Reserve a BOUNCE_BUF_SIZE byte buffer (or NULL if none is free).
+u8 *bounce_buf_get(void)
+{
+    struct bounce_pool_s *pool = GET_GLOBAL(BouncePool);
+    if (!pool)
+        return NULL;
+    u8 inuse = GET_FLATPTR(pool->inuse);
+    int i;
+    for (i = 0; i < BOUNCE_BUF_COUNT; i++)
+        if (!(inuse & (1 << i))) {
+            SET_FLATPTR(pool->inuse, inuse | (1 << i));
+            return GET_FLATPTR(pool->bufs_fl[i]);
+        }
+    dprintf(1, "No free bounce buffer\n");
+    return NULL;
+}
+
+// Release a buffer obtained from bounce_buf_get().
+void bounce_buf_put(u8 *buf_fl)
+{
+    struct bounce_pool_s *pool = GET_GLOBAL(BouncePool);
+    int i;
+    for (i = 0; i < BOUNCE_BUF_COUNT; i++)
+        if (GET_FLATPTR(pool->bufs_fl[i]) == buf_fl) {
+            SET_FLATPTR(pool->inuse, GET_FLATPTR(pool->inuse) & ~(1 << i));
+            return;
+        }
+}
+
+// Return the block size used when talking to the device itself.
+u16 drive_blksize(struct drive_s *drive_g)
+{
+    return GET_GLOBAL(drive_g->blksize) << GET_GLOBAL(drive_g->blkshift);
+}
+
+// Present a hard drive with large device blocks as 512 byte sectors.
+// The drive's sector count must be in device blocks on entry.
+int blkemu_init(struct drive_s *drive_g)
+{
+    ASSERT32FLAT();
+    u16 blksize = drive_g->blksize;
+    if (blksize == DISK_SECTOR_SIZE)
+        return 0;
+    if (blksize < DISK_SECTOR_SIZE || blksize > DISK_MAX_BLKSIZE
+        || (blksize & (blksize - 1))) {
+        dprintf(1, "Unsupported block size %d\n", blksize);
+        return -1;
+    }
+
+    if (bounce_buf_init() < 0)
+        return -1;
+    drive_g->blkshift = __ffs(blksize) - __ffs(DISK_SECTOR_SIZE);
+    drive_g->blksize = DISK_SECTOR_SIZE;
+    drive_g->sectors <<= drive_g->blkshift;
+    dprintf(3, "drive %p: emulating 512 byte sectors on %d byte blocks\n"
+            , drive_g, blksize);
     return 0;
 }
 
@@ -272,6 +362,381 @@ map_floppy_drive(struct drive_s *drive_g)
 }
 
 
+/****************************************************************
+ * Sector read cache
+ ****************************************************************/
+
+struct bcache_entry_s {
+    struct drive_s *drive_g;
+    u64 lba;
+    u32 stamp;
+};
+
+struct bcache_s {
+    u32 hits, misses;
+    u32 clock;
+    u16 count;
+    u8 *data_fl;
+    struct bcache_entry_s entries[0];
+};
+
+// Requests larger than this are not inserted into the cache.
+#define BCACHE_MAX_INSERT 8
+
+struct bcache_s *BCache VAR16VISIBLE;
+
+void
+block_cache_setup(void)
+{
+    ASSERT32FLAT();
+    if (!CONFIG_BLOCK_CACHE)
+        return;
+    u32 count = romfile_loadint("etc/block-cache-size"
+                                , CONFIG_BLOCK_CACHE_SIZE);
+    if (!count)
+        return;
+    if (count > 0xffff)
+        count = 0xffff;
+    struct bcache_s *bc = malloc_low(sizeof(*bc)
+                                     + count * sizeof(bc->entries[0]));
+    u8 *data = malloc_low(count * DISK_SECTOR_SIZE);
+    if (!bc || !data) {
+        warn_noalloc();
+        free(bc);
+        free(data);
+        return;
+    }
+    memset(bc, 0, sizeof(*bc) + count * sizeof(bc->entries[0]));
+    bc->count = count;
+    bc->data_fl = data;
+    BCache = bc;
+    dprintf(1, "Disk read cache: %d sectors at %p\n", count, data);
+}
+
+void
+block_cache_stats(void)
+{
+    if (!CONFIG_BLOCK_CACHE)
+        return;
+    struct bcache_s *bc = GET_GLOBAL(BCache);
+    if (!bc)
+        return;
+    dprintf(1, "Disk read cache: %u hits, %u misses\n"
+            , GET_FLATPTR(bc->hits), GET_FLATPTR(bc->misses));
+}
+
+static void rahead_flush(void);
+
+// Forget all cached data - the drives behind a drive_s may have changed.
+void
+block_cache_flush(void)
+{
+    rahead_flush();
+    if (!CONFIG_BLOCK_CACHE)
+        return;
+    struct bcache_s *bc = GET_GLOBAL(BCache);
+    if (!bc)
+        return;
+    int i, count = GET_FLATPTR(bc->count);
+    for (i = 0; i < count; i++)
+        SET_FLATPTR(bc->entries[i].drive_g, NULL);
+}
+
+// Only cache plain 512 byte sector hard drives.
+static int
+block_drive_cacheable(struct drive_s *drive_g)
+{
+    u8 type = GET_GLOBAL(drive_g->type);
+    return (GET_GLOBAL(drive_g->blksize) == DISK_SECTOR_SIZE
+            && type != DTYPE_FLOPPY && type != DTYPE_RAMDISK);
+}
+
+// Find the cache slot holding the given sector (or -1).
+static int
+bcache_find(struct bcache_s *bc, struct drive_s *drive_g, u64 lba)
+{
+    int i, count = GET_FLATPTR(bc->count);
+    for (i = 0; i < count; i++) {
+        struct bcache_entry_s *e = &bc->entries[i];
+        if (GET_FLATPTR(e->drive_g) == drive_g && GET_FLATPTR(e->lba) == lba)
+            return i;
+    }
+    return -1;
+}
+
+// Store a sector in the least recently used cache slot.
+static void
+bcache_insert(struct bcache_s *bc, struct drive_s *drive_g, u64 lba
+              , u8 *buf_fl)
+{
+    int i, count = GET_FLATPTR(bc->count), slot = 0;
+    u32 clock = GET_FLATPTR(bc->clock), oldest = 0;
+    for (i = 0; i < count; i++) {
+        struct bcache_entry_s *e = &bc->entries[i];
+        if (!GET_FLATPTR(e->drive_g)) {
+            slot = i;
+            break;
+        }
+        u32 age = clock - GET_FLATPTR(e->stamp);
+        if (age > oldest) {
+            oldest = age;
+            slot = i;
+        }
+    }
+    struct bcache_entry_s *e = &bc->entries[slot];
+    SET_FLATPTR(e->drive_g, drive_g);
+    SET_FLATPTR(e->lba, lba);
+    SET_FLATPTR(e->stamp, clock);
+    SET_FLATPTR(bc->clock, clock + 1);
+    memcpy_fl(GET_FLATPTR(bc->data_fl) + slot * DISK_SECTOR_SIZE, buf_fl
+              , DISK_SECTOR_SIZE);
+}
+
+static int process_uncached_op(struct disk_op_s *op);
+
+// Try to satisfy a read from the cache, filling it on a miss.
+static int
+bcache_read(struct bcache_s *bc, struct disk_op_s *op)
+{
+    u8 *data_fl = GET_FLATPTR(bc->data_fl);
+    u32 clock = GET_FLATPTR(bc->clock);
+    int i, count = op->count;
+    for (i = 0; i < count; i++)
+        if (bcache_find(bc, op->drive_g, op->lba + i) < 0)
+            break;
+    if (count && i == count) {
+        // Every sector is cached.
+        for (i = 0; i < count; i++) {
+            int slot = bcache_find(bc, op->drive_g, op->lba + i);
+            SET_FLATPTR(bc->entries[slot].stamp, clock);
+            memcpy_fl(op->buf_fl + i * DISK_SECTOR_SIZE
+                      , data_fl + slot * DISK_SECTOR_SIZE, DISK_SECTOR_SIZE);
+        }
+        SET_FLATPTR(bc->clock, clock + 1);
+        SET_FLATPTR(bc->hits, GET_FLATPTR(bc->hits) + 1);
+        return DISK_RET_SUCCESS;
+    }
+
+    SET_FLATPTR(bc->misses, GET_FLATPTR(bc->misses) + 1);
+    int ret = process_uncached_op(op);
+    if (ret || op->count > BCACHE_MAX_INSERT)
+        return ret;
+    for (i = 0; i < op->count; i++)
+        if (bcache_find(bc, op->drive_g, op->lba + i) < 0)
+            bcache_insert(bc, op->drive_g, op->lba + i
+                          , op->buf_fl + i * DISK_SECTOR_SIZE);
+    return ret;
+}
+
+// Drop any cached copies of sectors about to be written.
+static void
+bcache_invalidate(struct bcache_s *bc, struct disk_op_s *op)
+{
+    int i, count = GET_FLATPTR(bc->count);
+    for (i = 0; i < count; i++) {
+        struct bcache_entry_s *e = &bc->entries[i];
+        if (GET_FLATPTR(e->drive_g) != op->drive_g)
+            continue;
+        u64 lba = GET_FLATPTR(e->lba);
+        if (lba >= op->lba && lba < op->lba + op->count)
+            SET_FLATPTR(e->drive_g, NULL);
+    }
+}
+
+
+/****************************************************************
+ * Sequential read-ahead
+ ****************************************************************/
+
+struct rahead_stream_s {
+    struct drive_s *drive_g;
+    u64 next_lba;
+    u16 streak;
+};
+
+// Number of drives tracked by the sequential access detector.
+#define RAHEAD_STREAMS 4
+// Largest read-ahead window (the largest int13 transfer).
+#define RAHEAD_MAX 127
+
+struct rahead_s {
+    struct rahead_stream_s streams[RAHEAD_STREAMS];
+    u8 next_stream;
+    u16 size;
+    u32 fills, hits;
+    // The read-ahead buffer and the sectors it currently holds.
+    struct drive_s *drive_g;
+    u64 lba;
+    u16 count;
+    u8 *data_fl;
+};
+
+struct rahead_s *RAhead VAR16VISIBLE;
+
+void
+block_readahead_setup(void)
+{
+    ASSERT32FLAT();
+    if (!CONFIG_BLOCK_READAHEAD)
+        return;
+    u32 size = romfile_loadint("etc/block-readahead"
+                               , CONFIG_BLOCK_READAHEAD_SIZE);
+    if (!size)
+        return;
+    if (size > RAHEAD_MAX)
+        size = RAHEAD_MAX;
+    struct rahead_s *ra = malloc_low(sizeof(*ra));
+    u8 *data = malloc_low(size * DISK_SECTOR_SIZE);
+    if (!ra || !data) {
+        warn_noalloc();
+        free(ra);
+        free(data);
+        return;
+    }
+    memset(ra, 0, sizeof(*ra));
+    ra->size = size;
+    ra->data_fl = data;
+    RAhead = ra;
+    dprintf(1, "Disk read-ahead: %d sectors at %p\n", size, data);
+}
+
+void
+block_readahead_stats(void)
+{
+    if (!CONFIG_BLOCK_READAHEAD)
+        return;
+    struct rahead_s *ra = GET_GLOBAL(RAhead);
+    if (!ra)
+        return;
+    dprintf(1, "Disk read-ahead: %u window fills, %u buffered reads\n"
+            , GET_FLATPTR(ra->fills), GET_FLATPTR(ra->hits));
+}
+
+static void
+rahead_flush(void)
+{
+    if (!CONFIG_BLOCK_READAHEAD)
+        return;
+    struct rahead_s *ra = GET_GLOBAL(RAhead);
+    if (!ra)
+        return;
+    int i;
+    for (i = 0; i < RAHEAD_STREAMS; i++)
+        SET_FLATPTR(ra->streams[i].drive_g, NULL);
+    SET_FLATPTR(ra->drive_g, NULL);
+}
+
+// Note a read in the sequential access detector.  Returns the number
+// of directly preceding reads that ended where this one starts.
+static u16
+rahead_detect(struct rahead_s *ra, struct drive_s *drive_g, u64 lba, u16 count)
+{
+    struct rahead_stream_s *s = NULL;
+    int i;
+    for (i = 0; i < RAHEAD_STREAMS; i++)
+        if (GET_FLATPTR(ra->streams[i].drive_g) == drive_g) {
+            s = &ra->streams[i];
+            break;
+        }
+    u16 streak = 0;
+    if (!s) {
+        // Take over the oldest tracked drive.
+        u8 next = GET_FLATPTR(ra->next_stream);
+        SET_FLATPTR(ra->next_stream, (next + 1) % RAHEAD_STREAMS);
+        s = &ra->streams[next];
+        SET_FLATPTR(s->drive_g, drive_g);
+    } else if (GET_FLATPTR(s->next_lba) == lba) {
+        streak = GET_FLATPTR(s->streak);
+        if (streak < 0xffff)
+            streak++;
+    }
+    SET_FLATPTR(s->next_lba, lba + count);
+    SET_FLATPTR(s->streak, streak);
+    return streak;
+}
+
+static int process_device_op(struct disk_op_s *op);
+
+// Serve a read from the read-ahead buffer, refilling the buffer with
+// the following sectors when the drive is being read sequentially.
+static int
+rahead_read(struct rahead_s *ra, struct disk_op_s *op)
+{
+    struct drive_s *drive_g = op->drive_g;
+    u64 lba = op->lba;
+    u16 count = op->count;
+    u8 *buf_fl = op->buf_fl;
+    u8 *data_fl = GET_FLATPTR(ra->data_fl);
+    u16 streak = rahead_detect(ra, drive_g, lba, count);
+
+    // Copy any leading sectors already in the buffer.
+    u16 done = 0;
+    if (GET_FLATPTR(ra->drive_g) == drive_g) {
+        u64 buf_lba = GET_FLATPTR(ra->lba);
+        u16 buf_count = GET_FLATPTR(ra->count);
+        if (lba >= buf_lba && lba < buf_lba + buf_count) {
+            u32 offset = lba - buf_lba;
+            done = buf_count - offset;
+            if (done > count)
+                done = count;
+            memcpy_fl(buf_fl, data_fl + offset * DISK_SECTOR_SIZE
+                      , done * DISK_SECTOR_SIZE);
+        }
+    }
+    if (done == count) {
+        SET_FLATPTR(ra->hits, GET_FLATPTR(ra->hits) + 1);
+        return DISK_RET_SUCCESS;
+    }
+
+    // Fetch a full window if this looks like a sequential stream.
+    u16 todo = count - done;
+    u32 window = GET_FLATPTR(ra->size);
+    u64 sectors = GET_GLOBAL(drive_g->sectors);
+    op->lba = lba + done;
+    if (sectors != (u64)-1 && op->lba + window > sectors)
+        window = op->lba < sectors ? sectors - op->lba : 0;
+    if (streak && window > todo) {
+        SET_FLATPTR(ra->drive_g, NULL);
+        op->count = window;
+        op->buf_fl = data_fl;
+        int ret = process_device_op(op);
+        if (!ret && op->count >= todo) {
+            SET_FLATPTR(ra->drive_g, drive_g);
+            SET_FLATPTR(ra->lba, lba + done);
+            SET_FLATPTR(ra->count, op->count);
+            SET_FLATPTR(ra->fills, GET_FLATPTR(ra->fills) + 1);
+            memcpy_fl(buf_fl + done * DISK_SECTOR_SIZE, data_fl
+                      , todo * DISK_SECTOR_SIZE);
+            op->lba = lba;
+            op->count = count;
+            op->buf_fl = buf_fl;
+            return DISK_RET_SUCCESS;
+        }
+        // Window read failed - retry with just the requested sectors.
+        op->lba = lba + done;
+    }
+    op->count = todo;
+    op->buf_fl = buf_fl + done * DISK_SECTOR_SIZE;
+    int ret = process_device_op(op);
+    op->count += done;
+    op->lba = lba;
+    op->buf_fl = buf_fl;
+    return ret;
+}
+
+// Drop the read-ahead buffer if a write overlaps it.
+static void
+rahead_invalidate(struct rahead_s *ra, struct disk_op_s *op)
+{
+    if (GET_FLATPTR(ra->drive_g) != op->drive_g)
+        return;
+    u64 buf_lba = GET_FLATPTR(ra->lba);
+    if (op->lba < buf_lba + GET_FLATPTR(ra->count)
+        && op->lba + op->count > buf_lba)
+        SET_FLATPTR(ra->drive_g, NULL);
+}
+
+
 /****************************************************************
  * 16bit calling interface
  ****************************************************************/
@@ -298,11 +763,10 @@ process_scsi_op(struct disk_op_s *op)
     }
 }
 
-// Execute a disk_op request.
-int
-process_op(struct disk_op_s *op)
+// Execute a disk_op request in device blocks.
+static int
+process_drive_op(struct disk_op_s *op)
 {
-    ASSERT16();
     u8 type = GET_GLOBAL(op->drive_g->type);
     switch (type) {
     case DTYPE_FLOPPY:
@@ -320,6 +784,7 @@ process_op(struct disk_op_s *op)
     case DTYPE_AHCI:
 	return process_ahci_op(op);
     case DTYPE_USB:
+    case DTYPE_UAS:
     case DTYPE_VIRTIO_SCSI:
         return process_scsi_op(op);
     default:
@@ -328,6 +793,130 @@ process_op(struct disk_op_s *op)
     }
 }
 
+// Transfer 512 byte sectors on a drive with larger device blocks.
+// Aligned runs of whole blocks go directly to the drive; partial blocks
+// are staged in a bounce buffer (read-modify-write for writes).
+static int
+blkemu_transfer(struct disk_op_s *op, u8 shift, u8 *emubuf_fl)
+{
+    u32 per = 1 << shift;
+    u64 lba = op->lba;
+    u16 count = op->count;
+    u8 *buf_fl = op->buf_fl;
+    struct disk_op_s dop;
+    dop.drive_g = op->drive_g;
+    op->count = 0;
+
+    while (count) {
+        u32 offset = (u32)lba & (per - 1);
+        u16 thiscount;
+        int ret;
+        dop.lba = lba >> shift;
+        if (offset || count < per) {
+            // Partial block - go through the staging buffer.
+            thiscount = per - offset;
+            if (thiscount > count)
+                thiscount = count;
+            dop.command = CMD_READ;
+            dop.count = 1;
+            dop.buf_fl = emubuf_fl;
+            ret = process_drive_op(&dop);
+            if (ret)
+                return ret;
+            u8 *pos_fl = emubuf_fl + offset * DISK_SECTOR_SIZE;
+            u32 len = thiscount * DISK_SECTOR_SIZE;
+            if (op->command == CMD_WRITE) {
+                memcpy_fl(pos_fl, buf_fl, len);
+                dop.command = CMD_WRITE;
+                dop.count = 1;
+                dop.buf_fl = emubuf_fl;
+                ret = process_drive_op(&dop);
+                if (ret)
+                    return ret;
+            } else {
+                memcpy_fl(buf_fl, pos_fl, len);
+            }
+            op->count += thiscount;
+        } else {
+            // Whole blocks - pass straight through.
+            dop.command = op->command;
+            dop.count = count >> shift;
+            dop.buf_fl = buf_fl;
+            ret = process_drive_op(&dop);
+            op->count += dop.count << shift;
+            if (ret)
+                return ret;
+            thiscount = count & ~(per - 1);
+        }
+        lba += thiscount;
+        count -= thiscount;
+        buf_fl += thiscount * DISK_SECTOR_SIZE;
+    }
+    return DISK_RET_SUCCESS;
+}
+
+static int
+process_blkemu_op(struct disk_op_s *op, u8 shift)
+{
+    u8 *emubuf_fl = bounce_buf_get();
+    if (!emubuf_fl) {
+        op->count = 0;
+        return DISK_RET_EBOUNDARY;
+    }
+    int ret = blkemu_transfer(op, shift, emubuf_fl);
+    bounce_buf_put(emubuf_fl);
+    return ret;
+}
+
+// Execute a disk_op request in 512 byte sectors.
+static int
+process_device_op(struct disk_op_s *op)
+{
+    u8 shift = GET_GLOBAL(op->drive_g->blkshift);
+    if (shift && (op->command == CMD_READ || op->command == CMD_WRITE))
+        return process_blkemu_op(op, shift);
+    return process_drive_op(op);
+}
+
+// Execute a disk_op request without going through the cache.
+static int
+process_uncached_op(struct disk_op_s *op)
+{
+    struct rahead_s *ra = GET_GLOBAL(RAhead);
+    if (!CONFIG_BLOCK_READAHEAD || !ra || !block_drive_cacheable(op->drive_g))
+        return process_device_op(op);
+    switch (op->command) {
+    case CMD_READ:
+        return rahead_read(ra, op);
+    case CMD_WRITE:
+    case CMD_FORMAT:
+        rahead_invalidate(ra, op);
+        // FALLTHROUGH
+    default:
+        return process_device_op(op);
+    }
+}
+
+// Execute a disk_op request.
+int
+process_op(struct disk_op_s *op)
+{
+    ASSERT16();
+    struct bcache_s *bc = GET_GLOBAL(BCache);
+    if (!CONFIG_BLOCK_CACHE || !bc || !block_drive_cacheable(op->drive_g))
+        return process_uncached_op(op);
+    switch (op->command) {
+    case CMD_READ:
+        return bcache_read(bc, op);
+    case CMD_WRITE:
+    case CMD_FORMAT:
+        bcache_invalidate(bc, op);
+        // FALLTHROUGH
+    default:
+        return process_uncached_op(op);
+    }
+}
+
 // Execute a "disk_op_s" request - this runs on a stack in the ebda.
 static int
 __send_disk_op(struct disk_op_s *op_far, u16 op_seg)
@@ -12,6 +12,7 @@
 #include "ata.h" // atapi_cmd_data
 #include "ahci.h" // atapi_cmd_data
 #include "usb-msc.h" // usb_cmd_data
+#include "usb-uas.h" // uas_cmd_data
 #include "virtio-scsi.h" // virtio_scsi_cmd_data
 
 // Route command to low-level handler.
@@ -24,6 +25,8 @@ cdb_cmd_data(struct disk_op_s *op, void *cdbcmd, u16 blocksize)
         return atapi_cmd_data(op, cdbcmd, blocksize);
     case DTYPE_USB:
         return usb_cmd_data(op, cdbcmd, blocksize);
+    case DTYPE_UAS:
+        return uas_cmd_data(op, cdbcmd, blocksize);
     case DTYPE_AHCI:
         return ahci_cmd_data(op, cdbcmd, blocksize);
     case DTYPE_VIRTIO_SCSI:
@@ -78,11 +81,13 @@ scsi_is_ready(struct disk_op_s *op)
     return 0;
 }
 
-// Validate drive and find block size and sector count.
+// Validate drive and find block size and sector count.  The scsi
+// version from the inquiry data is stored in 'version' if not NULL.
 int
-scsi_init_drive(struct drive_s *drive, const char *s, int *pdt, char **desc)
+scsi_init_drive(struct drive_s *drive, const char *s, int *pdt, char **desc
+                , int *version)
 {
-    if (!CONFIG_USB_MSC && !CONFIG_VIRTIO_SCSI)
+    if (!CONFIG_USB_MSC && !CONFIG_USB_UAS && !CONFIG_VIRTIO_SCSI)
         return 0;
 
     struct disk_op_s dop;
@@ -101,6 +106,8 @@ scsi_init_drive(struct drive_s *drive, const char *s, int *pdt, char **desc)
     strtcpy(rev, data.rev, sizeof(rev));
     nullTrailingSpace(rev);
     *pdt = data.pdt & 0x1f;
+    if (version)
+        *version = data.version;
     int removable = !!(data.removable & 0x80);
     dprintf(1, "%s vendor='%s' product='%s' rev='%s' type=%d removable=%d\n"
             , s, vendor, product, rev, *pdt, removable);
@@ -168,6 +175,21 @@ cdb_get_inquiry(struct disk_op_s *op, struct cdbres_inquiry *data)
     return cdb_cmd_data(op, &cmd, sizeof(*data));
 }
 
+// Inquiry, block limits vital product data page.
+int
+cdb_get_block_limits(struct disk_op_s *op, struct cdbres_block_limits *data)
+{
+    struct cdb_inquiry_vpd cmd;
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.command = CDB_CMD_INQUIRY;
+    cmd.flags = CDB_INQUIRY_EVPD;
+    cmd.page = VPD_PAGE_BLOCK_LIMITS;
+    cmd.length = htons(sizeof(*data));
+    op->count = 1;
+    op->buf_fl = data;
+    return cdb_cmd_data(op, &cmd, sizeof(*data));
+}
+
 // Request SENSE
 int
 cdb_get_sense(struct disk_op_s *op, struct cdbres_request_sense *data)
@@ -229,7 +251,7 @@ cdb_read(struct disk_op_s *op)
     cmd.command = CDB_CMD_READ_10;
     cmd.lba = htonl(op->lba);
     cmd.count = htons(op->count);
-    return cdb_cmd_data(op, &cmd, GET_GLOBAL(op->drive_g->blksize));
+    return cdb_cmd_data(op, &cmd, drive_blksize(op->drive_g));
 }
 
 // Write sectors.
@@ -241,5 +263,5 @@ cdb_write(struct disk_op_s *op)
     cmd.command = CDB_CMD_WRITE_10;
     cmd.lba = htonl(op->lba);
     cmd.count = htons(op->count);
-    return cdb_cmd_data(op, &cmd, GET_GLOBAL(op->drive_g->blksize));
+    return cdb_cmd_data(op, &cmd, drive_blksize(op->drive_g));
 }
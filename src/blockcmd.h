@@ -7,6 +7,7 @@
 #define CDB_CMD_READ_10 0x28
 #define CDB_CMD_VERIFY_10 0x2f
 #define CDB_CMD_WRITE_10 0x2a
+#define CDB_CMD_READ_12 0xa8
 
 struct cdb_rwdata_10 {
     u8 command;
@@ -63,7 +64,8 @@ struct cdbres_request_sense {
 struct cdbres_inquiry {
     u8 pdt;
     u8 removable;
-    u8 reserved_02[2];
+    u8 version;
+    u8 reserved_03;
     u8 additional;
     u8 reserved_05[3];
     char vendor[8];
@@ -71,6 +73,28 @@ struct cdbres_inquiry {
     char rev[4];
 } PACKED;
 
+struct cdb_inquiry_vpd {
+    u8 command;
+    u8 flags;
+    u8 page;
+    u16 length;
+    u8 reserved_05;
+    u8 pad[10];
+} PACKED;
+
+#define CDB_INQUIRY_EVPD        0x01
+#define VPD_PAGE_BLOCK_LIMITS   0xb0
+
+struct cdbres_block_limits {
+    u8 pdt;
+    u8 page;
+    u16 length;
+    u8 reserved_04[4];
+    u32 max_transfer;
+    u32 opt_transfer;
+    u8 reserved_10[48];
+} PACKED;
+
 #define CDB_CMD_MODE_SENSE    0x5A
 #define MODE_PAGE_HD_GEOMETRY 0x04
 
@@ -104,12 +128,15 @@ int cdb_get_inquiry(struct disk_op_s *op, struct cdbres_inquiry *data);
 int cdb_get_sense(struct disk_op_s *op, struct cdbres_request_sense *data);
 int cdb_test_unit_ready(struct disk_op_s *op);
 int cdb_read_capacity(struct disk_op_s *op, struct cdbres_read_capacity *data);
+int cdb_get_block_limits(struct disk_op_s *op
+                         , struct cdbres_block_limits *data);
 int cdb_mode_sense_geom(struct disk_op_s *op, struct cdbres_mode_sense_geom *data);
 int cdb_inquiry(struct disk_op_s *op, struct cdbres_inquiry *data);
 int cdb_read(struct disk_op_s *op);
 int cdb_write(struct disk_op_s *op);
 
 int scsi_is_ready(struct disk_op_s *op);
-int scsi_init_drive(struct drive_s *drive, const char *s, int *pdt, char **desc);
+int scsi_init_drive(struct drive_s *drive, const char *s, int *pdt, char **desc
+                    , int *version);
 
 #endif // blockcmd.h
@@ -84,6 +84,13 @@ glob_prefix(const char *glob, const char *str)
     }
 }
 
+// Return the number of entries in the bootorder list.
+int
+bootorder_count(void)
+{
+    return BootorderCount;
+}
+
 // Search the bootorder list for the given glob pattern.
 static int
 find_prio(const char *glob)
@@ -624,6 +631,9 @@ do_boot(u16 seq_nr)
             wait_irq();
     }
 
+    block_cache_stats();
+    block_readahead_stats();
+
     // Boot the given BEV type.
     struct bev_s *ie = &BEV[seq_nr];
     switch (ie->type) {
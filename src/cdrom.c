@@ -31,50 +31,50 @@ cdemu_read(struct disk_op_s *op)
     dop.lba = GET_EBDA2(ebda_seg, cdemu.ilba) + op->lba / 4;
 
     int count = op->count;
+    u32 offset = op->lba & 3;
+    u8 *buf_fl = op->buf_fl;
     op->count = 0;
-    u8 *cdbuf_fl = GET_GLOBAL(bounce_buf_fl);
 
-    if (op->lba & 3) {
-        // Partial read of first block.
-        dop.count = 1;
+    while (count) {
+        if (!offset && count > 3) {
+            // Read n number of regular blocks.
+            dop.count = count / 4;
+            dop.buf_fl = buf_fl;
+            int ret = process_op(&dop);
+            op->count += dop.count * 4;
+            if (ret)
+                return ret;
+            u16 thiscount = count & ~3;
+            count &= 3;
+            buf_fl += thiscount * 512;
+            dop.lba += thiscount / 4;
+            continue;
+        }
+
+        // Partial blocks - read as many as fit through a bounce buffer.
+        u8 *cdbuf_fl = bounce_buf_get();
+        if (!cdbuf_fl)
+            return DISK_RET_EBOUNDARY;
+        u16 blocks = DIV_ROUND_UP(offset + count, 4);
+        if (blocks > BOUNCE_BUF_SIZE / CDROM_SECTOR_SIZE)
+            blocks = BOUNCE_BUF_SIZE / CDROM_SECTOR_SIZE;
+        dop.count = blocks;
         dop.buf_fl = cdbuf_fl;
         int ret = process_op(&dop);
-        if (ret)
-            return ret;
-        u8 thiscount = 4 - (op->lba & 3);
+        if (ret || dop.count != blocks) {
+            bounce_buf_put(cdbuf_fl);
+            return ret ? ret : DISK_RET_EBADTRACK;
+        }
+        u16 thiscount = blocks * 4 - offset;
         if (thiscount > count)
             thiscount = count;
+        memcpy_fl(buf_fl, cdbuf_fl + offset * 512, thiscount * 512);
+        bounce_buf_put(cdbuf_fl);
         count -= thiscount;
-        memcpy_fl(op->buf_fl, cdbuf_fl + (op->lba & 3) * 512, thiscount * 512);
-        op->buf_fl += thiscount * 512;
-        op->count += thiscount;
-        dop.lba++;
-    }
-
-    if (count > 3) {
-        // Read n number of regular blocks.
-        dop.count = count / 4;
-        dop.buf_fl = op->buf_fl;
-        int ret = process_op(&dop);
-        op->count += dop.count * 4;
-        if (ret)
-            return ret;
-        u8 thiscount = count & ~3;
-        count &= 3;
-        op->buf_fl += thiscount * 512;
-        dop.lba += thiscount / 4;
-    }
-
-    if (count) {
-        // Partial read on last block.
-        dop.count = 1;
-        dop.buf_fl = cdbuf_fl;
-        int ret = process_op(&dop);
-        if (ret)
-            return ret;
-        u8 thiscount = count;
-        memcpy_fl(op->buf_fl, cdbuf_fl, thiscount * 512);
+        buf_fl += thiscount * 512;
         op->count += thiscount;
+        dop.lba += blocks;
+        offset = 0;
     }
 
     return DISK_RET_SUCCESS;
@@ -241,6 +241,8 @@ cdrom_boot(struct drive_s *drive_g)
     u8 media = buffer[0x21];
     SET_EBDA2(ebda_seg, cdemu.media, media);
 
+    // The emulated drive is about to change - drop any cached sectors.
+    block_cache_flush();
     SET_EBDA2(ebda_seg, cdemu.emulated_drive_gf, dop.drive_g);
 
     u16 boot_segment = *(u16*)&buffer[0x22];
@@ -141,6 +141,17 @@ calc_future_tsc_usec(u32 usecs)
     return rdtscll() + ((u64)(khz/1000) * usecs);
 }
 
+// Return the number of milliseconds since the TSC value 'start'.
+u32
+calc_elapsed_msecs(u64 start)
+{
+    // Scale both sides down to avoid a 64bit division.
+    u32 khz = GET_GLOBAL(cpu_khz) >> 10;
+    if (!khz)
+        return 0;
+    return (u32)((rdtscll() - start) >> 10) / khz;
+}
+
 
 /****************************************************************
  * Init
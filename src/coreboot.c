@@ -450,6 +450,26 @@ cbfs_copyfile(struct cbfs_file *file, void *dst, u32 maxlen)
     return size;
 }
 
+// Copy part of a file to memory.  Only uncompressed files can be read
+// at an offset - compressed files must be loaded with cbfs_copyfile().
+int
+cbfs_readfile(struct cbfs_file *file, u32 offset, void *dst, u32 len)
+{
+    if (!CONFIG_COREBOOT || !CONFIG_COREBOOT_FLASH || !file)
+        return -1;
+    if (cbfs_iscomp(file))
+        return -1;
+
+    u32 size = ntohl(file->len);
+    if (offset >= size)
+        return 0;
+    if (len > size - offset)
+        len = size - offset;
+    void *src = (void*)file + ntohl(file->offset) + offset;
+    iomemcpy(dst, src, len);
+    return len;
+}
+
 struct cbfs_payload_segment {
     u32 type;
     u32 compression;
@@ -192,11 +192,18 @@ struct drive_s {
     // Info for EDD calls
     u8 translation;     // type of translation
     u16 blksize;        // block size
+    u8 blkshift;        // log2(device block size / blksize) if emulated
     struct chs_s pchs;  // Physical CHS
 };
 
 #define DISK_SECTOR_SIZE  512
 #define CDROM_SECTOR_SIZE 2048
+#define DISK_MAX_BLKSIZE  4096
+
+// Size and number of the shared bounce buffers (must hold at least
+// one DISK_MAX_BLKSIZE block).
+#define BOUNCE_BUF_SIZE   (4 * CDROM_SECTOR_SIZE)
+#define BOUNCE_BUF_COUNT  2
 
 #define DTYPE_NONE         0x00
 #define DTYPE_FLOPPY       0x01
@@ -208,6 +215,7 @@ struct drive_s {
 #define DTYPE_VIRTIO_BLK   0x07
 #define DTYPE_AHCI         0x08
 #define DTYPE_VIRTIO_SCSI  0x09
+#define DTYPE_UAS          0x0a
 
 #define MAXDESCSIZE 80
 
@@ -230,7 +238,6 @@ struct drive_s {
 
 // block.c
 extern u8 FloppyCount, CDCount;
-extern u8 *bounce_buf_fl;
 struct drive_s *getDrive(u8 exttype, u8 extdriveoffset);
 int getDriveId(u8 exttype, struct drive_s *drive_g);
 void map_floppy_drive(struct drive_s *drive_g);
@@ -239,6 +246,15 @@ void map_cd_drive(struct drive_s *drive_g);
 int process_op(struct disk_op_s *op);
 int send_disk_op(struct disk_op_s *op);
 int bounce_buf_init(void);
+u8 *bounce_buf_get(void);
+void bounce_buf_put(u8 *buf_fl);
+int blkemu_init(struct drive_s *drive_g);
+u16 drive_blksize(struct drive_s *drive_g);
+void block_cache_setup(void);
+void block_cache_stats(void);
+void block_cache_flush(void);
+void block_readahead_setup(void);
+void block_readahead_stats(void);
 
 // floppy.c
 extern struct floppy_ext_dbt_s diskette_param_table2;
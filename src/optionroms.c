@@ -188,6 +188,39 @@ getRomPriority(u64 *sources, struct rom_header *rom, int instance)
  * Roms in CBFS
  ****************************************************************/
 
+// Copy an option rom file to RomEnd.  The rom header is read first, so
+// that files that are not roms or do not fit are skipped without
+// copying them, and only the size given in the header is copied.
+static struct rom_header *
+copy_romfile(u32 file)
+{
+    if (!file)
+        return NULL;
+    struct rom_header *rom = (void*)RomEnd;
+    u32 avail = max_rom() - RomEnd;
+    int ret = romfile_read(file, 0, rom, sizeof(*rom));
+    if (ret < 0) {
+        // Compressed files can only be copied whole.
+        ret = romfile_copy(file, rom, avail);
+        if (ret <= 0)
+            return NULL;
+        return rom;
+    }
+    if (ret < sizeof(*rom) || rom->signature != OPTION_ROM_SIGNATURE)
+        return NULL;
+    u32 romsize = rom->size * 512;
+    if (romsize < sizeof(*rom) || romsize > avail) {
+        dprintf(1, "Option rom %s does not fit (size %d)\n"
+                , romfile_name(file), romsize);
+        return NULL;
+    }
+    ret = romfile_read(file, sizeof(*rom), (void*)rom + sizeof(*rom)
+                       , romsize - sizeof(*rom));
+    if (ret != romsize - sizeof(*rom))
+        return NULL;
+    return rom;
+}
+
 // Check if an option rom is at a hardcoded location or in CBFS.
 static struct rom_header *
 lookup_hardcode(struct pci_device *pci)
@@ -195,11 +228,7 @@ lookup_hardcode(struct pci_device *pci)
     char fname[17];
     snprintf(fname, sizeof(fname), "pci%04x,%04x.rom"
              , pci->vendor, pci->device);
-    int ret = romfile_copy(romfile_find(fname), (void*)RomEnd
-                           , max_rom() - RomEnd);
-    if (ret <= 0)
-        return NULL;
-    return (void*)RomEnd;
+    return copy_romfile(romfile_find(fname));
 }
 
 // Run all roms in a given CBFS directory.
@@ -211,9 +240,8 @@ run_file_roms(const char *prefix, int isvga, u64 *sources)
         file = romfile_findprefix(prefix, file);
         if (!file)
             break;
-        struct rom_header *rom = (void*)RomEnd;
-        int ret = romfile_copy(file, rom, max_rom() - RomEnd);
-        if (ret > 0) {
+        struct rom_header *rom = copy_romfile(file);
+        if (rom) {
             setRomSource(sources, rom, file);
             init_optionrom(rom, 0, isvga);
         }
@@ -14,22 +14,65 @@
 #include "smbios.h" // struct smbios_structure_header
 
 int qemu_cfg_present;
+static int qemu_cfg_dma;
+
+// Run a fw_cfg dma transfer and wait for it to complete.
+static void
+qemu_cfg_dma_transfer(void *address, u32 length, u32 control)
+{
+    QemuCfgDmaAccess access;
+    access.address = (u64)htonl((u32)address) << 32;
+    access.length = htonl(length);
+    access.control = htonl(control);
+    barrier();
+
+    // Writing the low half of the descriptor address starts the transfer.
+    outl(0, PORT_QEMU_CFG_DMA_ADDR_HIGH);
+    outl(htonl((u32)&access), PORT_QEMU_CFG_DMA_ADDR_LOW);
+
+    for (;;) {
+        u32 ctl = ntohl(readl(&access.control));
+        if (!(ctl & ~QEMU_CFG_DMA_CTL_ERROR)) {
+            if (ctl & QEMU_CFG_DMA_CTL_ERROR)
+                dprintf(1, "qemu_cfg: dma transfer error (ctl %x len %d)\n"
+                        , control, length);
+            return;
+        }
+        cpu_relax();
+    }
+}
+
+// File id and data offset of the fw_cfg entry selected by
+// qemu_cfg_read_file_offset() (zero if another entry was selected).
+static u32 CfgCursorFile, CfgCursorPos;
 
 static void
 qemu_cfg_select(u16 f)
 {
+    CfgCursorFile = 0;
     outw(f, PORT_QEMU_CFG_CTL);
 }
 
 static void
 qemu_cfg_read(u8 *buf, int len)
 {
-    insb(PORT_QEMU_CFG_DATA, buf, len);
+    if (!len)
+        return;
+    if (qemu_cfg_dma)
+        qemu_cfg_dma_transfer(buf, len, QEMU_CFG_DMA_CTL_READ);
+    else
+        insb(PORT_QEMU_CFG_DATA, buf, len);
 }
 
 static void
 qemu_cfg_skip(int len)
 {
+    if (len <= 0)
+        return;
+    if (qemu_cfg_dma) {
+        qemu_cfg_dma_transfer(NULL, len, QEMU_CFG_DMA_CTL_SKIP);
+        return;
+    }
     while (len--)
         inb(PORT_QEMU_CFG_DATA);
 }
@@ -37,6 +80,14 @@ qemu_cfg_skip(int len)
 static void
 qemu_cfg_read_entry(void *buf, int e, int len)
 {
+    if (qemu_cfg_dma) {
+        // Select the entry and read it with a single transfer.
+        CfgCursorFile = 0;
+        qemu_cfg_dma_transfer(buf, len, ((u32)e << 16)
+                              | QEMU_CFG_DMA_CTL_SELECT
+                              | QEMU_CFG_DMA_CTL_READ);
+        return;
+    }
     qemu_cfg_select(e);
     qemu_cfg_read(buf, len);
 }
@@ -59,6 +110,15 @@ void qemu_cfg_port_probe(void)
             break;
         }
     dprintf(4, "qemu_cfg_present=%d\n", qemu_cfg_present);
+    if (!qemu_cfg_present)
+        return;
+
+    // Use the dma interface when the host supports it.
+    u32 id;
+    qemu_cfg_read_entry(&id, QEMU_CFG_ID, sizeof(id));
+    if (id & QEMU_CFG_VERSION_DMA)
+        qemu_cfg_dma = 1;
+    dprintf(4, "qemu_cfg_dma=%d\n", qemu_cfg_dma);
 }
 
 void qemu_cfg_get_uuid(u8 *uuid)
@@ -305,81 +365,139 @@ u16 qemu_cfg_get_max_cpus(void)
     return cnt;
 }
 
-static QemuCfgFile LastFile;
+// Cached copy of the fw_cfg file directory, sorted by name.  The
+// size and select fields are converted to cpu byte order.  A file id
+// is the index of the file in this list plus one.
+static QemuCfgFile *CfgFiles;
+static u32 CfgFileCount;
 
-static u32
-__cfg_next_prefix_file(const char *prefix, int prefixlen, u32 prevselect)
+static void
+qemu_cfg_load_files(void)
 {
-    if (!qemu_cfg_present)
-        return 0;
+    if (CfgFiles || !qemu_cfg_present)
+        return;
 
     u32 count;
     qemu_cfg_read_entry(&count, QEMU_CFG_FILE_DIR, sizeof(count));
     count = ntohl(count);
-    u32 e;
-    for (e = 0; e < count; e++) {
-        qemu_cfg_read((void*)&LastFile, sizeof(LastFile));
-        u32 select = ntohs(LastFile.select);
-        if (select <= prevselect)
-            continue;
-        if (memcmp(prefix, LastFile.name, prefixlen) == 0)
-            return select;
+    if (!count)
+        return;
+    QemuCfgFile *files = malloc_tmphigh(count * sizeof(files[0]));
+    if (!files) {
+        warn_noalloc();
+        return;
     }
-    return 0;
+    qemu_cfg_read((void*)files, count * sizeof(files[0]));
+
+    // Insertion sort by name - the directory is small.
+    u32 i;
+    for (i = 0; i < count; i++) {
+        QemuCfgFile f = files[i];
+        f.size = ntohl(f.size);
+        f.select = ntohs(f.select);
+        f.name[sizeof(f.name) - 1] = '\0';
+        u32 j = i;
+        while (j && strcmp(files[j-1].name, f.name) > 0) {
+            files[j] = files[j-1];
+            j--;
+        }
+        files[j] = f;
+    }
+    CfgFiles = files;
+    CfgFileCount = count;
+    dprintf(3, "qemu_cfg: %d files\n", count);
 }
 
-u32 qemu_cfg_next_prefix_file(const char *prefix, u32 prevselect)
+// Return the index of the first file whose name is not below 'name'.
+static u32
+qemu_cfg_lower_bound(const char *name)
 {
-    return __cfg_next_prefix_file(prefix, strlen(prefix), prevselect);
+    u32 lo = 0, hi = CfgFileCount;
+    while (lo < hi) {
+        u32 mid = (lo + hi) / 2;
+        if (strcmp(CfgFiles[mid].name, name) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
 }
 
-u32 qemu_cfg_find_file(const char *name)
+static QemuCfgFile *
+qemu_cfg_get_file(u32 fileid)
 {
-    return __cfg_next_prefix_file(name, strlen(name) + 1, 0);
+    qemu_cfg_load_files();
+    if (!fileid || fileid > CfgFileCount)
+        return NULL;
+    return &CfgFiles[fileid - 1];
 }
 
-static int
-__qemu_cfg_set_file(u32 select)
+u32 qemu_cfg_next_prefix_file(const char *prefix, u32 previd)
 {
-    if (!qemu_cfg_present || !select)
-        return -1;
-    if (select == ntohs(LastFile.select))
+    qemu_cfg_load_files();
+    // Files with the same prefix are adjacent in the sorted list.
+    u32 idx = previd ? previd : qemu_cfg_lower_bound(prefix);
+    if (idx >= CfgFileCount
+        || memcmp(prefix, CfgFiles[idx].name, strlen(prefix)) != 0)
         return 0;
+    return idx + 1;
+}
 
-    u32 count;
-    qemu_cfg_read_entry(&count, QEMU_CFG_FILE_DIR, sizeof(count));
-    count = ntohl(count);
-    u32 e;
-    for (e = 0; e < count; e++) {
-        qemu_cfg_read((void*)&LastFile, sizeof(LastFile));
-        if (select == ntohs(LastFile.select))
-            return 0;
-    }
-    return -1;
+u32 qemu_cfg_find_file(const char *name)
+{
+    qemu_cfg_load_files();
+    u32 idx = qemu_cfg_lower_bound(name);
+    if (idx >= CfgFileCount || strcmp(CfgFiles[idx].name, name) != 0)
+        return 0;
+    return idx + 1;
 }
 
-int qemu_cfg_size_file(u32 select)
+int qemu_cfg_size_file(u32 fileid)
 {
-    if (__qemu_cfg_set_file(select))
+    QemuCfgFile *file = qemu_cfg_get_file(fileid);
+    if (!file)
         return -1;
-    return ntohl(LastFile.size);
+    return file->size;
 }
 
-const char* qemu_cfg_name_file(u32 select)
+const char* qemu_cfg_name_file(u32 fileid)
 {
-    if (__qemu_cfg_set_file(select))
+    QemuCfgFile *file = qemu_cfg_get_file(fileid);
+    if (!file)
         return NULL;
-    return LastFile.name;
+    return file->name;
 }
 
-int qemu_cfg_read_file(u32 select, void *dst, u32 maxlen)
+int qemu_cfg_read_file(u32 fileid, void *dst, u32 maxlen)
 {
-    if (__qemu_cfg_set_file(select))
+    QemuCfgFile *file = qemu_cfg_get_file(fileid);
+    if (!file || file->size > maxlen)
         return -1;
-    int len = qemu_cfg_size_file(select);
-    if (len < 0 || len > maxlen)
+    qemu_cfg_read_entry(dst, file->select, file->size);
+    return file->size;
+}
+
+// Read up to 'len' bytes at 'offset' of a file.  Sequential reads
+// continue from the currently selected position of the entry, so a
+// file can be processed in chunks without re-reading its start.
+int qemu_cfg_read_file_offset(u32 fileid, u32 offset, void *dst, u32 len)
+{
+    QemuCfgFile *file = qemu_cfg_get_file(fileid);
+    if (!file)
         return -1;
-    qemu_cfg_read_entry(dst, select, len);
+    if (offset >= file->size)
+        return 0;
+    if (len > file->size - offset)
+        len = file->size - offset;
+
+    if (CfgCursorFile != fileid || offset < CfgCursorPos) {
+        qemu_cfg_select(file->select);
+        CfgCursorFile = fileid;
+        CfgCursorPos = 0;
+    }
+    qemu_cfg_skip(offset - CfgCursorPos);
+    qemu_cfg_read(dst, len);
+    CfgCursorPos = offset + len;
     return len;
 }
 
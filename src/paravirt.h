@@ -39,6 +39,17 @@ static inline int kvm_para_available(void)
 #define QEMU_CFG_IRQ0_OVERRIDE		(QEMU_CFG_ARCH_LOCAL + 2)
 #define QEMU_CFG_E820_TABLE		(QEMU_CFG_ARCH_LOCAL + 3)
 
+// QEMU_CFG_ID feature bits
+#define QEMU_CFG_VERSION_TRADITIONAL	0x01
+#define QEMU_CFG_VERSION_DMA		0x02
+
+// QemuCfgDmaAccess control bits
+#define QEMU_CFG_DMA_CTL_ERROR		0x01
+#define QEMU_CFG_DMA_CTL_READ		0x02
+#define QEMU_CFG_DMA_CTL_SKIP		0x04
+#define QEMU_CFG_DMA_CTL_SELECT		0x08
+#define QEMU_CFG_DMA_CTL_WRITE		0x10
+
 extern int qemu_cfg_present;
 
 void qemu_cfg_port_probe(void);
@@ -63,17 +74,25 @@ typedef struct QemuCfgFile {
     char name[56];
 } QemuCfgFile;
 
+// Descriptor for a fw_cfg dma transfer (all fields are big-endian).
+typedef struct QemuCfgDmaAccess {
+    u32 control;
+    u32 length;
+    u64 address;
+} PACKED QemuCfgDmaAccess;
+
 struct e820_reservation {
     u64 address;
     u64 length;
     u32 type;
 };
 
-u32 qemu_cfg_next_prefix_file(const char *prefix, u32 prevselect);
+u32 qemu_cfg_next_prefix_file(const char *prefix, u32 previd);
 u32 qemu_cfg_find_file(const char *name);
-int qemu_cfg_size_file(u32 select);
-const char* qemu_cfg_name_file(u32 select);
-int qemu_cfg_read_file(u32 select, void *dst, u32 maxlen);
+int qemu_cfg_size_file(u32 fileid);
+const char* qemu_cfg_name_file(u32 fileid);
+int qemu_cfg_read_file(u32 fileid, void *dst, u32 maxlen);
+int qemu_cfg_read_file_offset(u32 fileid, u32 offset, void *dst, u32 len);
 
 // Wrappers that select cbfs or qemu_cfg file interface.
 static inline u32 romfile_findprefix(const char *prefix, u32 previd) {
@@ -96,6 +115,13 @@ static inline int romfile_copy(u32 fileid, void *dst, u32 maxlen) {
         return cbfs_copyfile((void*)fileid, dst, maxlen);
     return qemu_cfg_read_file(fileid, dst, maxlen);
 }
+// Read up to 'len' bytes of a file starting at 'offset'.  Returns the
+// number of bytes read (zero at end of file) or -1 on error.
+static inline int romfile_read(u32 fileid, u32 offset, void *dst, u32 len) {
+    if (CONFIG_COREBOOT)
+        return cbfs_readfile((void*)fileid, offset, dst, len);
+    return qemu_cfg_read_file_offset(fileid, offset, dst, len);
+}
 static inline const char* romfile_name(u32 fileid) {
     if (CONFIG_COREBOOT)
         return cbfs_filename((void*)fileid);
@@ -57,6 +57,28 @@ pci_config_maskw(u16 bdf, u32 addr, u16 off, u16 on)
     pci_config_writew(bdf, addr, val);
 }
 
+// Return the offset of the next capability with the given id after
+// 'cap' (or the first one if 'cap' is zero), or zero if none is found.
+u8 pci_find_capability(u16 bdf, u8 cap_id, u8 cap)
+{
+    int i;
+
+    if (!cap) {
+        if (!(pci_config_readw(bdf, PCI_STATUS) & PCI_STATUS_CAP_LIST))
+            return 0;
+        cap = pci_config_readb(bdf, PCI_CAPABILITY_LIST);
+    } else {
+        cap = pci_config_readb(bdf, cap + PCI_CAP_LIST_NEXT);
+    }
+    for (i = 0; cap && i <= 0xff; i++) {
+        if (pci_config_readb(bdf, cap + PCI_CAP_LIST_ID) == cap_id)
+            return cap;
+        cap = pci_config_readb(bdf, cap + PCI_CAP_LIST_NEXT);
+    }
+
+    return 0;
+}
+
 // Helper function for foreachbdf() macro - return next device
 int
 pci_next(int bdf, int bus)
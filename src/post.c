@@ -269,6 +269,8 @@ maininit(void)
 
     // Finalize data structures before boot
     cdemu_setup();
+    block_cache_setup();
+    block_readahead_setup();
     pmm_finalize();
     malloc_finalize();
     memmap_finalize();
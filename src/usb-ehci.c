@@ -69,16 +69,6 @@ ehci_hub_detect(struct usbhub_s *hub, u32 port)
     u32 *portreg = &cntl->regs->portsc[port];
     u32 portsc = readl(portreg);
 
-    // Power up port.
-    if (!(portsc & PORT_POWER)) {
-        portsc |= PORT_POWER;
-        writel(portreg, portsc);
-        msleep(EHCI_TIME_POSTPOWER);
-    } else {
-        msleep(1); // XXX - time for connect to be detected.
-    }
-    portsc = readl(portreg);
-
     if (!(portsc & PORT_CONNECT))
         // No device present
         goto doneearly;
@@ -155,6 +145,21 @@ static int
 check_ehci_ports(struct usb_ehci_s *cntl)
 {
     ASSERT32FLAT();
+    // Power up all ports at once.
+    int port, powered = 0;
+    for (port=0; port<cntl->checkports; port++) {
+        u32 *portreg = &cntl->regs->portsc[port];
+        u32 portsc = readl(portreg);
+        if (!(portsc & PORT_POWER)) {
+            writel(portreg, portsc | PORT_POWER);
+            powered = 1;
+        }
+    }
+    if (powered)
+        msleep(EHCI_TIME_POSTPOWER);
+    else
+        msleep(1); // XXX - time for connect to be detected.
+
     struct usbhub_s hub;
     memset(&hub, 0, sizeof(hub));
     hub.cntl = &cntl->usb;
@@ -303,6 +308,9 @@ ehci_init(struct pci_device *pci, int busid, struct pci_device *comppci)
  * End point communication
  ****************************************************************/
 
+// Number of tds preallocated for each bulk pipe.
+#define EHCI_BULK_QTDS 16
+
 struct ehci_pipe {
     struct ehci_qh qh;
     struct ehci_qtd *next_td, *tds;
@@ -361,15 +369,21 @@ ehci_reset_pipe(struct ehci_pipe *pipe)
     SET_FLATPTR(pipe->qh.token, GET_FLATPTR(pipe->qh.token) & QTD_TOGGLE);
 }
 
+// Wait for a td (and every td queued before it) to complete.
 static int
 ehci_wait_td(struct ehci_pipe *pipe, struct ehci_qtd *td, int timeout)
 {
     u64 end = calc_future_tsc(timeout);
     u32 status;
     for (;;) {
-        status = td->token;
+        status = GET_FLATPTR(td->token);
         if (!(status & QTD_STS_ACTIVE))
             break;
+        if (GET_FLATPTR(pipe->qh.token) & QTD_STS_HALT) {
+            // An earlier td in the chain failed.
+            status = GET_FLATPTR(pipe->qh.token);
+            break;
+        }
         if (check_tsc(end)) {
             u32 cur = GET_FLATPTR(pipe->qh.current);
             u32 tok = GET_FLATPTR(pipe->qh.token);
@@ -415,6 +429,7 @@ ehci_free_pipe(struct usb_pipe *p)
         if (next == &pipe->qh) {
             pos->next = next->next;
             ehci_waittick(cntl);
+            free(pipe->tds);
             free(pipe);
             return;
         }
@@ -422,6 +437,17 @@ ehci_free_pipe(struct usb_pipe *p)
     }
 }
 
+// Restart the data toggle of a bulk pipe at DATA0 (after the device
+// endpoint was reset).  The qh is idle between transfers.
+void
+ehci_reset_toggle(struct usb_pipe *p)
+{
+    if (! CONFIG_USB_EHCI)
+        return;
+    struct ehci_pipe *pipe = container_of(p, struct ehci_pipe, pipe);
+    SET_FLATPTR(pipe->qh.token, GET_FLATPTR(pipe->qh.token) & ~QTD_TOGGLE);
+}
+
 struct usb_pipe *
 ehci_alloc_control_pipe(struct usb_pipe *dummy)
 {
@@ -449,13 +475,14 @@ ehci_alloc_control_pipe(struct usb_pipe *dummy)
     return &pipe->pipe;
 }
 
+// Point the td buffer pages at 'buf' - a td covers up to five 4K pages.
 static int
 fillTDbuffer(struct ehci_qtd *td, u16 maxpacket, const void *buf, int bytes)
 {
     u32 dest = (u32)buf;
-    u32 *pos = td->buf;
+    int i = 0;
     while (bytes) {
-        if (pos >= &td->buf[ARRAY_SIZE(td->buf)])
+        if (i >= ARRAY_SIZE(td->buf))
             // More data than can transfer in a single qtd - only use
             // full packets to prevent a babble error.
             return ALIGN_DOWN(dest - (u32)buf, maxpacket);
@@ -463,10 +490,10 @@ fillTDbuffer(struct ehci_qtd *td, u16 maxpacket, const void *buf, int bytes)
         u32 max = 0x1000 - (dest & 0xfff);
         if (count > max)
             count = max;
-        *pos = dest;
+        SET_FLATPTR(td->buf[i], dest);
         bytes -= count;
         dest += count;
-        pos++;
+        i++;
     }
     return dest - (u32)buf;
 }
@@ -556,15 +583,21 @@ ehci_alloc_bulk_pipe(struct usb_pipe *dummy)
         dummy->cntl, struct usb_ehci_s, usb);
     dprintf(7, "ehci_alloc_bulk_pipe %p\n", &cntl->usb);
 
-    // Allocate a queue head.
+    // Allocate a queue head and its ring of transfer descriptors.
     struct ehci_pipe *pipe = memalign_low(EHCI_QH_ALIGN, sizeof(*pipe));
-    if (!pipe) {
+    struct ehci_qtd *tds = memalign_low(EHCI_QTD_ALIGN
+                                        , sizeof(*tds) * EHCI_BULK_QTDS);
+    if (!pipe || !tds) {
         warn_noalloc();
+        free(pipe);
+        free(tds);
         return NULL;
     }
     memset(pipe, 0, sizeof(*pipe));
+    memset(tds, 0, sizeof(*tds) * EHCI_BULK_QTDS);
     memcpy(&pipe->pipe, dummy, sizeof(pipe->pipe));
     pipe->qh.qtd_next = pipe->qh.alt_next = EHCI_PTR_TERM;
+    pipe->tds = tds;
 
     // Add queue head to controller list.
     struct ehci_qh *async_qh = cntl->async_qh;
@@ -574,8 +607,6 @@ ehci_alloc_bulk_pipe(struct usb_pipe *dummy)
     return &pipe->pipe;
 }
 
-#define STACKQTDS 4
-
 int
 ehci_send_bulk(struct usb_pipe *p, int dir, void *data, int datasize)
 {
@@ -585,11 +616,6 @@ ehci_send_bulk(struct usb_pipe *p, int dir, void *data, int datasize)
     dprintf(7, "ehci_send_bulk qh=%p dir=%d data=%p size=%d\n"
             , &pipe->qh, dir, data, datasize);
 
-    // Allocate 4 tds on stack (16byte aligned)
-    u8 tdsbuf[sizeof(struct ehci_qtd) * STACKQTDS + EHCI_QTD_ALIGN - 1];
-    struct ehci_qtd *tds = (void*)ALIGN((u32)tdsbuf, EHCI_QTD_ALIGN);
-    memset(tds, 0, sizeof(*tds) * STACKQTDS);
-
     // Setup fields in qh
     u16 maxpacket = GET_FLATPTR(pipe->pipe.maxpacket);
     SET_FLATPTR(pipe->qh.info1
@@ -602,32 +628,28 @@ ehci_send_bulk(struct usb_pipe *p, int dir, void *data, int datasize)
                 , ((1 << QH_MULT_SHIFT)
                    | (GET_FLATPTR(pipe->pipe.tt_port) << QH_HUBPORT_SHIFT)
                    | (GET_FLATPTR(pipe->pipe.tt_devaddr) << QH_HUBADDR_SHIFT)));
-    barrier();
-    SET_FLATPTR(pipe->qh.qtd_next, (u32)MAKE_FLATPTR(GET_SEG(SS), tds));
 
-    int tdpos = 0;
+    // Queue as much of the transfer as the td ring holds, start it,
+    // and only wait for the last td of the batch.
+    struct ehci_qtd *tds = GET_FLATPTR(pipe->tds);
     while (datasize) {
-        struct ehci_qtd *td = &tds[tdpos++ % STACKQTDS];
-        int ret = ehci_wait_td(pipe, td, 5000);
-        if (ret)
-            return -1;
-
-        struct ehci_qtd *nexttd_fl = MAKE_FLATPTR(GET_SEG(SS)
-                                                 , &tds[tdpos % STACKQTDS]);
-
-        int transfer = fillTDbuffer(td, maxpacket, data, datasize);
-        td->qtd_next = (transfer==datasize ? EHCI_PTR_TERM : (u32)nexttd_fl);
-        td->alt_next = EHCI_PTR_TERM;
+        int tdpos = 0;
+        struct ehci_qtd *td = NULL;
+        while (datasize && tdpos < EHCI_BULK_QTDS) {
+            td = &tds[tdpos++];
+            int transfer = fillTDbuffer(td, maxpacket, data, datasize);
+            data += transfer;
+            datasize -= transfer;
+            SET_FLATPTR(td->qtd_next, ((datasize && tdpos < EHCI_BULK_QTDS)
+                                       ? (u32)&tds[tdpos] : EHCI_PTR_TERM));
+            SET_FLATPTR(td->alt_next, EHCI_PTR_TERM);
+            SET_FLATPTR(td->token, (ehci_explen(transfer) | QTD_STS_ACTIVE
+                                    | (dir ? QTD_PID_IN : QTD_PID_OUT)
+                                    | ehci_maxerr(3)));
+        }
         barrier();
-        td->token = (ehci_explen(transfer) | QTD_STS_ACTIVE
-                     | (dir ? QTD_PID_IN : QTD_PID_OUT) | ehci_maxerr(3));
+        SET_FLATPTR(pipe->qh.qtd_next, (u32)tds);
 
-        data += transfer;
-        datasize -= transfer;
-    }
-    int i;
-    for (i=0; i<STACKQTDS; i++) {
-        struct ehci_qtd *td = &tds[tdpos++ % STACKQTDS];
         int ret = ehci_wait_td(pipe, td, 5000);
         if (ret)
             return -1;
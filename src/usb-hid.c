@@ -275,22 +275,27 @@ handle_key(struct keyevent *data)
 }
 
 // Check if a USB keyboard event is pending and process it if so.
-static void
+// Returns non-zero if a key is held down.
+static int
 usb_check_key(void)
 {
     if (! CONFIG_USB_KEYBOARD)
-        return;
+        return 0;
     struct usb_pipe *pipe = GET_GLOBAL(keyboard_pipe);
     if (!pipe)
-        return;
+        return 0;
 
+    int active = 0;
     for (;;) {
         struct keyevent data;
         int ret = usb_poll_intr(pipe, &data);
         if (ret)
             break;
+        if (data.modifiers || data.keys[0])
+            active = 1;
         handle_key(&data);
     }
+    return active;
 }
 
 // Test if USB keyboard is active.
@@ -347,22 +352,27 @@ handle_mouse(struct mouseevent *data)
 }
 
 // Check if a USB mouse event is pending and process it if so.
-static void
+// Returns non-zero if the mouse moved or a button is held down.
+static int
 usb_check_mouse(void)
 {
     if (! CONFIG_USB_MOUSE)
-        return;
+        return 0;
     struct usb_pipe *pipe = GET_GLOBAL(mouse_pipe);
     if (!pipe)
-        return;
+        return 0;
 
+    int active = 0;
     for (;;) {
         struct mouseevent data;
         int ret = usb_poll_intr(pipe, &data);
         if (ret)
             break;
+        if (data.buttons || data.x || data.y)
+            active = 1;
         handle_mouse(&data);
     }
+    return active;
 }
 
 // Test if USB mouse is active.
@@ -409,10 +419,29 @@ usb_mouse_command(int command, u8 *param)
     }
 }
 
+// Once no key or mouse activity has been seen for USBHID_IDLE_TICKS
+// timer ticks (about one second), the devices are only polled on
+// every USBHID_IDLE_INTERVAL'th tick.
+#define USBHID_IDLE_TICKS 18
+#define USBHID_IDLE_INTERVAL 4
+
 // Check for USB events pending - called periodically from timer interrupt.
 void
 usb_check_event(void)
 {
-    usb_check_key();
-    usb_check_mouse();
+    if (!usb_kbd_active() && !usb_mouse_active())
+        return;
+
+    u16 ebda_seg = get_ebda_seg();
+    u8 idle = GET_EBDA2(ebda_seg, usbhid_idle);
+    if (idle >= USBHID_IDLE_TICKS
+        && GET_BDA(timer_counter) % USBHID_IDLE_INTERVAL)
+        return;
+
+    int active = usb_check_key();
+    active |= usb_check_mouse();
+    if (active)
+        SET_EBDA2(ebda_seg, usbhid_idle, 0);
+    else if (idle < USBHID_IDLE_TICKS)
+        SET_EBDA2(ebda_seg, usbhid_idle, idle + 1);
 }
@@ -70,32 +70,24 @@ get_port_status(struct usbhub_s *hub, int port, struct usb_port_status *sts)
 static int
 usb_hub_detect(struct usbhub_s *hub, u32 port)
 {
-    // Turn on power to port.
-    int ret = set_port_feature(hub, port, USB_PORT_FEAT_POWER);
-    if (ret)
-        goto fail;
-
-    // Wait for port power to stabilize.
-    msleep(hub->powerwait);
-
     // Check periodically for a device connect.
     struct usb_port_status sts;
-    u64 end = calc_future_tsc(USB_TIME_SIGATT);
     for (;;) {
-        ret = get_port_status(hub, port, &sts);
+        int ret = get_port_status(hub, port, &sts);
         if (ret)
             goto fail;
         if (sts.wPortStatus & USB_PORT_STAT_CONNECTION)
             // Device connected.
             break;
-        if (check_tsc(end))
+        if (check_tsc(hub->detectend))
             // No device found.
             return -1;
         msleep(5);
     }
 
-    // XXX - wait USB_TIME_ATTDB time?
-
+    // Wait for the connection to debounce (in parallel with the
+    // other ports of the hub).
+    msleep(USB_TIME_ATTDB);
     return 0;
 
 fail:
@@ -176,6 +168,16 @@ usb_hub_init(struct usb_pipe *pipe)
     hub.powerwait = desc.bPwrOn2PwrGood * 2;
     hub.portcount = desc.bNbrPorts;
     hub.op = &HubOp;
+
+    // Turn on power to all ports and wait once for it to stabilize.
+    int port;
+    for (port=0; port<hub.portcount; port++) {
+        ret = set_port_feature(&hub, port, USB_PORT_FEAT_POWER);
+        if (ret)
+            dprintf(1, "Failure on hub port %d power\n", port);
+    }
+    msleep(hub.powerwait);
+
     usb_enumerate(&hub);
 
     dprintf(1, "Initialized USB HUB (%d ports used)\n", hub.devcount);
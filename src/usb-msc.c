@@ -13,9 +13,20 @@
 #include "disk.h" // DTYPE_USB
 #include "boot.h" // boot_add_hd
 
+// State shared by the luns of a device.  It is in low memory because
+// the command tag is updated at runtime.
+struct usbmsc_s {
+    struct usb_pipe *ctrl; // default control pipe (only during init)
+    u32 tag;
+    u8 iface;
+};
+
 struct usbdrive_s {
     struct drive_s drive;
     struct usb_pipe *bulkin, *bulkout;
+    struct usbmsc_s *msc;
+    u16 maxblocks; // largest transfer the lun accepts (0 if unlimited)
+    u8 lun;
 };
 
 
@@ -57,62 +68,125 @@ usb_msc_send(struct usbdrive_s *udrive_g, int dir, void *buf, u32 bytes)
     return usb_send_bulk(pipe, dir, buf, bytes);
 }
 
-// Low-level usb command transmit function.
-int
-usb_cmd_data(struct disk_op_s *op, void *cdbcmd, u16 blocksize)
+// Bulk-only mass storage reset recovery - resets the device's command
+// state and clears any halt of the bulk endpoints.  This needs the
+// default control pipe, so it is only available during init.
+static void
+usb_msc_reset(struct usbdrive_s *udrive_g)
 {
-    if (!CONFIG_USB_MSC)
-        return 0;
-
-    dprintf(16, "usb_cmd_data id=%p write=%d count=%d bs=%d buf=%p\n"
-            , op->drive_g, 0, op->count, blocksize, op->buf_fl);
-    struct usbdrive_s *udrive_g = container_of(
-        op->drive_g, struct usbdrive_s, drive);
+    ASSERT32FLAT();
+    struct usbmsc_s *msc = udrive_g->msc;
+    if (!msc->ctrl)
+        return;
+    dprintf(1, "USB MSC reset recovery\n");
+    struct usb_ctrlrequest req;
+    req.bRequestType = USB_DIR_OUT | USB_TYPE_CLASS | USB_RECIP_INTERFACE;
+    req.bRequest = US_REQ_BOT_RESET;
+    req.wValue = 0;
+    req.wIndex = msc->iface;
+    req.wLength = 0;
+    int ret = send_default_control(msc->ctrl, &req, NULL);
+    if (ret)
+        return;
+    usb_clear_halt(msc->ctrl, udrive_g->bulkin);
+    usb_clear_halt(msc->ctrl, udrive_g->bulkout);
+}
 
+// Transfer one command (cbw, data and csw) to the device.
+static int
+usb_msc_command(struct usbdrive_s *udrive_g, void *cdbcmd, int dir
+                , void *buf, u32 bytes, u32 *residue)
+{
     // Setup command block wrapper.
-    u32 bytes = blocksize * op->count;
+    struct usbmsc_s *msc = GET_GLOBAL(udrive_g->msc);
+    u32 tag = GET_FLATPTR(msc->tag) + 1;
+    SET_FLATPTR(msc->tag, tag);
     struct cbw_s cbw;
     memset(&cbw, 0, sizeof(cbw));
     memcpy(cbw.CBWCB, cdbcmd, USB_CDB_SIZE);
     cbw.dCBWSignature = CBW_SIGNATURE;
-    cbw.dCBWTag = 999; // XXX
+    cbw.dCBWTag = tag;
     cbw.dCBWDataTransferLength = bytes;
-    cbw.bmCBWFlags = (cbw.CBWCB[0] == CDB_CMD_WRITE_10) ? USB_DIR_OUT : USB_DIR_IN;
-    cbw.bCBWLUN = 0; // XXX
+    cbw.bmCBWFlags = dir;
+    cbw.bCBWLUN = GET_GLOBAL(udrive_g->lun);
     cbw.bCBWCBLength = USB_CDB_SIZE;
 
     // Transfer cbw to device.
     int ret = usb_msc_send(udrive_g, USB_DIR_OUT
-                            , MAKE_FLATPTR(GET_SEG(SS), &cbw), sizeof(cbw));
+                           , MAKE_FLATPTR(GET_SEG(SS), &cbw), sizeof(cbw));
     if (ret)
-        goto fail;
+        return -1;
 
     // Transfer data to/from device.
     if (bytes) {
-        ret = usb_msc_send(udrive_g, cbw.bmCBWFlags, op->buf_fl, bytes);
+        ret = usb_msc_send(udrive_g, dir, buf, bytes);
         if (ret)
-            goto fail;
+            return -1;
     }
 
     // Transfer csw info.
     struct csw_s csw;
     ret = usb_msc_send(udrive_g, USB_DIR_IN
-                        , MAKE_FLATPTR(GET_SEG(SS), &csw), sizeof(csw));
-    if (ret)
-        goto fail;
+                       , MAKE_FLATPTR(GET_SEG(SS), &csw), sizeof(csw));
+    if (ret || csw.dCSWSignature != CSW_SIGNATURE || csw.dCSWTag != tag
+        || csw.bCSWStatus > 1)
+        // Phase error
+        return -1;
+    *residue = csw.dCSWDataResidue;
+    return csw.bCSWStatus;
+}
 
-    if (!csw.bCSWStatus)
-        return DISK_RET_SUCCESS;
-    if (csw.bCSWStatus == 2)
-        goto fail;
+// Low-level usb command transmit function.
+int
+usb_cmd_data(struct disk_op_s *op, void *cdbcmd, u16 blocksize)
+{
+    if (!CONFIG_USB_MSC)
+        return 0;
 
-    if (blocksize)
-        op->count -= csw.dCSWDataResidue / blocksize;
-    return DISK_RET_EBADTRACK;
+    dprintf(16, "usb_cmd_data id=%p write=%d count=%d bs=%d buf=%p\n"
+            , op->drive_g, 0, op->count, blocksize, op->buf_fl);
+    struct usbdrive_s *udrive_g = container_of(
+        op->drive_g, struct usbdrive_s, drive);
+    struct cdb_rwdata_10 *cmd = cdbcmd;
+    int dir = (cmd->command == CDB_CMD_WRITE_10) ? USB_DIR_OUT : USB_DIR_IN;
+
+    // Issue reads and writes larger than the lun accepts in pieces.
+    u16 maxblocks = GET_GLOBAL(udrive_g->maxblocks);
+    u16 count = op->count, done = 0;
+    int split = (maxblocks && count > maxblocks
+                 && (cmd->command == CDB_CMD_READ_10
+                     || cmd->command == CDB_CMD_WRITE_10));
+    u32 lba = ntohl(cmd->lba);
+    void *buf = op->buf_fl;
+    for (;;) {
+        u16 blocks = count - done;
+        if (split) {
+            if (blocks > maxblocks)
+                blocks = maxblocks;
+            cmd->lba = htonl(lba + done);
+            cmd->count = htons(blocks);
+        }
+        u32 residue = 0;
+        int ret = usb_msc_command(udrive_g, cmd, dir, buf
+                                  , blocksize * blocks, &residue);
+        if (ret < 0)
+            goto fail;
+        if (ret) {
+            // Command failed
+            if (blocksize)
+                op->count = done + blocks - residue / blocksize;
+            return DISK_RET_EBADTRACK;
+        }
+        done += blocks;
+        if (done >= count)
+            return DISK_RET_SUCCESS;
+        buf += blocksize * blocks;
+    }
 
 fail:
-    // XXX - reset connection
     dprintf(1, "USB transmission failed\n");
+    if (!MODESEGMENT)
+        usb_msc_reset(udrive_g);
     op->count = 0;
     return DISK_RET_EBADTRACK;
 }
@@ -136,10 +210,8 @@ setup_drive_cdrom(struct drive_s *drive, char *desc)
 static int
 setup_drive_hd(struct drive_s *drive, char *desc)
 {
-    if (drive->blksize != DISK_SECTOR_SIZE) {
-        dprintf(1, "Unsupported USB MSC block size %d\n", drive->blksize);
+    if (blkemu_init(drive) < 0)
         return -1;
-    }
 
     // Register with bcv system.
     struct usb_pipe *pipe = container_of(
@@ -149,6 +221,91 @@ setup_drive_hd(struct drive_s *drive, char *desc)
     return 0;
 }
 
+// Ask the device for its highest lun number.  Devices with a single
+// lun may stall the request.
+static int
+usb_msc_maxlun(struct usb_pipe *pipe, struct usb_interface_descriptor *iface)
+{
+    struct usb_ctrlrequest req;
+    req.bRequestType = USB_DIR_IN | USB_TYPE_CLASS | USB_RECIP_INTERFACE;
+    req.bRequest = US_REQ_GET_MAX_LUN;
+    req.wValue = 0;
+    req.wIndex = iface->bInterfaceNumber;
+    req.wLength = 1;
+    u8 maxlun = 0;
+    int ret = send_default_control(pipe, &req, &maxlun);
+    if (ret || maxlun > 15)
+        return 0;
+    return maxlun;
+}
+
+// Find the largest transfer a disk lun accepts from its block limits.
+static void
+usb_msc_maxblocks(struct usbdrive_s *udrive_g, int version)
+{
+    // Only devices claiming SPC-3 or later (inquiry version 5) are asked
+    // for the vital product data page - older ones may not cope with it.
+    if (version < 5)
+        return;
+    struct disk_op_s dop;
+    memset(&dop, 0, sizeof(dop));
+    dop.drive_g = &udrive_g->drive;
+    struct cdbres_block_limits limits;
+    memset(&limits, 0, sizeof(limits));
+    int ret = cdb_get_block_limits(&dop, &limits);
+    if (ret)
+        return;
+    u32 maxblocks = ntohl(limits.max_transfer);
+    if (maxblocks && maxblocks < 0xffff) {
+        dprintf(3, "USB MSC lun %d max transfer %d blocks\n"
+                , udrive_g->lun, maxblocks);
+        udrive_g->maxblocks = maxblocks;
+    }
+}
+
+// Configure one lun of a usb msc device.
+static int
+usb_msc_lun_init(struct usb_pipe *bulkin, struct usb_pipe *bulkout
+                 , struct usbmsc_s *msc, int lun, int maxlun)
+{
+    // Allocate drive structure.
+    struct usbdrive_s *udrive_g = malloc_fseg(sizeof(*udrive_g));
+    if (!udrive_g) {
+        warn_noalloc();
+        return -1;
+    }
+    memset(udrive_g, 0, sizeof(*udrive_g));
+    udrive_g->drive.type = DTYPE_USB;
+    udrive_g->bulkin = bulkin;
+    udrive_g->bulkout = bulkout;
+    udrive_g->msc = msc;
+    udrive_g->lun = lun;
+
+    char name[16] = "USB MSC";
+    if (maxlun)
+        snprintf(name, sizeof(name), "USB MSC LUN %d", lun);
+    int ret, pdt, version;
+    char *desc = NULL;
+    ret = scsi_init_drive(&udrive_g->drive, name, &pdt, &desc, &version);
+    if (ret)
+        goto fail;
+
+    if (pdt == SCSI_TYPE_CDROM) {
+        ret = setup_drive_cdrom(&udrive_g->drive, desc);
+    } else {
+        usb_msc_maxblocks(udrive_g, version);
+        ret = setup_drive_hd(&udrive_g->drive, desc);
+    }
+    if (ret)
+        goto fail;
+
+    return 0;
+fail:
+    dprintf(1, "Unable to configure USB MSC lun %d.\n", lun);
+    free(udrive_g);
+    return -1;
+}
+
 // Configure a usb msc device.
 int
 usb_msc_init(struct usb_pipe *pipe
@@ -167,44 +324,43 @@ usb_msc_init(struct usb_pipe *pipe
         return -1;
     }
 
-    // Allocate drive structure.
-    struct usbdrive_s *udrive_g = malloc_fseg(sizeof(*udrive_g));
-    if (!udrive_g) {
+    // Find bulk in and bulk out endpoints.
+    struct usb_pipe *bulkin = NULL, *bulkout = NULL;
+    struct usbmsc_s *msc = malloc_low(sizeof(*msc));
+    if (!msc) {
         warn_noalloc();
         goto fail;
     }
-    memset(udrive_g, 0, sizeof(*udrive_g));
-    udrive_g->drive.type = DTYPE_USB;
-
-    // Find bulk in and bulk out endpoints.
+    memset(msc, 0, sizeof(*msc));
+    msc->ctrl = pipe;
+    msc->iface = iface->bInterfaceNumber;
     struct usb_endpoint_descriptor *indesc = findEndPointDesc(
         iface, imax, USB_ENDPOINT_XFER_BULK, USB_DIR_IN);
     struct usb_endpoint_descriptor *outdesc = findEndPointDesc(
         iface, imax, USB_ENDPOINT_XFER_BULK, USB_DIR_OUT);
     if (!indesc || !outdesc)
         goto fail;
-    udrive_g->bulkin = alloc_bulk_pipe(pipe, indesc);
-    udrive_g->bulkout = alloc_bulk_pipe(pipe, outdesc);
-    if (!udrive_g->bulkin || !udrive_g->bulkout)
+    bulkin = alloc_bulk_pipe(pipe, indesc);
+    bulkout = alloc_bulk_pipe(pipe, outdesc);
+    if (!bulkin || !bulkout)
         goto fail;
 
-    int ret, pdt;
-    char *desc = NULL;
-    ret = scsi_init_drive(&udrive_g->drive, "USB MSC", &pdt, &desc);
-    if (ret)
-        goto fail;
-
-    if (pdt == SCSI_TYPE_CDROM)
-        ret = setup_drive_cdrom(&udrive_g->drive, desc);
-    else
-        ret = setup_drive_hd(&udrive_g->drive, desc);
-
-    if (ret)
+    // Register a drive for each lun.
+    int maxlun = usb_msc_maxlun(pipe, iface);
+    int lun, count = 0;
+    for (lun = 0; lun <= maxlun; lun++)
+        if (!usb_msc_lun_init(bulkin, bulkout, msc, lun, maxlun))
+            count++;
+    // The control pipe is released once the device is configured.
+    msc->ctrl = NULL;
+    if (!count)
         goto fail;
 
     return 0;
 fail:
     dprintf(1, "Unable to configure USB MSC device.\n");
-    free(udrive_g);
+    free_pipe(bulkin);
+    free_pipe(bulkout);
+    free(msc);
     return -1;
 }
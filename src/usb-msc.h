@@ -20,5 +20,9 @@ int process_usb_op(struct disk_op_s *op);
 #define US_SC_SCSI         0x06
 
 #define US_PR_BULK         0x50
+#define US_PR_UAS          0x62
+
+#define US_REQ_GET_MAX_LUN 0xfe
+#define US_REQ_BOT_RESET   0xff
 
 #endif // ush-msc.h
@@ -11,6 +11,7 @@
 #include "pci_regs.h" // PCI_BASE_ADDRESS_0
 #include "usb.h" // struct usb_s
 #include "farptr.h" // GET_FLATPTR
+#include "memmap.h" // PAGE_SIZE
 
 #define FIT                     (1 << 31)
 
@@ -152,7 +153,7 @@ start_ohci(struct usb_ohci_s *cntl, struct ohci_hcca *hcca)
 
     // Go into operational state
     writel(&cntl->regs->control
-           , (OHCI_CTRL_CBSR | OHCI_CTRL_CLE | OHCI_CTRL_PLE
+           , (OHCI_CTRL_CBSR | OHCI_CTRL_CLE | OHCI_CTRL_BLE | OHCI_CTRL_PLE
               | OHCI_USB_OPER | oldrwc));
     readl(&cntl->regs->control); // flush writes
 
@@ -294,14 +295,35 @@ signal_freelist(struct usb_ohci_s *cntl)
     }
 }
 
+// Number of tds preallocated for each bulk pipe (each covers up to 8K).
+#define OHCI_BULK_TDS 16
+
 struct ohci_pipe {
     struct ohci_ed ed;
     struct usb_pipe pipe;
+    struct ohci_regs *regs;
     void *data;
     int count;
     struct ohci_td *tds;
 };
 
+// Remove an ed from a control or bulk list - returns 0 if found.
+static int
+ohci_unlink_ed(struct usb_ohci_s *cntl, u32 *pos, struct ohci_ed *ed)
+{
+    for (;;) {
+        struct ohci_ed *next = (void*)*pos;
+        if (!next)
+            return -1;
+        if (next == ed) {
+            *pos = next->hwNextED;
+            signal_freelist(cntl);
+            return 0;
+        }
+        pos = &next->hwNextED;
+    }
+}
+
 void
 ohci_free_pipe(struct usb_pipe *p)
 {
@@ -312,22 +334,25 @@ ohci_free_pipe(struct usb_pipe *p)
     struct usb_ohci_s *cntl = container_of(
         pipe->pipe.cntl, struct usb_ohci_s, usb);
 
-    u32 *pos = &cntl->regs->ed_controlhead;
-    for (;;) {
-        struct ohci_ed *next = (void*)*pos;
-        if (!next) {
-            // Not found?!  Exit without freeing.
-            warn_internalerror();
-            return;
-        }
-        if (next == &pipe->ed) {
-            *pos = next->hwNextED;
-            signal_freelist(cntl);
-            free(pipe);
-            return;
-        }
-        pos = &next->hwNextED;
+    if (ohci_unlink_ed(cntl, &cntl->regs->ed_controlhead, &pipe->ed)
+        && ohci_unlink_ed(cntl, &cntl->regs->ed_bulkhead, &pipe->ed)) {
+        // Not found?!  Exit without freeing.
+        warn_internalerror();
+        return;
     }
+    free(pipe->tds);
+    free(pipe);
+}
+
+// Restart the data toggle of a bulk pipe at DATA0 (after the device
+// endpoint was reset).  The ed is idle between transfers.
+void
+ohci_reset_toggle(struct usb_pipe *p)
+{
+    if (! CONFIG_USB_OHCI)
+        return;
+    struct ohci_pipe *pipe = container_of(p, struct ohci_pipe, pipe);
+    SET_FLATPTR(pipe->ed.hwHeadP, GET_FLATPTR(pipe->ed.hwHeadP) & ~ED_C);
 }
 
 struct usb_pipe *
@@ -422,13 +447,132 @@ ohci_alloc_bulk_pipe(struct usb_pipe *dummy)
 {
     if (! CONFIG_USB_OHCI)
         return NULL;
-    dprintf(1, "OHCI Bulk transfers not supported.\n");
-    return NULL;
+    struct usb_ohci_s *cntl = container_of(
+        dummy->cntl, struct usb_ohci_s, usb);
+    dprintf(7, "ohci_alloc_bulk_pipe %p\n", &cntl->usb);
+
+    // Allocate an endpoint descriptor and its ring of transfer
+    // descriptors (plus the dummy td that terminates the ring).
+    struct ohci_pipe *pipe = malloc_low(sizeof(*pipe));
+    struct ohci_td *tds = malloc_low(sizeof(*tds) * (OHCI_BULK_TDS + 1));
+    if (!pipe || !tds) {
+        warn_noalloc();
+        free(pipe);
+        free(tds);
+        return NULL;
+    }
+    memset(pipe, 0, sizeof(*pipe));
+    memset(tds, 0, sizeof(*tds) * (OHCI_BULK_TDS + 1));
+    memcpy(&pipe->pipe, dummy, sizeof(pipe->pipe));
+    pipe->regs = cntl->regs;
+    pipe->tds = tds;
+    pipe->ed.hwINFO = ED_SKIP;
+    pipe->ed.hwHeadP = pipe->ed.hwTailP = (u32)tds;
+
+    // Add endpoint descriptor to controller list.
+    pipe->ed.hwNextED = cntl->regs->ed_bulkhead;
+    barrier();
+    cntl->regs->ed_bulkhead = (u32)&pipe->ed;
+    return &pipe->pipe;
+}
+
+// Wait for the controller to retire all tds queued on a bulk ed.
+static int
+wait_bulk_ed(struct ohci_pipe *pipe, int timeout)
+{
+    u64 end = calc_future_tsc(timeout);
+    for (;;) {
+        u32 head = GET_FLATPTR(pipe->ed.hwHeadP);
+        if (head & ED_H) {
+            dprintf(1, "ohci bulk ed halted (head=%x)\n", head);
+            return -2;
+        }
+        if ((head & ~(ED_C|ED_H)) == GET_FLATPTR(pipe->ed.hwTailP))
+            return 0;
+        if (check_tsc(end)) {
+            warn_timeout();
+            return -1;
+        }
+        yield();
+    }
+}
+
+// Fill a td with as much of the buffer as it can describe.  An OHCI
+// td may cross one 4K page boundary, so it covers up to 8K of data.
+static int
+ohci_fill_td(struct ohci_td *td, u16 maxpacket, const void *buf, int bytes)
+{
+    u32 start = (u32)buf;
+    int room = 2*PAGE_SIZE - (start & (PAGE_SIZE-1));
+    int transfer = bytes;
+    if (transfer > room)
+        // Split on a packet boundary so the next td starts a new packet.
+        transfer = ALIGN_DOWN(room, maxpacket);
+    SET_FLATPTR(td->hwCBP, start);
+    SET_FLATPTR(td->hwBE, start + transfer - 1);
+    return transfer;
 }
 
 int
 ohci_send_bulk(struct usb_pipe *p, int dir, void *data, int datasize)
 {
+    if (! CONFIG_USB_OHCI)
+        return -1;
+    struct ohci_pipe *pipe = container_of(p, struct ohci_pipe, pipe);
+    dprintf(7, "ohci_send_bulk ed=%p dir=%d data=%p size=%d\n"
+            , &pipe->ed, dir, data, datasize);
+    int maxpacket = GET_FLATPTR(pipe->pipe.maxpacket);
+    int lowspeed = GET_FLATPTR(pipe->pipe.speed);
+    int devaddr = (GET_FLATPTR(pipe->pipe.devaddr)
+                   | (GET_FLATPTR(pipe->pipe.ep) << 7));
+    struct ohci_td *tds = GET_FLATPTR(pipe->tds);
+    struct ohci_regs *regs = GET_FLATPTR(pipe->regs);
+
+    // Queue as much of the transfer as the td ring holds, start it,
+    // and wait for the whole batch to be retired.  The data toggle is
+    // carried in the ed between tds and between calls.
+    while (datasize) {
+        int tdpos = 0;
+        while (datasize && tdpos < OHCI_BULK_TDS) {
+            struct ohci_td *td = &tds[tdpos++];
+            int transfer = ohci_fill_td(td, maxpacket, data, datasize);
+            data += transfer;
+            datasize -= transfer;
+            SET_FLATPTR(td->hwNextTD, (u32)&tds[tdpos]);
+            SET_FLATPTR(td->hwINFO, ((dir ? TD_DP_IN : TD_DP_OUT)
+                                     | TD_T_TOGGLE | TD_CC));
+        }
+        struct ohci_td *tail = &tds[tdpos];
+        SET_FLATPTR(tail->hwINFO, 0);
+        SET_FLATPTR(tail->hwCBP, 0);
+        SET_FLATPTR(tail->hwNextTD, 0);
+        SET_FLATPTR(tail->hwBE, 0);
+
+        // The ed is idle here (head == tail), so it can be reloaded.
+        u32 carry = GET_FLATPTR(pipe->ed.hwHeadP) & ED_C;
+        SET_FLATPTR(pipe->ed.hwINFO, ED_SKIP);
+        barrier();
+        SET_FLATPTR(pipe->ed.hwHeadP, (u32)tds | carry);
+        SET_FLATPTR(pipe->ed.hwTailP, (u32)tail);
+        barrier();
+        SET_FLATPTR(pipe->ed.hwINFO, (devaddr | (maxpacket << 16)
+                                      | (lowspeed ? ED_LOWSPEED : 0)));
+        pci_writel((u32)&regs->cmdstatus, OHCI_BLF);
+
+        int ret = wait_bulk_ed(pipe, 5000);
+        if (ret)
+            goto fail;
+    }
+    return 0;
+fail:
+    dprintf(1, "ohci_send_bulk failed\n");
+    // Park the ed again with an empty queue.  The data toggle is kept -
+    // the device only resets its toggle when the endpoint is cleared
+    // (CLEAR_FEATURE ENDPOINT_HALT).
+    SET_FLATPTR(pipe->ed.hwINFO, ED_SKIP);
+    msleep(2); // Let the controller move off the ed (one frame is 1ms).
+    u32 carry = GET_FLATPTR(pipe->ed.hwHeadP) & ED_C;
+    SET_FLATPTR(pipe->ed.hwHeadP, GET_FLATPTR(pipe->ed.hwTailP) | carry);
     return -1;
 }
 
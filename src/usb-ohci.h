@@ -5,6 +5,7 @@
 void ohci_init(struct pci_device *pci, int busid);
 struct usb_pipe;
 void ohci_free_pipe(struct usb_pipe *p);
+void ohci_reset_toggle(struct usb_pipe *p);
 struct usb_pipe *ohci_alloc_control_pipe(struct usb_pipe *dummy);
 int ohci_control(struct usb_pipe *p, int dir, const void *cmd, int cmdsize
                  , void *data, int datasize);
@@ -106,6 +107,7 @@ struct ohci_regs {
 
 #define OHCI_HCR        (1 << 0)
 #define OHCI_CLF        (1 << 1)
+#define OHCI_BLF        (1 << 2)
 
 #define OHCI_INTR_MIE   (1 << 31)
 
@@ -0,0 +1,326 @@
+// Code for handling USB Attached SCSI (UAS) devices.
+//
+// This file may be distributed under the terms of the GNU LGPLv3 license.
+
+#include "util.h" // dprintf
+#include "config.h" // CONFIG_USB_UAS
+#include "usb-uas.h" // usb_uas_init
+#include "usb.h" // struct usb_s
+#include "biosvar.h" // GET_GLOBAL
+#include "blockcmd.h" // scsi_init_drive
+#include "disk.h" // DTYPE_UAS
+#include "boot.h" // boot_add_hd
+
+struct uas_autosense_s {
+    u8 length;
+    u8 data[18];
+};
+
+struct uasdrive_s {
+    struct drive_s drive;
+    struct usb_pipe *command, *status, *data_in, *data_out;
+    // The device returns sense data in the sense iu instead of keeping
+    // it for REQUEST SENSE, so the data of the last failed command is
+    // kept here (in low memory).
+    struct uas_autosense_s *autosense;
+};
+
+
+/****************************************************************
+ * UAS information units
+ ****************************************************************/
+
+#define UAS_IU_COMMAND      0x01
+#define UAS_IU_SENSE        0x03
+#define UAS_IU_RESPONSE     0x04
+#define UAS_IU_READ_READY   0x06
+#define UAS_IU_WRITE_READY  0x07
+
+// Pipe usage descriptor (follows each endpoint of a UAS interface)
+#define USB_DT_PIPE_USAGE   0x24
+
+struct uas_pipe_usage_descriptor {
+    u8 bLength;
+    u8 bDescriptorType;
+    u8 bPipeID;
+    u8 reserved_03;
+} PACKED;
+
+#define UAS_PIPE_COMMAND    1
+#define UAS_PIPE_STATUS     2
+#define UAS_PIPE_DATA_IN    3
+#define UAS_PIPE_DATA_OUT   4
+
+// Only one command is outstanding at a time, so a single tag is used.
+// On super speed devices the tag is also the stream of the status and
+// data pipes.
+#define UAS_TAG             1
+
+struct uas_iu_header {
+    u8 id;
+    u8 reserved_01;
+    u16 tag;
+} PACKED;
+
+struct uas_iu_command {
+    struct uas_iu_header hdr;
+    u8 attribute;
+    u8 reserved_05;
+    u8 add_cdb_length;
+    u8 reserved_07;
+    u8 lun[8];
+    u8 cdb[16];
+} PACKED;
+
+struct uas_iu_sense {
+    struct uas_iu_header hdr;
+    u16 qualifier;
+    u8 status;
+    u8 reserved_07[7];
+    u16 length;
+    u8 data[18];
+} PACKED;
+
+
+/****************************************************************
+ * Command processing
+ ****************************************************************/
+
+// Transfer the data of a command on stream pipes.  The sense iu is
+// queued first, so a command that ends without (all of) its data phase
+// is noticed right away instead of when the data transfer times out.
+static int
+uas_stream_data(struct usb_pipe *status, void *sense_fl
+                , struct usb_pipe *data, int dir, void *buf_fl, u32 bytes)
+{
+    int ret = usb_queue_bulk(status, USB_DIR_IN, sense_fl
+                             , sizeof(struct uas_iu_sense));
+    if (ret < 0)
+        return -1;
+    int dataret = 0;
+    u64 end = calc_future_tsc(5000);
+    while (bytes && !dataret) {
+        int count = usb_queue_bulk(data, dir, buf_fl, bytes);
+        if (count < 0) {
+            dataret = -1;
+            break;
+        }
+        for (;;) {
+            dataret = usb_check_bulk(data, 0);
+            if (dataret <= 0)
+                break;
+            if ((usb_check_bulk(status, 0) <= 0 || check_tsc(end))
+                && usb_check_bulk(data, 1)) {
+                // Command ended (or timed out) before its data phase.
+                dataret = -1;
+                break;
+            }
+            yield();
+        }
+        buf_fl += count;
+        bytes -= count;
+    }
+
+    // Wait for the sense iu.
+    for (;;) {
+        ret = usb_check_bulk(status, check_tsc(end));
+        if (ret <= 0)
+            break;
+        yield();
+    }
+    if (ret)
+        return -1;
+    return dataret ? 1 : 0;
+}
+
+// Low-level usb command transmit function.
+int
+uas_cmd_data(struct disk_op_s *op, void *cdbcmd, u16 blocksize)
+{
+    if (!CONFIG_USB_UAS)
+        return 0;
+
+    dprintf(16, "uas_cmd_data id=%p count=%d bs=%d buf=%p\n"
+            , op->drive_g, op->count, blocksize, op->buf_fl);
+    struct uasdrive_s *udrive_g = container_of(
+        op->drive_g, struct uasdrive_s, drive);
+    struct usb_pipe *status = GET_GLOBAL(udrive_g->status);
+    struct uas_autosense_s *autosense = GET_GLOBAL(udrive_g->autosense);
+    u32 bytes = blocksize * op->count;
+
+    // Return the sense data of the last failed command.
+    int len = GET_FLATPTR(autosense->length);
+    SET_FLATPTR(autosense->length, 0);
+    if (*(u8*)cdbcmd == CDB_CMD_REQUEST_SENSE && len) {
+        if (len > bytes)
+            len = bytes;
+        memcpy_fl(op->buf_fl, autosense->data, len);
+        return DISK_RET_SUCCESS;
+    }
+
+    // Send command iu.
+    struct uas_iu_command cmd;
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.hdr.id = UAS_IU_COMMAND;
+    cmd.hdr.tag = htons(UAS_TAG);
+    memcpy(cmd.cdb, cdbcmd, sizeof(cmd.cdb));
+    int ret = usb_send_bulk(GET_GLOBAL(udrive_g->command), USB_DIR_OUT
+                            , MAKE_FLATPTR(GET_SEG(SS), &cmd), sizeof(cmd));
+    if (ret)
+        goto fail;
+
+    struct uas_iu_sense sense;
+    void *sense_fl = MAKE_FLATPTR(GET_SEG(SS), &sense);
+    int dataret = 0;
+    if (bytes) {
+        int dir = (cmd.cdb[0] == CDB_CMD_WRITE_10) ? USB_DIR_OUT : USB_DIR_IN;
+        struct usb_pipe *data = (dir == USB_DIR_OUT
+                                 ? GET_GLOBAL(udrive_g->data_out)
+                                 : GET_GLOBAL(udrive_g->data_in));
+        if (GET_FLATPTR(status->stream)) {
+            ret = uas_stream_data(status, sense_fl, data, dir
+                                  , op->buf_fl, bytes);
+            if (ret < 0 || sense.hdr.id != UAS_IU_SENSE)
+                goto fail;
+            dataret = ret;
+            goto have_sense;
+        }
+        // Without streams the device announces the data phase with a
+        // read/write ready iu on the status pipe.
+        ret = usb_send_bulk(status, USB_DIR_IN, sense_fl, sizeof(sense));
+        if (ret)
+            goto fail;
+        if (sense.hdr.id == UAS_IU_SENSE)
+            goto have_sense;
+        if (sense.hdr.id != (dir == USB_DIR_OUT ? UAS_IU_WRITE_READY
+                             : UAS_IU_READ_READY))
+            goto fail;
+        dataret = usb_send_bulk(data, dir, op->buf_fl, bytes);
+    }
+
+    // Read sense iu.
+    ret = usb_send_bulk(status, USB_DIR_IN, sense_fl, sizeof(sense));
+    if (ret || sense.hdr.id != UAS_IU_SENSE)
+        goto fail;
+
+have_sense:
+    if (!sense.status && !dataret)
+        return DISK_RET_SUCCESS;
+    dprintf(3, "uas: command %02x status %02x\n", cmd.cdb[0], sense.status);
+    if (sense.status) {
+        // Keep the sense data for a following REQUEST SENSE.
+        len = ntohs(sense.length);
+        if (len > sizeof(sense.data))
+            len = sizeof(sense.data);
+        memcpy_fl(autosense->data, MAKE_FLATPTR(GET_SEG(SS), sense.data), len);
+        SET_FLATPTR(autosense->length, len);
+    }
+    op->count = 0;
+    return DISK_RET_EBADTRACK;
+
+fail:
+    dprintf(1, "USB UAS transmission failed\n");
+    op->count = 0;
+    return DISK_RET_EBADTRACK;
+}
+
+
+/****************************************************************
+ * Setup
+ ****************************************************************/
+
+// Find the endpoints of the four UAS pipes from their pipe usage
+// descriptors.
+static int
+uas_find_pipes(struct usb_interface_descriptor *iface, int imax
+               , struct usb_endpoint_descriptor **epdescs)
+{
+    struct usb_endpoint_descriptor *epdesc = NULL;
+    void *desc = (void*)iface + iface->bLength, *end = (void*)iface + imax;
+    while (desc < end) {
+        struct uas_pipe_usage_descriptor *usage = desc;
+        if (!usage->bLength || usage->bDescriptorType == USB_DT_INTERFACE)
+            break;
+        if (usage->bDescriptorType == USB_DT_ENDPOINT)
+            epdesc = desc;
+        else if (usage->bDescriptorType == USB_DT_PIPE_USAGE && epdesc
+                 && usage->bPipeID >= UAS_PIPE_COMMAND
+                 && usage->bPipeID <= UAS_PIPE_DATA_OUT)
+            epdescs[usage->bPipeID - UAS_PIPE_COMMAND] = epdesc;
+        desc += usage->bLength;
+    }
+    int i;
+    for (i=0; i<4; i++)
+        if (!epdescs[i] || ((epdescs[i]->bmAttributes
+                             & USB_ENDPOINT_XFERTYPE_MASK)
+                            != USB_ENDPOINT_XFER_BULK))
+            return -1;
+    return 0;
+}
+
+// Configure a usb uas device.
+int
+usb_uas_init(struct usb_pipe *pipe
+             , struct usb_interface_descriptor *iface, int imax)
+{
+    if (!CONFIG_USB_UAS)
+        return -1;
+
+    struct usb_endpoint_descriptor *epdescs[4] = { NULL };
+    if (uas_find_pipes(iface, imax, epdescs)) {
+        dprintf(1, "Unsupported UAS interface\n");
+        return -1;
+    }
+
+    // Allocate drive structure.
+    struct uasdrive_s *udrive_g = malloc_fseg(sizeof(*udrive_g));
+    if (!udrive_g) {
+        warn_noalloc();
+        goto fail;
+    }
+    memset(udrive_g, 0, sizeof(*udrive_g));
+    udrive_g->drive.type = DTYPE_UAS;
+    udrive_g->autosense = malloc_low(sizeof(*udrive_g->autosense));
+    if (!udrive_g->autosense) {
+        warn_noalloc();
+        goto fail;
+    }
+    udrive_g->autosense->length = 0;
+
+    // The status and data pipes of super speed devices use streams.
+    udrive_g->command = alloc_bulk_pipe(pipe, epdescs[0]);
+    udrive_g->status = alloc_bulk_stream_pipe(pipe, epdescs[1], UAS_TAG);
+    udrive_g->data_in = alloc_bulk_stream_pipe(pipe, epdescs[2], UAS_TAG);
+    udrive_g->data_out = alloc_bulk_stream_pipe(pipe, epdescs[3], UAS_TAG);
+    if (!udrive_g->command || !udrive_g->status
+        || !udrive_g->data_in || !udrive_g->data_out)
+        goto fail;
+
+    int ret, pdt;
+    char *desc = NULL;
+    ret = scsi_init_drive(&udrive_g->drive, "USB UAS", &pdt, &desc, NULL);
+    if (ret)
+        goto fail;
+
+    int prio = bootprio_find_usb(pipe->cntl->pci, pipe->path);
+    if (pdt == SCSI_TYPE_CDROM) {
+        boot_add_cd(&udrive_g->drive, desc, prio);
+    } else {
+        if (blkemu_init(&udrive_g->drive) < 0)
+            goto fail;
+        boot_add_hd(&udrive_g->drive, desc, prio);
+    }
+    return 0;
+
+fail:
+    dprintf(1, "Unable to configure UAS drive.\n");
+    if (udrive_g) {
+        free_pipe(udrive_g->command);
+        free_pipe(udrive_g->status);
+        free_pipe(udrive_g->data_in);
+        free_pipe(udrive_g->data_out);
+        free(udrive_g->autosense);
+    }
+    free(udrive_g);
+    return -1;
+}
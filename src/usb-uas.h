@@ -0,0 +1,12 @@
+#ifndef __USB_UAS_H
+#define __USB_UAS_H
+
+// usb-uas.c
+struct disk_op_s;
+int uas_cmd_data(struct disk_op_s *op, void *cdbcmd, u16 blocksize);
+struct usb_interface_descriptor;
+struct usb_pipe;
+int usb_uas_init(struct usb_pipe *pipe
+                 , struct usb_interface_descriptor *iface, int imax);
+
+#endif // usb-uas.h
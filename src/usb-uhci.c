@@ -295,6 +295,17 @@ uhci_free_pipe(struct usb_pipe *p)
     }
 }
 
+// Restart the data toggle of a bulk pipe at DATA0 (after the device
+// endpoint was reset).
+void
+uhci_reset_toggle(struct usb_pipe *p)
+{
+    if (! CONFIG_USB_UHCI)
+        return;
+    struct uhci_pipe *pipe = container_of(p, struct uhci_pipe, pipe);
+    SET_FLATPTR(pipe->toggle, 0);
+}
+
 struct usb_pipe *
 uhci_alloc_control_pipe(struct usb_pipe *dummy)
 {
@@ -0,0 +1,1283 @@
+// Code for handling XHCI "Super speed" USB controllers.
+//
+// This file may be distributed under the terms of the GNU LGPLv3 license.
+
+#include "util.h" // dprintf
+#include "pci.h" // pci_bdf_to_bus
+#include "config.h" // CONFIG_*
+#include "usb-xhci.h" // struct xhci_trb
+#include "pci_regs.h" // PCI_BASE_ADDRESS_0
+#include "usb.h" // struct usb_s
+#include "farptr.h" // MAKE_FLATPTR
+#include "memmap.h" // PAGE_SIZE
+
+// Number of trbs in a ring (the last one holds the link to the start).
+#define XHCI_RING_ITEMS 16
+#define XHCI_RING_SIZE (XHCI_RING_ITEMS * sizeof(struct xhci_trb))
+
+// Rings are aligned to their size so the ring a completed trb
+// belongs to can be found from the trb address in its event.
+#define XHCI_RING(trb) \
+    ((struct xhci_ring *)((u32)(trb) & ~(XHCI_RING_SIZE-1)))
+
+// Maximum number of trbs queued for one bulk transfer batch.
+#define XHCI_BULK_TRBS (XHCI_RING_ITEMS - 2)
+
+// Maximum number of device slots used.
+#define XHCI_MAX_SLOTS 32
+
+#define XHCI_TIME_POSTPOWER 20
+
+// Size of the stream context array of a stream pipe (2 << n entries;
+// the smallest size is used, entry 0 is reserved).
+#define XHCI_PSTREAMS 1
+#define XHCI_STREAMS (2 << XHCI_PSTREAMS)
+
+struct xhci_ring {
+    struct xhci_trb ring[XHCI_RING_ITEMS];
+    struct xhci_trb evt;
+    u32 eidx;
+    u32 nidx;
+    u32 cs;
+    struct mutex_s lock;
+};
+
+struct usb_xhci_s {
+    struct usb_s usb;
+    struct xhci_caps *caps;
+    struct xhci_op *op;
+    struct xhci_pr *pr;
+    struct xhci_ir *ir;
+    u32 *db;
+    u32 ports;
+    u32 slots;
+    u32 ctxsize;
+
+    // Controller memory
+    u64 *devs;
+    u64 *spba;
+    void *spbufs;
+    struct xhci_ring *cmds;
+    struct xhci_ring *evts;
+    struct xhci_er_seg *eseg;
+    struct xhci_device *slotdev[XHCI_MAX_SLOTS + 1];
+};
+
+// State of an addressed device (one per device slot).
+struct xhci_device {
+    struct xhci_device *parent;
+    void *ctx;
+    u32 route;
+    int refs;
+    u8 slotid;
+    u8 rootport;
+    u8 depth;
+    u8 tt_slot;
+    u8 tt_port;
+    u8 ishub;
+};
+
+struct xhci_pipe {
+    struct usb_pipe pipe;
+    struct xhci_device *dev;
+    struct xhci_ring *ring;
+    u8 slotid;
+    u8 epid;
+    u16 mps;
+    // Stream context array of a stream pipe
+    struct xhci_streamctx *streams;
+    // Interrupt pipe report buffers
+    void *buf;
+    u32 pos;
+    // Controller event ring (for interrupt pipes)
+    struct xhci_ring *evts;
+};
+
+
+/****************************************************************
+ * Rings and events
+ ****************************************************************/
+
+// Allocate a ring.  Rings that are checked from 16bit code (the event
+// ring and interrupt pipe rings) are placed in low memory.
+static struct xhci_ring *
+xhci_alloc_ring(int lowmem)
+{
+    struct xhci_ring *ring;
+    if (lowmem)
+        ring = memalign_low(XHCI_RING_SIZE, sizeof(*ring));
+    else
+        ring = memalign_high(XHCI_RING_SIZE, sizeof(*ring));
+    if (!ring) {
+        warn_noalloc();
+        return NULL;
+    }
+    memset(ring, 0, sizeof(*ring));
+    ring->cs = 1;
+    return ring;
+}
+
+// Add a trb to a ring.  The link trb is written as soon as the ring
+// fills up so the enqueue position always refers to a usable trb.
+static void
+xhci_trb_queue(struct xhci_ring *ring, u32 ptr_low, u32 ptr_high
+               , u32 status, u32 control)
+{
+    struct xhci_trb *dst = &ring->ring[ring->nidx];
+    dst->ptr_low = ptr_low;
+    dst->ptr_high = ptr_high;
+    dst->status = status;
+    barrier();
+    dst->control = control | (ring->cs ? TRB_C : 0);
+    ring->evt.status = 0;
+    ring->nidx++;
+
+    if (ring->nidx == XHCI_RING_ITEMS - 1) {
+        struct xhci_trb *link = &ring->ring[ring->nidx];
+        link->ptr_low = (u32)&ring->ring[0];
+        link->ptr_high = 0;
+        link->status = 0;
+        barrier();
+        link->control = ((TR_LINK << TRB_TYPE_SHIFT) | TRB_TC
+                         | (control & TRB_CH) | (ring->cs ? TRB_C : 0));
+        ring->nidx = 0;
+        ring->cs ^= 1;
+    }
+}
+
+static void
+xhci_doorbell(struct usb_xhci_s *xhci, u32 slotid, u32 value)
+{
+    barrier();
+    writel(&xhci->db[slotid], value);
+}
+
+// Move completion events from the event ring to the rings they
+// refer to.
+static void
+xhci_process_events(struct usb_xhci_s *xhci)
+{
+    struct xhci_ring *evts = xhci->evts;
+    int found = 0;
+    for (;;) {
+        struct xhci_trb *etrb = &evts->ring[evts->nidx];
+        u32 control = etrb->control;
+        if (!(control & TRB_C) != !evts->cs)
+            // No more events.
+            break;
+        barrier();
+        found = 1;
+
+        u32 type = TRB_TYPE(control);
+        switch (type) {
+        case ER_TRANSFER:
+        case ER_COMMAND_COMPLETE: {
+            struct xhci_trb *rtrb = (void*)etrb->ptr_low;
+            if (!rtrb)
+                break;
+            struct xhci_ring *ring = XHCI_RING(rtrb);
+            u32 eidx = rtrb - ring->ring + 1;
+            if (eidx == XHCI_RING_ITEMS - 1)
+                eidx = 0;
+            memcpy(&ring->evt, etrb, sizeof(*etrb));
+            ring->eidx = eidx;
+            if (type == ER_TRANSFER)
+                // Keep the completion code and residual length in the
+                // retired trb - interrupt pipes check every trb.
+                rtrb->status = etrb->status;
+            break;
+        }
+        case ER_PORT_STATUS_CHANGE:
+            // Ports are polled during enumeration.
+            break;
+        default:
+            dprintf(3, "xhci: unexpected event type %d (cc %d)\n"
+                    , type, TRB_CC(etrb->status));
+            break;
+        }
+
+        // Advance the event ring.
+        evts->nidx++;
+        if (evts->nidx == XHCI_RING_ITEMS) {
+            evts->nidx = 0;
+            evts->cs ^= 1;
+        }
+    }
+    if (!found)
+        // Nothing to tell the controller - avoid the register access.
+        return;
+
+    // Tell the controller how far the event ring has been consumed.
+    writel(&xhci->ir->erdp_low
+           , (u32)&evts->ring[evts->nidx] | XHCI_ERDP_EHB);
+    writel(&xhci->ir->erdp_high, 0);
+}
+
+// Check the trbs queued on a ring.  Returns the completion code of the
+// last event once they all completed (or one failed), else 0.
+static int
+xhci_ring_check(struct usb_xhci_s *xhci, struct xhci_ring *ring)
+{
+    xhci_process_events(xhci);
+    int cc = TRB_CC(ring->evt.status);
+    if (ring->eidx == ring->nidx)
+        return cc;
+    if (cc && cc != CC_SUCCESS && cc != CC_SHORT_PACKET)
+        // Error part way through the queued trbs.
+        return cc;
+    return 0;
+}
+
+// Wait for the trbs queued on a ring to complete.  Returns the
+// completion code of the last event (or -1 on timeout).  Runtime
+// (16bit) callers run via call32() and must not yield.
+static int
+xhci_event_wait(struct usb_xhci_s *xhci, struct xhci_ring *ring
+                , u32 timeout, int canyield)
+{
+    u64 end = calc_future_tsc(timeout);
+    for (;;) {
+        int cc = xhci_ring_check(xhci, ring);
+        if (cc)
+            return cc;
+        if (check_tsc(end)) {
+            warn_timeout();
+            return -1;
+        }
+        if (canyield)
+            yield();
+    }
+}
+
+// Issue a command and wait for its completion code.
+static int
+xhci_cmd_submit_status(struct usb_xhci_s *xhci, u32 ptr, u32 status
+                       , u32 control, int canyield)
+{
+    struct xhci_ring *cmds = xhci->cmds;
+    mutex_lock(&cmds->lock);
+    xhci_trb_queue(cmds, ptr, 0, status, control);
+    xhci_doorbell(xhci, 0, 0);
+    int cc = xhci_event_wait(xhci, cmds, 1000, canyield);
+    mutex_unlock(&cmds->lock);
+    return cc;
+}
+
+static int
+xhci_cmd_submit(struct usb_xhci_s *xhci, u32 ptr, u32 control, int canyield)
+{
+    return xhci_cmd_submit_status(xhci, ptr, 0, control, canyield);
+}
+
+#define xhci_cmd(type, slotid, epid)                                    \
+    (((type) << TRB_TYPE_SHIFT) | ((slotid) << TRB_SLOT_SHIFT)          \
+     | ((epid) << TRB_EP_SHIFT))
+
+// Restart an endpoint after an error or timeout - discards any trbs
+// still queued on its ring.
+static void
+xhci_recover_ep(struct usb_xhci_s *xhci, struct xhci_pipe *pipe, int cc
+                , int canyield)
+{
+    u32 slotid = pipe->slotid, epid = pipe->epid;
+    struct xhci_ring *ring = pipe->ring;
+    dprintf(1, "xhci: recover slot %d ep %d (cc %d)\n", slotid, epid, cc);
+    // Reset a halted endpoint - an endpoint that did not halt (timeout
+    // or a non fatal error) is stopped instead.
+    if (cc < 0 || xhci_cmd_submit(
+            xhci, 0, xhci_cmd(CR_RESET_ENDPOINT, slotid, epid)
+            , canyield) != CC_SUCCESS)
+        xhci_cmd_submit(xhci, 0, xhci_cmd(CR_STOP_ENDPOINT, slotid, epid)
+                        , canyield);
+    u32 deq = (u32)&ring->ring[ring->nidx] | (ring->cs ? 1 : 0);
+    u32 stream = pipe->pipe.stream;
+    if (stream)
+        deq |= SCT_PRIMARY_RING;
+    xhci_cmd_submit_status(xhci, deq, stream << 16
+                           , xhci_cmd(CR_SET_TR_DEQUEUE, slotid, epid)
+                           , canyield);
+    ring->eidx = ring->nidx;
+}
+
+
+/****************************************************************
+ * Contexts and device slots
+ ****************************************************************/
+
+static void *
+xhci_ctx(struct usb_xhci_s *xhci, void *base, int idx)
+{
+    return base + idx * xhci->ctxsize;
+}
+
+// Allocate an input context - the slot context is copied from the
+// device's current state.
+static struct xhci_inctx *
+xhci_alloc_inctx(struct usb_xhci_s *xhci, struct xhci_device *dev)
+{
+    u32 size = xhci->ctxsize * 33;
+    struct xhci_inctx *in = memalign_tmphigh(64, size);
+    if (!in) {
+        warn_noalloc();
+        return NULL;
+    }
+    memset(in, 0, size);
+    if (dev && dev->ctx)
+        memcpy(xhci_ctx(xhci, in, 1), xhci_ctx(xhci, dev->ctx, 0)
+               , sizeof(struct xhci_slotctx));
+    return in;
+}
+
+static const u8 xhci_speed_from_usb[] = {
+    [USB_FULLSPEED] = XHCI_SPEED_FULL,
+    [USB_LOWSPEED] = XHCI_SPEED_LOW,
+    [USB_HIGHSPEED] = XHCI_SPEED_HIGH,
+    [USB_SUPERSPEED] = XHCI_SPEED_SUPER,
+};
+
+static void
+xhci_put_device(struct usb_xhci_s *xhci, struct xhci_device *dev)
+{
+    while (dev && !--dev->refs) {
+        struct xhci_device *parent = dev->parent;
+        xhci_cmd_submit(xhci, 0, xhci_cmd(CR_DISABLE_SLOT, dev->slotid, 0)
+                        , 1);
+        xhci->devs[dev->slotid] = 0;
+        xhci->slotdev[dev->slotid] = NULL;
+        free(dev->ctx);
+        free(dev);
+        dev = parent;
+    }
+}
+
+// Tell the controller a device is a hub (needed for transaction
+// translation to full/low speed devices behind it).
+static int
+xhci_config_hub(struct usb_xhci_s *xhci, struct xhci_device *dev
+                , u32 portcount)
+{
+    if (dev->ishub)
+        return 0;
+    struct xhci_inctx *in = xhci_alloc_inctx(xhci, dev);
+    if (!in)
+        return -1;
+    in->add = 1 << 0;
+    struct xhci_slotctx *slot = xhci_ctx(xhci, in, 1);
+    slot->ctx[0] |= SLOT0_HUB;
+    slot->ctx[1] |= portcount << SLOT1_PORTS_SHIFT;
+    int cc = xhci_cmd_submit(xhci, (u32)in
+                             , xhci_cmd(CR_CONFIGURE_ENDPOINT, dev->slotid, 0)
+                             , 1);
+    free(in);
+    if (cc != CC_SUCCESS) {
+        dprintf(1, "xhci: configure hub slot %d failed (cc %d)\n"
+                , dev->slotid, cc);
+        return -1;
+    }
+    dev->ishub = 1;
+    return 0;
+}
+
+// Allocate a device slot for a newly reset device and give it an
+// address - returns the control pipe of the device.
+struct usb_pipe *
+xhci_alloc_device_pipe(struct usbhub_s *hub, u32 port, int speed)
+{
+    ASSERT32FLAT();
+    if (! CONFIG_USB_XHCI)
+        return NULL;
+    struct usb_xhci_s *xhci = container_of(hub->cntl, struct usb_xhci_s, usb);
+    dprintf(7, "xhci_alloc_device_pipe %p port %d speed %d\n"
+            , &xhci->usb, port, speed);
+
+    struct xhci_device *parent = NULL;
+    if (hub->pipe) {
+        parent = xhci->slotdev[hub->pipe->devaddr];
+        if (parent->depth >= 5 || port >= 15) {
+            dprintf(1, "xhci: hub tier too deep\n");
+            return NULL;
+        }
+        if (xhci_config_hub(xhci, parent, hub->portcount))
+            return NULL;
+    }
+
+    struct xhci_device *dev = malloc_high(sizeof(*dev));
+    struct xhci_pipe *pipe = malloc_tmphigh(sizeof(*pipe));
+    void *ctx = memalign_high(64, xhci->ctxsize * 32);
+    struct xhci_ring *ring = xhci_alloc_ring(0);
+    if (!dev || !pipe || !ctx || !ring) {
+        warn_noalloc();
+        goto fail;
+    }
+    memset(dev, 0, sizeof(*dev));
+    memset(pipe, 0, sizeof(*pipe));
+    memset(ctx, 0, xhci->ctxsize * 32);
+
+    // Work out the route to the device.
+    if (parent) {
+        dev->rootport = parent->rootport;
+        dev->route = parent->route | ((port + 1) << (4 * parent->depth));
+        dev->depth = parent->depth + 1;
+        if (hub->pipe->speed == USB_HIGHSPEED) {
+            dev->tt_slot = parent->slotid;
+            dev->tt_port = port + 1;
+        } else {
+            dev->tt_slot = parent->tt_slot;
+            dev->tt_port = parent->tt_port;
+        }
+    } else {
+        dev->rootport = port + 1;
+    }
+    u16 maxpacket = 8;
+    if (speed == USB_HIGHSPEED)
+        maxpacket = 64;
+    else if (speed == USB_SUPERSPEED)
+        maxpacket = 512;
+
+    // Enable a device slot.
+    int cc = xhci_cmd_submit(xhci, 0, xhci_cmd(CR_ENABLE_SLOT, 0, 0), 1);
+    if (cc != CC_SUCCESS) {
+        dprintf(1, "xhci: enable slot failed (cc %d)\n", cc);
+        goto fail;
+    }
+    dev->slotid = xhci->cmds->evt.control >> TRB_SLOT_SHIFT;
+    if (!dev->slotid || dev->slotid > XHCI_MAX_SLOTS) {
+        dprintf(1, "xhci: bad slot id %d\n", dev->slotid);
+        dev->slotid = 0;
+        goto fail;
+    }
+    xhci->devs[dev->slotid] = (u32)ctx;
+
+    // Address the device.
+    struct xhci_inctx *in = xhci_alloc_inctx(xhci, NULL);
+    if (!in)
+        goto fail;
+    in->add = (1 << 0) | (1 << 1);
+    struct xhci_slotctx *slot = xhci_ctx(xhci, in, 1);
+    slot->ctx[0] = (dev->route | (xhci_speed_from_usb[speed] << SLOT0_SPEED_SHIFT)
+                    | (1 << SLOT0_ENTRIES_SHIFT));
+    slot->ctx[1] = dev->rootport << SLOT1_ROOTPORT_SHIFT;
+    if (speed != USB_HIGHSPEED && speed != USB_SUPERSPEED && dev->tt_slot)
+        slot->ctx[2] = ((dev->tt_slot << SLOT2_TTSLOT_SHIFT)
+                        | (dev->tt_port << SLOT2_TTPORT_SHIFT));
+    struct xhci_epctx *ep = xhci_ctx(xhci, in, 2);
+    ep->ctx[1] = ((3 << EP1_CERR_SHIFT) | (EPTYPE_CONTROL << EP1_TYPE_SHIFT)
+                  | (maxpacket << EP1_MAXPACKET_SHIFT));
+    ep->deq_low = (u32)&ring->ring[0] | 1;
+    ep->length = 8;
+    cc = xhci_cmd_submit(xhci, (u32)in
+                         , xhci_cmd(CR_ADDRESS_DEVICE, dev->slotid, 0), 1);
+    free(in);
+    if (cc != CC_SUCCESS) {
+        dprintf(1, "xhci: address device on slot %d failed (cc %d)\n"
+                , dev->slotid, cc);
+        goto fail;
+    }
+
+    dev->ctx = ctx;
+    dev->refs = 1;
+    xhci->slotdev[dev->slotid] = dev;
+    if (parent) {
+        dev->parent = parent;
+        parent->refs++;
+    }
+    pipe->pipe.cntl = &xhci->usb;
+    pipe->pipe.type = USB_TYPE_XHCI;
+    pipe->pipe.path = (u64)-1;
+    pipe->pipe.devaddr = dev->slotid;
+    pipe->pipe.speed = speed;
+    pipe->pipe.maxpacket = maxpacket;
+    pipe->pipe.tt_devaddr = dev->tt_slot;
+    pipe->pipe.tt_port = dev->tt_port;
+    pipe->dev = dev;
+    pipe->ring = ring;
+    pipe->slotid = dev->slotid;
+    pipe->epid = 1;
+    pipe->mps = maxpacket;
+    return &pipe->pipe;
+
+fail:
+    if (dev && dev->slotid) {
+        xhci_cmd_submit(xhci, 0, xhci_cmd(CR_DISABLE_SLOT, dev->slotid, 0), 1);
+        xhci->devs[dev->slotid] = 0;
+    }
+    free(dev);
+    free(pipe);
+    free(ctx);
+    free(ring);
+    return NULL;
+}
+
+// Add an endpoint to (or drop it from) a configured device.
+static int
+xhci_config_ep(struct usb_xhci_s *xhci, struct xhci_pipe *pipe, int add
+               , u32 eptype, u32 interval)
+{
+    struct xhci_device *dev = pipe->dev;
+    u32 epid = pipe->epid;
+    struct xhci_inctx *in = xhci_alloc_inctx(xhci, dev);
+    if (!in)
+        return -1;
+    if (!add) {
+        in->add = 1 << 0;
+        in->del = 1 << epid;
+    } else {
+        in->add = (1 << 0) | (1 << epid);
+        struct xhci_slotctx *slot = xhci_ctx(xhci, in, 1);
+        if (((slot->ctx[0] & SLOT0_ENTRIES_MASK) >> SLOT0_ENTRIES_SHIFT) < epid)
+            slot->ctx[0] = ((slot->ctx[0] & ~SLOT0_ENTRIES_MASK)
+                            | (epid << SLOT0_ENTRIES_SHIFT));
+        u32 maxpacket = pipe->pipe.maxpacket;
+        u32 burst = pipe->pipe.maxburst;
+        struct xhci_epctx *ep = xhci_ctx(xhci, in, epid + 1);
+        ep->ctx[0] = interval << EP0_INTERVAL_SHIFT;
+        ep->ctx[1] = ((3 << EP1_CERR_SHIFT) | (eptype << EP1_TYPE_SHIFT)
+                      | (burst << EP1_BURST_SHIFT)
+                      | (maxpacket << EP1_MAXPACKET_SHIFT));
+        ep->deq_low = (u32)&pipe->ring->ring[0] | 1;
+        if (pipe->streams) {
+            // The endpoint dequeue pointer refers to the stream
+            // contexts instead, and the ring serves a single stream.
+            struct xhci_streamctx *sctx = &pipe->streams[pipe->pipe.stream];
+            sctx->deq_low = ep->deq_low | SCT_PRIMARY_RING;
+            ep->ctx[0] |= (XHCI_PSTREAMS << EP0_MAXPSTREAMS_SHIFT) | EP0_LSA;
+            ep->deq_low = (u32)pipe->streams;
+        }
+        if (eptype == EPTYPE_INTR_IN || eptype == EPTYPE_INTR_OUT)
+            ep->length = (maxpacket | ((maxpacket * (burst + 1))
+                                       << EP_LENGTH_ESIT_SHIFT));
+        else
+            ep->length = 3 * 1024;
+    }
+    int cc = xhci_cmd_submit(xhci, (u32)in
+                             , xhci_cmd(CR_CONFIGURE_ENDPOINT, dev->slotid, 0)
+                             , 1);
+    free(in);
+    if (cc != CC_SUCCESS) {
+        dprintf(1, "xhci: configure slot %d ep %d failed (cc %d)\n"
+                , dev->slotid, epid, cc);
+        return -1;
+    }
+    return 0;
+}
+
+
+// Allocate a pipe for a bulk or interrupt endpoint of a configured
+// device.  The pipe is used from 16bit code, so it is in low memory.
+static struct xhci_pipe *
+xhci_alloc_ep_pipe(struct usb_pipe *dummy, u32 eptype, u32 interval)
+{
+    struct usb_xhci_s *xhci = container_of(dummy->cntl, struct usb_xhci_s, usb);
+    struct xhci_device *dev = NULL;
+    if (dummy->devaddr <= XHCI_MAX_SLOTS)
+        dev = xhci->slotdev[dummy->devaddr];
+    if (!dev) {
+        warn_internalerror();
+        return NULL;
+    }
+
+    struct xhci_pipe *pipe = malloc_low(sizeof(*pipe));
+    struct xhci_ring *ring = xhci_alloc_ring(
+        eptype == EPTYPE_INTR_IN || eptype == EPTYPE_INTR_OUT);
+    if (!pipe || !ring) {
+        warn_noalloc();
+        free(pipe);
+        free(ring);
+        return NULL;
+    }
+    memset(pipe, 0, sizeof(*pipe));
+    memcpy(&pipe->pipe, dummy, sizeof(pipe->pipe));
+    pipe->dev = dev;
+    pipe->ring = ring;
+    pipe->slotid = dev->slotid;
+    pipe->epid = dummy->ep * 2 + (dummy->dir ? 1 : 0);
+    pipe->mps = dummy->maxpacket;
+    if (dummy->stream) {
+        if (dummy->stream >= XHCI_STREAMS
+            || !HCC_MAX_PSA(readl(&xhci->caps->hccparams))) {
+            dprintf(1, "xhci: stream %d not supported\n", dummy->stream);
+            goto fail;
+        }
+        pipe->streams = memalign_high(
+            sizeof(*pipe->streams), XHCI_STREAMS * sizeof(*pipe->streams));
+        if (!pipe->streams) {
+            warn_noalloc();
+            goto fail;
+        }
+        memset(pipe->streams, 0, XHCI_STREAMS * sizeof(*pipe->streams));
+    }
+    if (xhci_config_ep(xhci, pipe, 1, eptype, interval))
+        goto fail;
+    dev->refs++;
+    return pipe;
+fail:
+    free(pipe->streams);
+    free(pipe);
+    free(ring);
+    return NULL;
+}
+
+void
+xhci_free_pipe(struct usb_pipe *p)
+{
+    if (! CONFIG_USB_XHCI)
+        return;
+    dprintf(7, "xhci_free_pipe %p\n", p);
+    struct xhci_pipe *pipe = container_of(p, struct xhci_pipe, pipe);
+    struct usb_xhci_s *xhci = container_of(
+        pipe->pipe.cntl, struct usb_xhci_s, usb);
+    if (pipe->epid > 1 && pipe->dev->refs > 1)
+        xhci_config_ep(xhci, pipe, 0, 0, 0);
+    xhci_put_device(xhci, pipe->dev);
+    free(pipe->ring);
+    free(pipe->streams);
+    free(pipe->buf);
+    free(pipe);
+}
+
+// Restart the sequence number of an endpoint at zero (after the
+// device endpoint was reset).  The xhci can only do this for a
+// running endpoint by dropping and re-adding it, which also starts
+// its ring over.
+void
+xhci_reset_toggle(struct usb_pipe *p)
+{
+    ASSERT32FLAT();
+    if (! CONFIG_USB_XHCI)
+        return;
+    struct xhci_pipe *pipe = container_of(p, struct xhci_pipe, pipe);
+    struct usb_xhci_s *xhci = container_of(
+        pipe->pipe.cntl, struct usb_xhci_s, usb);
+    u32 eptype = pipe->pipe.dir ? EPTYPE_BULK_IN : EPTYPE_BULK_OUT;
+    xhci_config_ep(xhci, pipe, 0, 0, 0);
+    struct xhci_ring *ring = pipe->ring;
+    memset(ring->ring, 0, sizeof(ring->ring));
+    ring->eidx = ring->nidx = 0;
+    ring->cs = 1;
+    if (pipe->streams)
+        memset(pipe->streams, 0, XHCI_STREAMS * sizeof(*pipe->streams));
+    xhci_config_ep(xhci, pipe, 1, eptype, 0);
+}
+
+
+/****************************************************************
+ * Transfers
+ ****************************************************************/
+
+int
+xhci_control(struct usb_pipe *p, int dir, const void *cmd, int cmdsize
+             , void *data, int datasize)
+{
+    ASSERT32FLAT();
+    if (! CONFIG_USB_XHCI)
+        return -1;
+    dprintf(5, "xhci_control %p\n", p);
+    struct xhci_pipe *pipe = container_of(p, struct xhci_pipe, pipe);
+    struct usb_xhci_s *xhci = container_of(
+        pipe->pipe.cntl, struct usb_xhci_s, usb);
+
+    if (pipe->pipe.maxpacket != pipe->mps) {
+        // The device descriptor reported a different ep0 packet size.
+        struct xhci_inctx *in = xhci_alloc_inctx(xhci, NULL);
+        if (!in)
+            return -1;
+        in->add = 1 << 1;
+        struct xhci_epctx *ep = xhci_ctx(xhci, in, 2);
+        ep->ctx[1] = pipe->pipe.maxpacket << EP1_MAXPACKET_SHIFT;
+        int cc = xhci_cmd_submit(
+            xhci, (u32)in, xhci_cmd(CR_EVALUATE_CONTEXT, pipe->slotid, 0), 1);
+        free(in);
+        if (cc != CC_SUCCESS) {
+            dprintf(1, "xhci: evaluate context failed (cc %d)\n", cc);
+            return -1;
+        }
+        pipe->mps = pipe->pipe.maxpacket;
+    }
+
+    // Setup stage (the request is sent as immediate data)
+    struct xhci_ring *ring = pipe->ring;
+    u32 req[2];
+    memcpy(req, cmd, sizeof(req));
+    u32 trt = datasize ? (dir ? TRB_TRT_IN : TRB_TRT_OUT) : 0;
+    xhci_trb_queue(ring, req[0], req[1], cmdsize
+                   , (TR_SETUP << TRB_TYPE_SHIFT) | TRB_IDT | trt);
+    // Data stage
+    if (datasize)
+        xhci_trb_queue(ring, (u32)data, 0, datasize
+                       , (TR_DATA << TRB_TYPE_SHIFT) | (dir ? TRB_DIR_IN : 0));
+    // Status stage (in the opposite direction of the data)
+    xhci_trb_queue(ring, 0, 0, 0
+                   , ((TR_STATUS << TRB_TYPE_SHIFT) | TRB_IOC
+                      | ((datasize && dir) ? 0 : TRB_DIR_IN)));
+    xhci_doorbell(xhci, pipe->slotid, pipe->epid);
+
+    int cc = xhci_event_wait(xhci, ring, 500, 1);
+    if (cc != CC_SUCCESS && cc != CC_SHORT_PACKET) {
+        xhci_recover_ep(xhci, pipe, cc, 1);
+        return -1;
+    }
+    return 0;
+}
+
+struct usb_pipe *
+xhci_alloc_bulk_pipe(struct usb_pipe *dummy)
+{
+    if (! CONFIG_USB_XHCI)
+        return NULL;
+    dprintf(7, "xhci_alloc_bulk_pipe %p\n", dummy->cntl);
+    struct xhci_pipe *pipe = xhci_alloc_ep_pipe(
+        dummy, dummy->dir ? EPTYPE_BULK_IN : EPTYPE_BULK_OUT, 0);
+    if (!pipe)
+        return NULL;
+    return &pipe->pipe;
+}
+
+// Queue (as much as the ring holds of) a bulk transfer as chained trbs
+// - a trb may not cross a 64K boundary - and start it.  Returns the
+// number of bytes queued.
+static int
+xhci_bulk_queue(struct xhci_pipe *pipe, void *data, int datasize)
+{
+    struct usb_xhci_s *xhci = container_of(
+        pipe->pipe.cntl, struct usb_xhci_s, usb);
+    struct xhci_ring *ring = pipe->ring;
+    u32 maxpacket = pipe->pipe.maxpacket;
+    int count = 0, queued = 0;
+    while (datasize && count < XHCI_BULK_TRBS) {
+        u32 addr = (u32)data;
+        int len = 0x10000 - (addr & 0xffff);
+        if (len > datasize)
+            len = datasize;
+        data += len;
+        datasize -= len;
+        queued += len;
+        count++;
+        int last = !datasize || count == XHCI_BULK_TRBS;
+        // TD size - number of packets left in the td after this trb
+        u32 tdsize = last ? 0 : DIV_ROUND_UP(datasize, maxpacket);
+        if (tdsize > 31)
+            tdsize = 31;
+        xhci_trb_queue(ring, addr, 0, len | (tdsize << 17)
+                       , ((TR_NORMAL << TRB_TYPE_SHIFT)
+                          | (last ? TRB_IOC : TRB_CH)));
+    }
+    xhci_doorbell(xhci, pipe->slotid, pipe->epid | (pipe->pipe.stream << 16));
+    return queued;
+}
+
+// Queue a bulk transfer and wait for it to complete.
+static int
+xhci_bulk_transfer(struct xhci_pipe *pipe, void *data, int datasize
+                   , int canyield)
+{
+    struct usb_xhci_s *xhci = container_of(
+        pipe->pipe.cntl, struct usb_xhci_s, usb);
+    struct xhci_ring *ring = pipe->ring;
+    while (datasize) {
+        int queued = xhci_bulk_queue(pipe, data, datasize);
+        data += queued;
+        datasize -= queued;
+
+        int cc = xhci_event_wait(xhci, ring, 5000, canyield);
+        if (cc != CC_SUCCESS && cc != CC_SHORT_PACKET) {
+            dprintf(1, "xhci_send_bulk failed (cc %d)\n", cc);
+            xhci_recover_ep(xhci, pipe, cc, canyield);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+struct xhci_xfer_s {
+    struct usb_pipe *pipe;
+    void *data;
+    int datasize;
+    int canyield;
+    int cancel;
+};
+
+int VISIBLE32FLAT
+xhci_send_bulk_32(struct xhci_xfer_s *xfer)
+{
+    struct xhci_pipe *pipe = container_of(xfer->pipe, struct xhci_pipe, pipe);
+    return xhci_bulk_transfer(pipe, xfer->data, xfer->datasize
+                              , xfer->canyield);
+}
+
+int
+xhci_send_bulk(struct usb_pipe *p, int dir, void *data, int datasize)
+{
+    if (! CONFIG_USB_XHCI)
+        return -1;
+    dprintf(7, "xhci_send_bulk pipe=%p dir=%d data=%p size=%d\n"
+            , p, dir, data, datasize);
+    // Only 32bit (boot time) callers may yield while the transfer runs.
+    struct xhci_xfer_s xfer = { .pipe = p, .data = data, .datasize = datasize
+                                , .canyield = !MODESEGMENT };
+    if (MODESEGMENT) {
+        // The rings live above 1MB - run the transfer in 32bit mode.
+        extern int _cfunc32flat_xhci_send_bulk_32(struct xhci_xfer_s *xfer);
+        return call32(_cfunc32flat_xhci_send_bulk_32
+                      , (u32)MAKE_FLATPTR(GET_SEG(SS), &xfer), -1);
+    }
+    return xhci_send_bulk_32(&xfer);
+}
+
+int VISIBLE32FLAT
+xhci_queue_bulk_32(struct xhci_xfer_s *xfer)
+{
+    struct xhci_pipe *pipe = container_of(xfer->pipe, struct xhci_pipe, pipe);
+    return xhci_bulk_queue(pipe, xfer->data, xfer->datasize);
+}
+
+// Start a bulk transfer without waiting for it.  Returns the number of
+// bytes queued - the caller queues the rest once these completed.
+int
+xhci_queue_bulk(struct usb_pipe *p, int dir, void *data, int datasize)
+{
+    if (! CONFIG_USB_XHCI)
+        return -1;
+    dprintf(7, "xhci_queue_bulk pipe=%p dir=%d data=%p size=%d\n"
+            , p, dir, data, datasize);
+    struct xhci_xfer_s xfer = { .pipe = p, .data = data, .datasize = datasize };
+    if (MODESEGMENT) {
+        extern int _cfunc32flat_xhci_queue_bulk_32(struct xhci_xfer_s *xfer);
+        return call32(_cfunc32flat_xhci_queue_bulk_32
+                      , (u32)MAKE_FLATPTR(GET_SEG(SS), &xfer), -1);
+    }
+    return xhci_queue_bulk_32(&xfer);
+}
+
+int VISIBLE32FLAT
+xhci_check_bulk_32(struct xhci_xfer_s *xfer)
+{
+    struct xhci_pipe *pipe = container_of(xfer->pipe, struct xhci_pipe, pipe);
+    struct usb_xhci_s *xhci = container_of(
+        pipe->pipe.cntl, struct usb_xhci_s, usb);
+    int cc = xhci_ring_check(xhci, pipe->ring);
+    if (cc == CC_SUCCESS || cc == CC_SHORT_PACKET)
+        return 0;
+    if (!cc && !xfer->cancel)
+        return 1;
+    dprintf(1, "xhci_check_bulk failed (cc %d)\n", cc);
+    xhci_recover_ep(xhci, pipe, cc ? cc : -1, 0);
+    return -1;
+}
+
+// Check a transfer started with xhci_queue_bulk() - returns 0 once it
+// completed, 1 while it is still running and -1 if it failed (or was
+// still running and 'cancel' is set).
+int
+xhci_check_bulk(struct usb_pipe *p, int cancel)
+{
+    if (! CONFIG_USB_XHCI)
+        return -1;
+    struct xhci_xfer_s xfer = { .pipe = p, .cancel = cancel };
+    if (MODESEGMENT) {
+        extern int _cfunc32flat_xhci_check_bulk_32(struct xhci_xfer_s *xfer);
+        return call32(_cfunc32flat_xhci_check_bulk_32
+                      , (u32)MAKE_FLATPTR(GET_SEG(SS), &xfer), -1);
+    }
+    return xhci_check_bulk_32(&xfer);
+}
+
+// Queue report buffers on an interrupt pipe's ring.  Each ring entry
+// uses the report buffer with the same index.
+static void
+xhci_queue_reports(struct xhci_pipe *pipe, int count)
+{
+    struct xhci_ring *ring = pipe->ring;
+    int maxpacket = pipe->pipe.maxpacket;
+    while (count--)
+        xhci_trb_queue(ring, (u32)pipe->buf + maxpacket * ring->nidx, 0
+                       , maxpacket, (TR_NORMAL << TRB_TYPE_SHIFT) | TRB_IOC);
+}
+
+struct usb_pipe *
+xhci_alloc_intr_pipe(struct usb_pipe *dummy, int frameexp)
+{
+    if (! CONFIG_USB_XHCI)
+        return NULL;
+    dprintf(7, "xhci_alloc_intr_pipe %p %d\n", dummy->cntl, frameexp);
+
+    // The endpoint interval is in units of 2^n * 125us.
+    if (frameexp > 12)
+        frameexp = 12;
+    int maxpacket = dummy->maxpacket;
+    void *buf = malloc_high(maxpacket * (XHCI_RING_ITEMS - 1));
+    if (!buf) {
+        warn_noalloc();
+        return NULL;
+    }
+    struct xhci_pipe *pipe = xhci_alloc_ep_pipe(
+        dummy, dummy->dir ? EPTYPE_INTR_IN : EPTYPE_INTR_OUT, frameexp + 3);
+    if (!pipe) {
+        free(buf);
+        return NULL;
+    }
+    pipe->buf = buf;
+    struct usb_xhci_s *xhci = container_of(dummy->cntl, struct usb_xhci_s, usb);
+    pipe->evts = xhci->evts;
+
+    // Keep all but one of the ring entries queued for reports.
+    xhci_queue_reports(pipe, XHCI_RING_ITEMS - 2);
+    xhci_doorbell(xhci, pipe->slotid, pipe->epid);
+    return &pipe->pipe;
+}
+
+struct xhci_poll_s {
+    struct usb_pipe *pipe;
+    void *data;
+};
+
+int VISIBLE32FLAT
+xhci_poll_intr_32(struct xhci_poll_s *poll)
+{
+    struct xhci_pipe *pipe = container_of(poll->pipe, struct xhci_pipe, pipe);
+    struct usb_xhci_s *xhci = container_of(
+        pipe->pipe.cntl, struct usb_xhci_s, usb);
+    struct xhci_ring *ring = pipe->ring;
+    xhci_process_events(xhci);
+    u32 pos = pipe->pos;
+    if (pos == ring->eidx)
+        // No reports found.
+        return -1;
+
+    u32 status = ring->ring[pos].status;
+    int cc = TRB_CC(status);
+    if (cc != CC_SUCCESS && cc != CC_SHORT_PACKET) {
+        // The endpoint stopped - restart it and queue all the report
+        // buffers again.
+        xhci_recover_ep(xhci, pipe, cc, 0);
+        pipe->pos = ring->nidx;
+        xhci_queue_reports(pipe, XHCI_RING_ITEMS - 2);
+        xhci_doorbell(xhci, pipe->slotid, pipe->epid);
+        return -1;
+    }
+
+    // Copy data (the event holds the number of bytes not transferred).
+    int maxpacket = pipe->pipe.maxpacket;
+    u32 residue = TRB_XFER_LEN(status);
+    int len = residue < maxpacket ? maxpacket - residue : 0;
+    if (len) {
+        memcpy(poll->data, pipe->buf + maxpacket * pos, len);
+        memset(poll->data + len, 0, maxpacket - len);
+    }
+
+    // Requeue the report buffer that matches the next ring entry.
+    xhci_queue_reports(pipe, 1);
+    xhci_doorbell(xhci, pipe->slotid, pipe->epid);
+    pos++;
+    if (pos == XHCI_RING_ITEMS - 1)
+        pos = 0;
+    pipe->pos = pos;
+    return len ? 0 : -1;
+}
+
+int
+xhci_poll_intr(struct usb_pipe *p, void *data)
+{
+    if (! CONFIG_USB_XHCI)
+        return -1;
+    if (MODESEGMENT) {
+        // Only leave 16bit mode if a report was already moved to the
+        // pipe's ring or an event is pending - both rings are in low
+        // memory, so this check does no register access.
+        struct xhci_pipe *pipe = container_of(p, struct xhci_pipe, pipe);
+        struct xhci_ring *ring = GET_FLATPTR(pipe->ring);
+        struct xhci_ring *evts = GET_FLATPTR(pipe->evts);
+        u32 nidx = GET_FLATPTR(evts->nidx);
+        u32 *pcontrol = (void*)&evts->ring[nidx]
+                        + offsetof(struct xhci_trb, control);
+        u32 control = GET_FLATPTR(*pcontrol);
+        if (GET_FLATPTR(pipe->pos) == GET_FLATPTR(ring->eidx)
+            && !(control & TRB_C) != !GET_FLATPTR(evts->cs))
+            return -1;
+
+        struct xhci_poll_s poll = {
+            .pipe = p, .data = MAKE_FLATPTR(GET_SEG(SS), data) };
+        extern int _cfunc32flat_xhci_poll_intr_32(struct xhci_poll_s *poll);
+        return call32(_cfunc32flat_xhci_poll_intr_32
+                      , (u32)MAKE_FLATPTR(GET_SEG(SS), &poll), -1);
+    }
+    struct xhci_poll_s poll = { .pipe = p, .data = data };
+    return xhci_poll_intr_32(&poll);
+}
+
+
+/****************************************************************
+ * Root hub
+ ****************************************************************/
+
+// Check if device attached to port
+static int
+xhci_hub_detect(struct usbhub_s *hub, u32 port)
+{
+    struct usb_xhci_s *xhci = container_of(hub->cntl, struct usb_xhci_s, usb);
+    void *portreg = &xhci->pr[port].portsc;
+
+    // Check periodically for a device connect.  Super speed ports only
+    // report a connection once link training has completed.
+    for (;;) {
+        u32 portsc = readl(portreg);
+        if (portsc & XHCI_PORTSC_CCS)
+            return 0;
+        if (check_tsc(hub->detectend))
+            // No device found.
+            return -1;
+        msleep(5);
+    }
+}
+
+static int
+xhci_port_speed(u32 portsc)
+{
+    switch ((portsc & XHCI_PORTSC_SPEED_MASK) >> XHCI_PORTSC_SPEED_SHIFT) {
+    case XHCI_SPEED_FULL:
+        return USB_FULLSPEED;
+    case XHCI_SPEED_LOW:
+        return USB_LOWSPEED;
+    case XHCI_SPEED_HIGH:
+        return USB_HIGHSPEED;
+    case XHCI_SPEED_SUPER:
+        return USB_SUPERSPEED;
+    default:
+        return -1;
+    }
+}
+
+// Reset device on port
+static int
+xhci_hub_reset(struct usbhub_s *hub, u32 port)
+{
+    struct usb_xhci_s *xhci = container_of(hub->cntl, struct usb_xhci_s, usb);
+    void *portreg = &xhci->pr[port].portsc;
+    u32 portsc = readl(portreg);
+    if (!(portsc & XHCI_PORTSC_CCS))
+        // No longer connected
+        return -1;
+
+    if (!(portsc & XHCI_PORTSC_PED)) {
+        // USB2 ports are enabled by a port reset (super speed ports
+        // are enabled by the controller after link training).
+        writel(portreg, XHCI_PORTSC_PP | XHCI_PORTSC_PR);
+        u64 end = calc_future_tsc(USB_TIME_DRSTR * 2);
+        for (;;) {
+            portsc = readl(portreg);
+            if (!(portsc & XHCI_PORTSC_PR) && (portsc & XHCI_PORTSC_PED))
+                break;
+            if (check_tsc(end)) {
+                dprintf(1, "xhci: port %d reset timed out\n", port);
+                return -1;
+            }
+            msleep(1);
+        }
+    }
+
+    // Acknowledge the status change bits.
+    writel(portreg, XHCI_PORTSC_PP | (portsc & XHCI_PORTSC_RW1C_BITS));
+    return xhci_port_speed(portsc);
+}
+
+// Disable port
+static void
+xhci_hub_disconnect(struct usbhub_s *hub, u32 port)
+{
+    struct usb_xhci_s *xhci = container_of(hub->cntl, struct usb_xhci_s, usb);
+    // Writing one to the enable bit disables the port.
+    writel(&xhci->pr[port].portsc, XHCI_PORTSC_PP | XHCI_PORTSC_PED);
+}
+
+static struct usbhub_op_s xhci_HubOp = {
+    .detect = xhci_hub_detect,
+    .reset = xhci_hub_reset,
+    .disconnect = xhci_hub_disconnect,
+};
+
+// Find any devices connected to the root hub.
+static int
+check_xhci_ports(struct usb_xhci_s *xhci)
+{
+    ASSERT32FLAT();
+    // Power up all ports at once (only needed if the ports have power
+    // switches).
+    int port, powered = 0;
+    for (port=0; port<xhci->ports; port++) {
+        void *portreg = &xhci->pr[port].portsc;
+        if (!(readl(portreg) & XHCI_PORTSC_PP)) {
+            writel(portreg, XHCI_PORTSC_PP);
+            powered = 1;
+        }
+    }
+    if (powered)
+        msleep(XHCI_TIME_POSTPOWER);
+
+    struct usbhub_s hub;
+    memset(&hub, 0, sizeof(hub));
+    hub.cntl = &xhci->usb;
+    hub.portcount = xhci->ports;
+    hub.op = &xhci_HubOp;
+    usb_enumerate(&hub);
+    return hub.devcount;
+}
+
+
+/****************************************************************
+ * Setup
+ ****************************************************************/
+
+// Wait for a register to reach a given value.
+static int
+xhci_wait_reg(void *reg, u32 mask, u32 value, u32 timeout)
+{
+    u64 end = calc_future_tsc(timeout);
+    for (;;) {
+        if ((readl(reg) & mask) == value)
+            return 0;
+        if (check_tsc(end)) {
+            warn_timeout();
+            return -1;
+        }
+        yield();
+    }
+}
+
+static void
+configure_xhci(void *data)
+{
+    struct usb_xhci_s *xhci = data;
+
+    // Allocate ram for the device context array, rings and event
+    // ring segment table.  These are used at runtime.
+    u32 devsize = sizeof(*xhci->devs) * (xhci->slots + 1);
+    xhci->devs = memalign_high(64, devsize);
+    xhci->eseg = memalign_high(64, sizeof(*xhci->eseg));
+    xhci->cmds = xhci_alloc_ring(0);
+    xhci->evts = xhci_alloc_ring(1);
+    if (!xhci->devs || !xhci->eseg || !xhci->cmds || !xhci->evts) {
+        warn_noalloc();
+        goto fail;
+    }
+    memset(xhci->devs, 0, devsize);
+    memset(xhci->eseg, 0, sizeof(*xhci->eseg));
+
+    // Stop and reset the controller.
+    u32 cmd = readl(&xhci->op->usbcmd);
+    if (cmd & XHCI_CMD_RS) {
+        writel(&xhci->op->usbcmd, cmd & ~XHCI_CMD_RS);
+        if (xhci_wait_reg(&xhci->op->usbsts, XHCI_STS_HCH, XHCI_STS_HCH, 32))
+            goto fail;
+    }
+    writel(&xhci->op->usbcmd, XHCI_CMD_HCRST);
+    if (xhci_wait_reg(&xhci->op->usbcmd, XHCI_CMD_HCRST, 0, 1000)
+        || xhci_wait_reg(&xhci->op->usbsts, XHCI_STS_CNR, 0, 1000))
+        goto fail;
+    if (!(readl(&xhci->op->pagesize) & 1)) {
+        dprintf(1, "xhci: 4K pages not supported\n");
+        goto fail;
+    }
+
+    // Scratchpad buffers for the controller's private use.
+    u32 spb = HCS2_MAX_SPB(readl(&xhci->caps->hcsparams2));
+    if (spb) {
+        xhci->spba = memalign_high(64, sizeof(*xhci->spba) * spb);
+        xhci->spbufs = memalign_high(PAGE_SIZE, PAGE_SIZE * spb);
+        if (!xhci->spba || !xhci->spbufs) {
+            warn_noalloc();
+            goto fail;
+        }
+        memset(xhci->spbufs, 0, PAGE_SIZE * spb);
+        int i;
+        for (i=0; i<spb; i++)
+            xhci->spba[i] = (u32)xhci->spbufs + i * PAGE_SIZE;
+        xhci->devs[0] = (u32)xhci->spba;
+    }
+
+    // Point the controller at the device contexts and rings.
+    writel(&xhci->op->config, xhci->slots);
+    writel(&xhci->op->dcbaap_low, (u32)xhci->devs);
+    writel(&xhci->op->dcbaap_high, 0);
+    writel(&xhci->op->crcr_low, (u32)xhci->cmds | XHCI_CRCR_RCS);
+    writel(&xhci->op->crcr_high, 0);
+    xhci->eseg->ptr_low = (u32)xhci->evts;
+    xhci->eseg->size = XHCI_RING_ITEMS;
+    writel(&xhci->ir->erstsz, 1);
+    writel(&xhci->ir->erdp_low, (u32)xhci->evts);
+    writel(&xhci->ir->erdp_high, 0);
+    writel(&xhci->ir->erstba_low, (u32)xhci->eseg);
+    writel(&xhci->ir->erstba_high, 0);
+
+    // Start the controller.
+    cmd = readl(&xhci->op->usbcmd);
+    writel(&xhci->op->usbcmd, cmd | XHCI_CMD_RS);
+    if (xhci_wait_reg(&xhci->op->usbsts, XHCI_STS_HCH, 0, 32))
+        goto fail;
+
+    // Find devices
+    int count = check_xhci_ports(xhci);
+    if (count)
+        // Success
+        return;
+
+    // No devices found - shutdown and free controller.
+    cmd = readl(&xhci->op->usbcmd);
+    writel(&xhci->op->usbcmd, cmd & ~XHCI_CMD_RS);
+    xhci_wait_reg(&xhci->op->usbsts, XHCI_STS_HCH, XHCI_STS_HCH, 32);
+fail:
+    free(xhci->devs);
+    free(xhci->eseg);
+    free(xhci->cmds);
+    free(xhci->evts);
+    free(xhci->spba);
+    free(xhci->spbufs);
+    free(xhci);
+}
+
+void
+xhci_init(struct pci_device *pci, int busid)
+{
+    if (! CONFIG_USB_XHCI)
+        return;
+
+    u16 bdf = pci->bdf;
+    u32 baseaddr = pci_config_readl(bdf, PCI_BASE_ADDRESS_0);
+    if ((baseaddr & PCI_BASE_ADDRESS_MEM_TYPE_MASK)
+        == PCI_BASE_ADDRESS_MEM_TYPE_64
+        && pci_config_readl(bdf, PCI_BASE_ADDRESS_1)) {
+        dprintf(1, "No support for XHCI registers above 4G\n");
+        return;
+    }
+    struct xhci_caps *caps = (void*)(baseaddr & PCI_BASE_ADDRESS_MEM_MASK);
+
+    // The controller state is needed by the 16bit disk and keyboard
+    // code, so it can't be placed in temporary memory.
+    struct usb_xhci_s *xhci = malloc_high(sizeof(*xhci));
+    if (!xhci) {
+        warn_noalloc();
+        return;
+    }
+    memset(xhci, 0, sizeof(*xhci));
+    xhci->usb.busid = busid;
+    xhci->usb.pci = pci;
+    xhci->usb.type = USB_TYPE_XHCI;
+    xhci->caps = caps;
+    xhci->op = (void*)caps + readb(&caps->caplength);
+    xhci->pr = (void*)xhci->op + 0x400;
+    xhci->db = (void*)caps + (readl(&caps->dboff) & ~0x3);
+    xhci->ir = (void*)caps + (readl(&caps->rtsoff) & ~0x1f) + 0x20;
+    u32 hcs1 = readl(&caps->hcsparams1);
+    xhci->ports = HCS1_MAX_PORTS(hcs1);
+    xhci->slots = HCS1_MAX_SLOTS(hcs1);
+    if (xhci->slots > XHCI_MAX_SLOTS)
+        xhci->slots = XHCI_MAX_SLOTS;
+    xhci->ctxsize = (readl(&caps->hccparams) & HCC_64BYTE_CONTEXT) ? 64 : 32;
+
+    dprintf(1, "XHCI init on dev %02x:%02x.%x (regs=%p, %d ports, %d slots)\n"
+            , pci_bdf_to_bus(bdf), pci_bdf_to_dev(bdf)
+            , pci_bdf_to_fn(bdf), caps, xhci->ports, xhci->slots);
+
+    pci_config_maskw(bdf, PCI_COMMAND
+                     , 0, PCI_COMMAND_MASTER|PCI_COMMAND_MEMORY);
+
+    run_thread(configure_xhci, xhci);
+}
@@ -0,0 +1,246 @@
+#ifndef __USB_XHCI_H
+#define __USB_XHCI_H
+
+// usb-xhci.c
+void xhci_init(struct pci_device *pci, int busid);
+struct usbhub_s;
+struct usb_pipe;
+struct usb_pipe *xhci_alloc_device_pipe(struct usbhub_s *hub, u32 port
+                                        , int speed);
+void xhci_free_pipe(struct usb_pipe *p);
+void xhci_reset_toggle(struct usb_pipe *p);
+int xhci_control(struct usb_pipe *p, int dir, const void *cmd, int cmdsize
+                 , void *data, int datasize);
+struct usb_pipe *xhci_alloc_bulk_pipe(struct usb_pipe *dummy);
+int xhci_send_bulk(struct usb_pipe *p, int dir, void *data, int datasize);
+int xhci_queue_bulk(struct usb_pipe *p, int dir, void *data, int datasize);
+int xhci_check_bulk(struct usb_pipe *p, int cancel);
+struct usb_pipe *xhci_alloc_intr_pipe(struct usb_pipe *dummy, int frameexp);
+int xhci_poll_intr(struct usb_pipe *p, void *data);
+
+
+/****************************************************************
+ * xhci structs and flags
+ ****************************************************************/
+
+// capability registers
+struct xhci_caps {
+    u8  caplength;
+    u8  reserved_01;
+    u16 hciversion;
+    u32 hcsparams1;
+    u32 hcsparams2;
+    u32 hcsparams3;
+    u32 hccparams;
+    u32 dboff;
+    u32 rtsoff;
+} PACKED;
+
+#define HCS1_MAX_SLOTS(p)  ((p) & 0xff)
+#define HCS1_MAX_PORTS(p)  (((p) >> 24) & 0xff)
+#define HCS2_MAX_SPB(p)    ((((p) >> 16) & 0x3e0) | (((p) >> 27) & 0x1f))
+
+#define HCC_64BYTE_CONTEXT (1 << 2)
+#define HCC_MAX_PSA(p)     (((p) >> 12) & 0xf)
+
+// operational registers
+struct xhci_op {
+    u32 usbcmd;
+    u32 usbsts;
+    u32 pagesize;
+    u32 reserved_01[2];
+    u32 dnctl;
+    u32 crcr_low;
+    u32 crcr_high;
+    u32 reserved_02[4];
+    u32 dcbaap_low;
+    u32 dcbaap_high;
+    u32 config;
+} PACKED;
+
+#define XHCI_CMD_RS     (1 << 0)
+#define XHCI_CMD_HCRST  (1 << 1)
+
+#define XHCI_STS_HCH    (1 << 0)
+#define XHCI_STS_HSE    (1 << 2)
+#define XHCI_STS_CNR    (1 << 11)
+
+#define XHCI_CRCR_RCS   (1 << 0)
+
+// port registers (at operational base + 0x400)
+struct xhci_pr {
+    u32 portsc;
+    u32 portpmsc;
+    u32 portli;
+    u32 reserved_01;
+} PACKED;
+
+#define XHCI_PORTSC_CCS         (1 << 0)
+#define XHCI_PORTSC_PED         (1 << 1)
+#define XHCI_PORTSC_PR          (1 << 4)
+#define XHCI_PORTSC_PLS_SHIFT   5
+#define XHCI_PORTSC_PLS_MASK    (0xf << XHCI_PORTSC_PLS_SHIFT)
+#define XHCI_PORTSC_PP          (1 << 9)
+#define XHCI_PORTSC_SPEED_SHIFT 10
+#define XHCI_PORTSC_SPEED_MASK  (0xf << XHCI_PORTSC_SPEED_SHIFT)
+#define XHCI_PORTSC_CSC         (1 << 17)
+#define XHCI_PORTSC_PEC         (1 << 18)
+#define XHCI_PORTSC_WRC         (1 << 19)
+#define XHCI_PORTSC_OCC         (1 << 20)
+#define XHCI_PORTSC_PRC         (1 << 21)
+#define XHCI_PORTSC_PLC         (1 << 22)
+#define XHCI_PORTSC_CEC         (1 << 23)
+#define XHCI_PORTSC_RW1C_BITS   (XHCI_PORTSC_CSC | XHCI_PORTSC_PEC      \
+                                 | XHCI_PORTSC_WRC | XHCI_PORTSC_OCC    \
+                                 | XHCI_PORTSC_PRC | XHCI_PORTSC_PLC    \
+                                 | XHCI_PORTSC_CEC)
+
+// port and slot context speed ids
+#define XHCI_SPEED_FULL  1
+#define XHCI_SPEED_LOW   2
+#define XHCI_SPEED_HIGH  3
+#define XHCI_SPEED_SUPER 4
+
+// interrupter registers (at runtime base + 0x20)
+struct xhci_ir {
+    u32 iman;
+    u32 imod;
+    u32 erstsz;
+    u32 reserved_01;
+    u32 erstba_low;
+    u32 erstba_high;
+    u32 erdp_low;
+    u32 erdp_high;
+} PACKED;
+
+#define XHCI_ERDP_EHB   (1 << 3)
+
+// event ring segment table entry
+struct xhci_er_seg {
+    u32 ptr_low;
+    u32 ptr_high;
+    u32 size;
+    u32 reserved_01;
+} PACKED;
+
+// transfer request block
+struct xhci_trb {
+    u32 ptr_low;
+    u32 ptr_high;
+    u32 status;
+    u32 control;
+} PACKED;
+
+#define TRB_C           (1 << 0)
+#define TRB_TC          (1 << 1)
+#define TRB_ENT         (1 << 1)
+#define TRB_ISP         (1 << 2)
+#define TRB_CH          (1 << 4)
+#define TRB_IOC         (1 << 5)
+#define TRB_IDT         (1 << 6)
+#define TRB_BSR         (1 << 9)
+#define TRB_TYPE_SHIFT  10
+#define TRB_TYPE_MASK   (0x3f << TRB_TYPE_SHIFT)
+#define TRB_TYPE(c)     (((c) & TRB_TYPE_MASK) >> TRB_TYPE_SHIFT)
+#define TRB_DIR_IN      (1 << 16)
+#define TRB_TRT_OUT     (2 << 16)
+#define TRB_TRT_IN      (3 << 16)
+#define TRB_EP_SHIFT    16
+#define TRB_SLOT_SHIFT  24
+
+#define TRB_XFER_LEN(s) ((s) & 0xffffff)
+#define TRB_CC(s)       ((s) >> 24)
+
+enum {
+    TR_NORMAL = 1,
+    TR_SETUP,
+    TR_DATA,
+    TR_STATUS,
+    TR_ISOCH,
+    TR_LINK,
+    TR_EVDATA,
+    TR_NOOP,
+
+    CR_ENABLE_SLOT = 9,
+    CR_DISABLE_SLOT,
+    CR_ADDRESS_DEVICE,
+    CR_CONFIGURE_ENDPOINT,
+    CR_EVALUATE_CONTEXT,
+    CR_RESET_ENDPOINT,
+    CR_STOP_ENDPOINT,
+    CR_SET_TR_DEQUEUE,
+    CR_RESET_DEVICE,
+
+    ER_TRANSFER = 32,
+    ER_COMMAND_COMPLETE,
+    ER_PORT_STATUS_CHANGE,
+    ER_BANDWIDTH_REQUEST,
+    ER_DOORBELL,
+    ER_HOST_CONTROLLER,
+    ER_DEVICE_NOTIFICATION,
+    ER_MFINDEX_WRAP,
+};
+
+// completion codes
+#define CC_SUCCESS      1
+#define CC_STALL        6
+#define CC_SHORT_PACKET 13
+
+// Slot, endpoint and input control contexts.  These are 32 bytes
+// long, or 64 bytes when the controller sets HCC_64BYTE_CONTEXT.
+struct xhci_slotctx {
+    u32 ctx[4];
+} PACKED;
+
+#define SLOT0_ROUTE_MASK     0xfffff
+#define SLOT0_SPEED_SHIFT    20
+#define SLOT0_MTT            (1 << 25)
+#define SLOT0_HUB            (1 << 26)
+#define SLOT0_ENTRIES_SHIFT  27
+#define SLOT0_ENTRIES_MASK   (0x1f << SLOT0_ENTRIES_SHIFT)
+#define SLOT1_ROOTPORT_SHIFT 16
+#define SLOT1_PORTS_SHIFT    24
+#define SLOT2_TTSLOT_SHIFT   0
+#define SLOT2_TTPORT_SHIFT   8
+
+struct xhci_epctx {
+    u32 ctx[2];
+    u32 deq_low;
+    u32 deq_high;
+    u32 length;
+    u32 reserved_01[3];
+} PACKED;
+
+#define EP0_MAXPSTREAMS_SHIFT 10
+#define EP0_LSA             (1 << 15)
+#define EP0_INTERVAL_SHIFT  16
+#define EP1_CERR_SHIFT      1
+#define EP1_TYPE_SHIFT      3
+#define EP1_BURST_SHIFT     8
+#define EP1_MAXPACKET_SHIFT 16
+#define EP_LENGTH_ESIT_SHIFT 16
+
+// endpoint context types
+#define EPTYPE_BULK_OUT 2
+#define EPTYPE_INTR_OUT 3
+#define EPTYPE_CONTROL  4
+#define EPTYPE_BULK_IN  6
+#define EPTYPE_INTR_IN  7
+
+// stream context (entry of a stream context array)
+struct xhci_streamctx {
+    u32 deq_low;
+    u32 deq_high;
+    u32 edtla;
+    u32 reserved_01;
+} PACKED;
+
+#define SCT_PRIMARY_RING    (1 << 1)
+
+struct xhci_inctx {
+    u32 del;
+    u32 add;
+    u32 reserved_01[6];
+} PACKED;
+
+#endif // usb-xhci.h
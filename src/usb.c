@@ -12,11 +12,15 @@
 #include "usb-uhci.h" // uhci_init
 #include "usb-ohci.h" // ohci_init
 #include "usb-ehci.h" // ehci_init
+#include "usb-xhci.h" // xhci_init
 #include "usb-hid.h" // usb_keyboard_setup
 #include "usb-hub.h" // usb_hub_init
 #include "usb-msc.h" // usb_msc_init
+#include "usb-uas.h" // usb_uas_init
 #include "usb.h" // struct usb_s
 #include "biosvar.h" // GET_GLOBAL
+#include "boot.h" // bootprio_find_usb
+#include "paravirt.h" // romfile_loadint
 
 
 /****************************************************************
@@ -38,6 +42,8 @@ free_pipe(struct usb_pipe *pipe)
         return ohci_free_pipe(pipe);
     case USB_TYPE_EHCI:
         return ehci_free_pipe(pipe);
+    case USB_TYPE_XHCI:
+        return xhci_free_pipe(pipe);
     }
 }
 
@@ -71,6 +77,8 @@ send_control(struct usb_pipe *pipe, int dir, const void *cmd, int cmdsize
         return ohci_control(pipe, dir, cmd, cmdsize, data, datasize);
     case USB_TYPE_EHCI:
         return ehci_control(pipe, dir, cmd, cmdsize, data, datasize);
+    case USB_TYPE_XHCI:
+        return xhci_control(pipe, dir, cmd, cmdsize, data, datasize);
     }
 }
 
@@ -81,14 +89,29 @@ desc2pipe(struct usb_pipe *newpipe, struct usb_pipe *origpipe
 {
     memcpy(newpipe, origpipe, sizeof(*newpipe));
     newpipe->ep = epdesc->bEndpointAddress & USB_ENDPOINT_NUMBER_MASK;
+    newpipe->dir = epdesc->bEndpointAddress & USB_ENDPOINT_DIR_MASK;
     newpipe->maxpacket = epdesc->wMaxPacketSize;
+    newpipe->maxburst = 0;
+    newpipe->stream = 0;
+    if (origpipe->speed == USB_SUPERSPEED) {
+        // Super speed endpoints are followed by a companion descriptor.
+        struct usb_ss_ep_comp_descriptor *comp = (void*)epdesc + epdesc->bLength;
+        if (comp->bDescriptorType == USB_DT_ENDPOINT_COMPANION)
+            newpipe->maxburst = comp->bMaxBurst;
+    }
 }
 
+// Allocate a bulk pipe.  A non-zero stream selects the stream of a
+// super speed endpoint the pipe transfers on (it is ignored on
+// controllers without stream support).
 struct usb_pipe *
-alloc_bulk_pipe(struct usb_pipe *pipe, struct usb_endpoint_descriptor *epdesc)
+alloc_bulk_stream_pipe(struct usb_pipe *pipe
+                       , struct usb_endpoint_descriptor *epdesc, int stream)
 {
     struct usb_pipe dummy;
     desc2pipe(&dummy, pipe, epdesc);
+    if (pipe->speed == USB_SUPERSPEED)
+        dummy.stream = stream;
     switch (pipe->type) {
     default:
     case USB_TYPE_UHCI:
@@ -97,9 +120,17 @@ alloc_bulk_pipe(struct usb_pipe *pipe, struct usb_endpoint_descriptor *epdesc)
         return ohci_alloc_bulk_pipe(&dummy);
     case USB_TYPE_EHCI:
         return ehci_alloc_bulk_pipe(&dummy);
+    case USB_TYPE_XHCI:
+        return xhci_alloc_bulk_pipe(&dummy);
     }
 }
 
+struct usb_pipe *
+alloc_bulk_pipe(struct usb_pipe *pipe, struct usb_endpoint_descriptor *epdesc)
+{
+    return alloc_bulk_stream_pipe(pipe, epdesc, 0);
+}
+
 int
 usb_send_bulk(struct usb_pipe *pipe_fl, int dir, void *data, int datasize)
 {
@@ -111,9 +142,32 @@ usb_send_bulk(struct usb_pipe *pipe_fl, int dir, void *data, int datasize)
         return ohci_send_bulk(pipe_fl, dir, data, datasize);
     case USB_TYPE_EHCI:
         return ehci_send_bulk(pipe_fl, dir, data, datasize);
+    case USB_TYPE_XHCI:
+        return xhci_send_bulk(pipe_fl, dir, data, datasize);
     }
 }
 
+// Start a bulk transfer without waiting for it to complete.  Only
+// stream pipes (xhci) support this.  Returns the number of bytes queued.
+int
+usb_queue_bulk(struct usb_pipe *pipe_fl, int dir, void *data, int datasize)
+{
+    if (GET_FLATPTR(pipe_fl->type) != USB_TYPE_XHCI)
+        return -1;
+    return xhci_queue_bulk(pipe_fl, dir, data, datasize);
+}
+
+// Check a transfer started with usb_queue_bulk() - returns 0 once it
+// completed, 1 while it is running and -1 on failure.  A running
+// transfer is aborted (and fails) if 'cancel' is set.
+int
+usb_check_bulk(struct usb_pipe *pipe_fl, int cancel)
+{
+    if (GET_FLATPTR(pipe_fl->type) != USB_TYPE_XHCI)
+        return -1;
+    return xhci_check_bulk(pipe_fl, cancel);
+}
+
 struct usb_pipe *
 alloc_intr_pipe(struct usb_pipe *pipe, struct usb_endpoint_descriptor *epdesc)
 {
@@ -122,7 +176,7 @@ alloc_intr_pipe(struct usb_pipe *pipe, struct usb_endpoint_descriptor *epdesc)
     // Find the exponential period of the requested time.
     int period = epdesc->bInterval;
     int frameexp;
-    if (pipe->speed != USB_HIGHSPEED)
+    if (pipe->speed != USB_HIGHSPEED && pipe->speed != USB_SUPERSPEED)
         frameexp = (period <= 0) ? 0 : __fls(period);
     else
         frameexp = (period <= 4) ? 0 : period - 4;
@@ -134,6 +188,8 @@ alloc_intr_pipe(struct usb_pipe *pipe, struct usb_endpoint_descriptor *epdesc)
         return ohci_alloc_intr_pipe(&dummy, frameexp);
     case USB_TYPE_EHCI:
         return ehci_alloc_intr_pipe(&dummy, frameexp);
+    case USB_TYPE_XHCI:
+        return xhci_alloc_intr_pipe(&dummy, frameexp);
     }
 }
 
@@ -148,6 +204,8 @@ usb_poll_intr(struct usb_pipe *pipe_fl, void *data)
         return ohci_poll_intr(pipe_fl, data);
     case USB_TYPE_EHCI:
         return ehci_poll_intr(pipe_fl, data);
+    case USB_TYPE_XHCI:
+        return xhci_poll_intr(pipe_fl, data);
     }
 }
 
@@ -156,6 +214,39 @@ usb_poll_intr(struct usb_pipe *pipe_fl, void *data)
  * Helper functions
  ****************************************************************/
 
+// Clear a halt of an endpoint on the device and restart the data
+// toggle of the pipe that talks to it.
+int
+usb_clear_halt(struct usb_pipe *ctrl, struct usb_pipe *pipe)
+{
+    ASSERT32FLAT();
+    struct usb_ctrlrequest req;
+    req.bRequestType = USB_DIR_OUT | USB_TYPE_STANDARD | USB_RECIP_ENDPOINT;
+    req.bRequest = USB_REQ_CLEAR_FEATURE;
+    req.wValue = USB_ENDPOINT_HALT;
+    req.wIndex = pipe->ep | pipe->dir;
+    req.wLength = 0;
+    int ret = send_default_control(ctrl, &req, NULL);
+    if (ret)
+        return ret;
+    switch (pipe->type) {
+    default:
+    case USB_TYPE_UHCI:
+        uhci_reset_toggle(pipe);
+        break;
+    case USB_TYPE_OHCI:
+        ohci_reset_toggle(pipe);
+        break;
+    case USB_TYPE_EHCI:
+        ehci_reset_toggle(pipe);
+        break;
+    case USB_TYPE_XHCI:
+        xhci_reset_toggle(pipe);
+        break;
+    }
+    return 0;
+}
+
 // Find the first endpoing of a given type in an interface description.
 struct usb_endpoint_descriptor *
 findEndPointDesc(struct usb_interface_descriptor *iface, int imax
@@ -235,6 +326,113 @@ set_configuration(struct usb_pipe *pipe, u16 val)
     return send_default_control(pipe, &req, NULL);
 }
 
+static int
+set_interface(struct usb_pipe *pipe, struct usb_interface_descriptor *iface)
+{
+    struct usb_ctrlrequest req;
+    req.bRequestType = USB_DIR_OUT | USB_TYPE_STANDARD | USB_RECIP_INTERFACE;
+    req.bRequest = USB_REQ_SET_INTERFACE;
+    req.wValue = iface->bAlternateSetting;
+    req.wIndex = iface->bInterfaceNumber;
+    req.wLength = 0;
+    return send_default_control(pipe, &req, NULL);
+}
+
+// Find an alternate setting of an interface that uses the given
+// protocol.
+static struct usb_interface_descriptor *
+find_alt_iface(struct usb_config_descriptor *config
+               , struct usb_interface_descriptor *iface, u8 protocol)
+{
+    void *end = (void*)config + config->wTotalLength;
+    struct usb_interface_descriptor *alt = (void*)iface + iface->bLength;
+    while ((void*)alt < end && alt->bLength) {
+        if (alt->bDescriptorType == USB_DT_INTERFACE
+            && alt->bInterfaceNumber == iface->bInterfaceNumber
+            && alt->bInterfaceClass == iface->bInterfaceClass
+            && alt->bInterfaceProtocol == protocol)
+            return alt;
+        alt = (void*)alt + alt->bLength;
+    }
+    return NULL;
+}
+
+
+/****************************************************************
+ * Lazy enumeration
+ ****************************************************************/
+
+// When the "etc/usb-lazy-enumeration" knob is set and a bootorder
+// list is present, only the usb devices named in the bootorder list
+// are set up.  If a boot menu may be shown, keyboards are needed too
+// and all hubs and ports must then still be scanned.
+static int UsbLazy, UsbLazyKeyboards;
+
+static void
+usb_lazy_setup(void)
+{
+    if (!CONFIG_BOOTORDER || !bootorder_count()
+        || !romfile_loadint("etc/usb-lazy-enumeration", 0))
+        return;
+    UsbLazy = 1;
+    UsbLazyKeyboards = (CONFIG_USB_KEYBOARD && CONFIG_BOOTMENU
+                        && qemu_cfg_show_boot_menu());
+    dprintf(1, "USB: lazy enumeration (keyboards %s)\n"
+            , UsbLazyKeyboards ? "enabled" : "skipped");
+}
+
+// Check if no usb controller in the pci slot of 'pci' leads to a
+// device in the bootorder list.
+static int
+usb_lazy_skip_slot(struct pci_device *pci)
+{
+    if (!UsbLazy || UsbLazyKeyboards)
+        return 0;
+    struct pci_device *p;
+    foreachpci(p) {
+        if (p->class == PCI_CLASS_SERIAL_USB
+            && pci_bdf_to_busdev(p->bdf) == pci_bdf_to_busdev(pci->bdf)
+            && bootprio_find_pci_device(p) >= 0)
+            return 0;
+    }
+    dprintf(1, "USB: skipping controller %02x:%02x.%x (not in bootorder)\n"
+            , pci_bdf_to_bus(pci->bdf), pci_bdf_to_dev(pci->bdf)
+            , pci_bdf_to_fn(pci->bdf));
+    return 1;
+}
+
+// Check if a hub port does not lead to a device in the bootorder list.
+// Ehci root ports are always scanned, as full and low speed devices
+// found there are handed over to a companion controller (which has
+// its own pci address in the bootorder list).
+static int
+usb_lazy_skip_port(struct usbhub_s *hub, u32 port)
+{
+    if (!UsbLazy || UsbLazyKeyboards
+        || (!hub->pipe && hub->cntl->type == USB_TYPE_EHCI))
+        return 0;
+    u64 path = hub->pipe ? hub->pipe->path : (u64)-1;
+    path = (path << 8) | port;
+    return bootprio_find_usb(hub->cntl->pci, path) < 0;
+}
+
+// Check if a device found during lazy enumeration should be set up.
+static int
+usb_lazy_want_device(struct usb_pipe *pipe
+                     , struct usb_interface_descriptor *iface)
+{
+    if (!UsbLazy)
+        return 1;
+    if (iface->bInterfaceClass == USB_CLASS_HID)
+        return (UsbLazyKeyboards
+                && iface->bInterfaceSubClass == USB_INTERFACE_SUBCLASS_BOOT
+                && (iface->bInterfaceProtocol
+                    == USB_INTERFACE_PROTOCOL_KEYBOARD));
+    if (iface->bInterfaceClass == USB_CLASS_HUB && UsbLazyKeyboards)
+        return 1;
+    return bootprio_find_usb(pipe->cntl->pci, pipe->path) >= 0;
+}
+
 
 /****************************************************************
  * Initialization and enumeration
@@ -248,6 +446,18 @@ usb_set_address(struct usbhub_s *hub, int port, int speed)
     ASSERT32FLAT();
     struct usb_s *cntl = hub->cntl;
     dprintf(3, "set_address %p\n", cntl);
+    if (cntl->type == USB_TYPE_XHCI) {
+        // xhci controllers assign the address themselves when a slot
+        // is set up for the device - there is no default address pipe.
+        msleep(USB_TIME_RSTRCY);
+        struct usb_pipe *pipe = xhci_alloc_device_pipe(hub, port, speed);
+        if (!pipe)
+            return NULL;
+        if (hub->pipe)
+            pipe->path = hub->pipe->path;
+        pipe->path = (pipe->path << 8) | port;
+        return pipe;
+    }
     if (cntl->maxaddr >= USB_MAXADDR)
         return NULL;
 
@@ -317,9 +527,15 @@ configure_usb_device(struct usb_pipe *pipe)
     dprintf(3, "device rev=%04x cls=%02x sub=%02x proto=%02x size=%02x\n"
             , dinfo.bcdUSB, dinfo.bDeviceClass, dinfo.bDeviceSubClass
             , dinfo.bDeviceProtocol, dinfo.bMaxPacketSize0);
-    if (dinfo.bMaxPacketSize0 < 8 || dinfo.bMaxPacketSize0 > 64)
+    u16 maxpacket = dinfo.bMaxPacketSize0;
+    if (pipe->speed == USB_SUPERSPEED) {
+        // Super speed devices report the packet size as a power of two.
+        if (maxpacket != 9)
+            return 0;
+        maxpacket = 1 << maxpacket;
+    } else if (maxpacket < 8 || maxpacket > 64)
         return 0;
-    pipe->maxpacket = dinfo.bMaxPacketSize0;
+    pipe->maxpacket = maxpacket;
 
     // Get configuration
     struct usb_config_descriptor *config = get_device_config(pipe);
@@ -334,6 +550,11 @@ configure_usb_device(struct usb_pipe *pipe)
         && iface->bInterfaceClass != USB_CLASS_HUB)
         // Not a supported device.
         goto fail;
+    if (!usb_lazy_want_device(pipe, iface)) {
+        dprintf(1, "USB: skipping device cls=%02x (not in bootorder)\n"
+                , iface->bInterfaceClass);
+        goto fail;
+    }
 
     // Set the configuration.
     ret = set_configuration(pipe, config->bConfigurationValue);
@@ -344,9 +565,21 @@ configure_usb_device(struct usb_pipe *pipe)
     int imax = (void*)config + config->wTotalLength - (void*)iface;
     if (iface->bInterfaceClass == USB_CLASS_HUB)
         ret = usb_hub_init(pipe);
-    else if (iface->bInterfaceClass == USB_CLASS_MASS_STORAGE)
-        ret = usb_msc_init(pipe, iface, imax);
-    else
+    else if (iface->bInterfaceClass == USB_CLASS_MASS_STORAGE) {
+        // Prefer the UAS alternate setting of a drive if it has one.
+        struct usb_interface_descriptor *uas = NULL;
+        if (CONFIG_USB_UAS)
+            uas = find_alt_iface(config, iface, US_PR_UAS);
+        ret = -1;
+        if (uas && !set_interface(pipe, uas)) {
+            int uasmax = (void*)config + config->wTotalLength - (void*)uas;
+            ret = usb_uas_init(pipe, uas, uasmax);
+            if (ret)
+                set_interface(pipe, iface);
+        }
+        if (ret)
+            ret = usb_msc_init(pipe, iface, imax);
+    } else
         ret = usb_hid_init(pipe, iface, imax);
     if (ret)
         goto fail;
@@ -364,14 +597,23 @@ usb_init_hub_port(void *data)
     struct usbhub_s *hub = data;
     u32 port = hub->port; // XXX - find better way to pass port
 
+    if (usb_lazy_skip_port(hub, port))
+        goto done;
+
     // Detect if device present (and possibly start reset)
     int ret = hub->op->detect(hub, port);
     if (ret)
         // No device present
         goto done;
 
-    // Reset port and determine device speed
-    mutex_lock(&hub->cntl->resetlock);
+    // Reset port and determine device speed.  Only one device may be
+    // at the default address at a time - except on xhci root ports,
+    // which are separate buses addressed by the controller.
+    struct mutex_s *resetlock = NULL;
+    if (hub->pipe || hub->cntl->type != USB_TYPE_XHCI)
+        resetlock = &hub->cntl->resetlock;
+    if (resetlock)
+        mutex_lock(resetlock);
     ret = hub->op->reset(hub, port);
     if (ret < 0)
         // Reset failed
@@ -383,7 +625,8 @@ usb_init_hub_port(void *data)
         hub->op->disconnect(hub, port);
         goto resetfail;
     }
-    mutex_unlock(&hub->cntl->resetlock);
+    if (resetlock)
+        mutex_unlock(resetlock);
 
     // Configure the device
     int count = configure_usb_device(pipe);
@@ -396,15 +639,23 @@ done:
     return;
 
 resetfail:
-    mutex_unlock(&hub->cntl->resetlock);
+    if (resetlock)
+        mutex_unlock(resetlock);
     goto done;
 }
 
+// Time usb_setup() started (for reporting enumeration time).
+static u64 UsbSetupTime;
+
+// Find devices on all ports of a hub in parallel.  The hub's ports
+// must already be powered - they then share one deadline for a device
+// to signal its attachment.
 void
 usb_enumerate(struct usbhub_s *hub)
 {
     u32 portcount = hub->portcount;
     hub->threads = portcount;
+    hub->detectend = calc_future_tsc(USB_TIME_SIGATT);
 
     // Launch a thread for every port.
     int i;
@@ -416,6 +667,12 @@ usb_enumerate(struct usbhub_s *hub)
     // Wait for threads to complete.
     while (hub->threads)
         yield();
+
+    if (!hub->pipe)
+        dprintf(1, "USB controller %d: %d devices, enumeration done"
+                " %u ms after usb setup\n"
+                , hub->cntl->busid, hub->devcount
+                , calc_elapsed_msecs(UsbSetupTime));
 }
 
 void
@@ -426,13 +683,15 @@ usb_setup(void)
         return;
 
     dprintf(3, "init usb\n");
+    UsbSetupTime = rdtscll();
+    usb_lazy_setup();
 
     // Look for USB controllers
     int count = 0;
     struct pci_device *ehcipci = PCIDevices;
     struct pci_device *pci;
     foreachpci(pci) {
-        if (pci->class != PCI_CLASS_SERIAL_USB)
+        if (pci->class != PCI_CLASS_SERIAL_USB || usb_lazy_skip_slot(pci))
             continue;
 
         if (pci->bdf >= ehcipci->bdf) {
@@ -464,5 +723,7 @@ usb_setup(void)
             uhci_init(pci, count++);
         else if (pci_classprog(pci) == PCI_CLASS_SERIAL_USB_OHCI)
             ohci_init(pci, count++);
+        else if (pci_classprog(pci) == PCI_CLASS_SERIAL_USB_XHCI)
+            xhci_init(pci, count++);
     }
 }
@@ -15,6 +15,9 @@ struct usb_pipe {
     u16 maxpacket;
     u8 tt_devaddr;
     u8 tt_port;
+    u8 dir;
+    u8 maxburst;
+    u8 stream;
 };
 
 // Common information for usb controllers.
@@ -38,6 +41,7 @@ struct usbhub_s {
     u32 threads;
     u32 portcount;
     u32 devcount;
+    u64 detectend;
 };
 
 // Hub callback (32bit) info
@@ -50,10 +54,12 @@ struct usbhub_op_s {
 #define USB_TYPE_UHCI 1
 #define USB_TYPE_OHCI 2
 #define USB_TYPE_EHCI 3
+#define USB_TYPE_XHCI 4
 
 #define USB_FULLSPEED 0
 #define USB_LOWSPEED  1
 #define USB_HIGHSPEED 2
+#define USB_SUPERSPEED 3
 
 #define USB_MAXADDR 127
 
@@ -102,6 +108,8 @@ struct usbhub_op_s {
 #define USB_REQ_SET_INTERFACE           0x0B
 #define USB_REQ_SYNCH_FRAME             0x0C
 
+#define USB_ENDPOINT_HALT               0x00
+
 struct usb_ctrlrequest {
     u8 bRequestType;
     u8 bRequest;
@@ -117,6 +125,7 @@ struct usb_ctrlrequest {
 #define USB_DT_ENDPOINT                 0x05
 #define USB_DT_DEVICE_QUALIFIER         0x06
 #define USB_DT_OTHER_SPEED_CONFIG       0x07
+#define USB_DT_ENDPOINT_COMPANION       0x30
 
 struct usb_device_descriptor {
     u8  bLength;
@@ -181,6 +190,15 @@ struct usb_endpoint_descriptor {
     u8  bInterval;
 } PACKED;
 
+struct usb_ss_ep_comp_descriptor {
+    u8  bLength;
+    u8  bDescriptorType;
+
+    u8  bMaxBurst;
+    u8  bmAttributes;
+    u16 wBytesPerInterval;
+} PACKED;
+
 #define USB_ENDPOINT_NUMBER_MASK        0x0f    /* in bEndpointAddress */
 #define USB_ENDPOINT_DIR_MASK           0x80
 
@@ -202,12 +220,18 @@ void usb_enumerate(struct usbhub_s *hub);
 int send_default_control(struct usb_pipe *pipe, const struct usb_ctrlrequest *req
                          , void *data);
 int usb_send_bulk(struct usb_pipe *pipe, int dir, void *data, int datasize);
+int usb_queue_bulk(struct usb_pipe *pipe, int dir, void *data, int datasize);
+int usb_check_bulk(struct usb_pipe *pipe, int cancel);
 void free_pipe(struct usb_pipe *pipe);
 struct usb_pipe *alloc_bulk_pipe(struct usb_pipe *pipe
                                  , struct usb_endpoint_descriptor *epdesc);
+struct usb_pipe *alloc_bulk_stream_pipe(struct usb_pipe *pipe
+                                        , struct usb_endpoint_descriptor *epdesc
+                                        , int stream);
 struct usb_pipe *alloc_intr_pipe(struct usb_pipe *pipe
                                  , struct usb_endpoint_descriptor *epdesc);
 int usb_poll_intr(struct usb_pipe *pipe, void *data);
+int usb_clear_halt(struct usb_pipe *ctrl, struct usb_pipe *pipe);
 struct usb_endpoint_descriptor *findEndPointDesc(
     struct usb_interface_descriptor *iface, int imax, int type, int dir);
 u32 mkendpFromDesc(struct usb_pipe *pipe
@@ -19,10 +19,24 @@
 #include "virtio-blk.h"
 #include "disk.h"
 
+// Maximum number of request chains kept in flight on the virtqueue.
+#define VIRTIO_BLK_MAX_REQS    16
+// Maximum number of blocks described by a single request chain.
+#define VIRTIO_BLK_MAX_SECTORS 128
+
+struct virtio_blk_req {
+    struct virtio_blk_outhdr hdr;
+    u16 count;
+    u8 status;
+};
+
 struct virtiodrive_s {
     struct drive_s drive;
     struct vring_virtqueue *vq;
-    u16 ioaddr;
+    struct virtio_blk_req *reqs;
+    struct vp_device vp;
+    u16 max_reqs;
+    u16 max_sectors;
 };
 
 static int
@@ -31,47 +45,84 @@ virtio_blk_op(struct disk_op_s *op, int write)
     struct virtiodrive_s *vdrive_g =
         container_of(op->drive_g, struct virtiodrive_s, drive);
     struct vring_virtqueue *vq = GET_GLOBAL(vdrive_g->vq);
-    struct virtio_blk_outhdr hdr = {
-        .type = write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN,
-        .ioprio = 0,
-        .sector = op->lba,
-    };
-    u8 status = VIRTIO_BLK_S_UNSUPP;
-    struct vring_list sg[] = {
-        {
-            .addr	= MAKE_FLATPTR(GET_SEG(SS), &hdr),
-            .length	= sizeof(hdr),
-        },
-        {
-            .addr	= op->buf_fl,
-            .length	= GET_GLOBAL(vdrive_g->drive.blksize) * op->count,
-        },
-        {
-            .addr	= MAKE_FLATPTR(GET_SEG(SS), &status),
-            .length	= sizeof(status),
-        },
-    };
-
-    /* Add to virtqueue and kick host */
-    if (write)
-        vring_add_buf(vq, sg, 2, 1, 0, 0);
-    else
-        vring_add_buf(vq, sg, 1, 2, 0, 0);
-    vring_kick(GET_GLOBAL(vdrive_g->ioaddr), vq, 1);
-
-    /* Wait for reply */
-    while (!vring_more_used(vq))
-        usleep(5);
-
-    /* Reclaim virtqueue element */
-    vring_get_buf(vq, NULL);
-
-    /* Clear interrupt status register.  Avoid leaving interrupts stuck if
-     * VRING_AVAIL_F_NO_INTERRUPT was ignored and interrupts were raised.
-     */
-    vp_get_isr(GET_GLOBAL(vdrive_g->ioaddr));
-
-    return status == VIRTIO_BLK_S_OK ? DISK_RET_SUCCESS : DISK_RET_EBADTRACK;
+    struct virtio_blk_req *reqs = GET_GLOBAL(vdrive_g->reqs);
+    struct vp_device *vp = &vdrive_g->vp;
+    u16 blksize = drive_blksize(&vdrive_g->drive);
+    u8 shift = GET_GLOBAL(vdrive_g->drive.blkshift);
+    u16 max_reqs = GET_GLOBAL(vdrive_g->max_reqs);
+    u16 max_sectors = GET_GLOBAL(vdrive_g->max_sectors);
+    u64 lba = op->lba;
+    char *buf_fl = op->buf_fl;
+    u16 todo = op->count, done = 0;
+    int ret = DISK_RET_SUCCESS;
+
+    while (todo) {
+        /* Queue up a batch of request chains */
+        int num_added = 0;
+        while (todo && num_added < max_reqs) {
+            struct virtio_blk_req *req = &reqs[num_added];
+            u16 count = todo > max_sectors ? max_sectors : todo;
+            SET_FLATPTR(req->hdr.type,
+                        write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN);
+            SET_FLATPTR(req->hdr.ioprio, 0);
+            SET_FLATPTR(req->hdr.sector, lba << shift);
+            SET_FLATPTR(req->count, count);
+            SET_FLATPTR(req->status, VIRTIO_BLK_S_UNSUPP);
+            struct vring_list sg[] = {
+                {
+                    .addr	= (void*)&req->hdr,
+                    .length	= sizeof(req->hdr),
+                },
+                {
+                    .addr	= buf_fl,
+                    .length	= (u32)blksize * count,
+                },
+                {
+                    .addr	= (void*)&req->status,
+                    .length	= sizeof(req->status),
+                },
+            };
+            if (write)
+                vring_add_buf(vq, sg, 2, 1, num_added, num_added);
+            else
+                vring_add_buf(vq, sg, 1, 2, num_added, num_added);
+            num_added++;
+            lba += count;
+            buf_fl += (u32)blksize * count;
+            todo -= count;
+        }
+
+        /* Kick host once for the whole batch */
+        vring_kick(vp, vq, num_added);
+
+        /* Wait for replies - the host may complete them in any order */
+        int i;
+        for (i = 0; i < num_added; i++) {
+            while (!vring_more_used(vq))
+                usleep(5);
+            vring_get_buf(vq, NULL);
+        }
+
+        /* Clear interrupt status register.  Avoid leaving interrupts stuck if
+         * VRING_AVAIL_F_NO_INTERRUPT was ignored and interrupts were raised.
+         */
+        vp_get_isr(vp);
+
+        /* Only report the leading run of successful blocks */
+        for (i = 0; i < num_added; i++) {
+            struct virtio_blk_req *req = &reqs[i];
+            if (GET_FLATPTR(req->status) != VIRTIO_BLK_S_OK) {
+                ret = DISK_RET_EBADTRACK;
+                break;
+            }
+            done += GET_FLATPTR(req->count);
+        }
+        if (ret)
+            break;
+    }
+
+    op->count = done;
+    return ret;
 }
 
 int
@@ -111,33 +162,56 @@ init_virtio_blk(struct pci_device *pci)
     vdrive_g->drive.type = DTYPE_VIRTIO_BLK;
     vdrive_g->drive.cntl_id = bdf;
 
-    u16 ioaddr = vp_init_simple(bdf);
-    vdrive_g->ioaddr = ioaddr;
-    if (vp_find_vq(ioaddr, 0, &vdrive_g->vq) < 0 ) {
+    struct vp_device *vp = &vdrive_g->vp;
+    if (vp_init_simple(vp, pci) < 0)
+        goto fail;
+    if (vp_find_vq(vp, 0, &vdrive_g->vq) < 0) {
         dprintf(1, "fail to find vq for virtio-blk %x:%x\n",
                 pci_bdf_to_bus(bdf), pci_bdf_to_dev(bdf));
         goto fail;
     }
 
+    // Each request chain uses three descriptors (or one indirect slot).
+    vdrive_g->max_reqs = vring_max_bufs(vdrive_g->vq, 3);
+    if (vdrive_g->max_reqs > VIRTIO_BLK_MAX_REQS)
+        vdrive_g->max_reqs = VIRTIO_BLK_MAX_REQS;
+    vdrive_g->reqs = malloc_low(sizeof(*vdrive_g->reqs) * vdrive_g->max_reqs);
+    if (!vdrive_g->reqs) {
+        warn_noalloc();
+        goto fail;
+    }
+
     struct virtio_blk_config cfg;
-    vp_get(ioaddr, 0, &cfg, sizeof(cfg));
+    vp_get(vp, 0, &cfg, sizeof(cfg));
 
-    u32 f = vp_get_features(ioaddr);
+    u32 f = vp_get_features(vp);
     vdrive_g->drive.blksize = (f & (1 << VIRTIO_BLK_F_BLK_SIZE)) ?
         cfg.blk_size : DISK_SECTOR_SIZE;
 
+    // The capacity is always in 512 byte units.
     vdrive_g->drive.sectors = cfg.capacity;
-    dprintf(3, "virtio-blk %x:%x blksize=%d sectors=%u\n",
-            pci_bdf_to_bus(bdf), pci_bdf_to_dev(bdf),
-            vdrive_g->drive.blksize, (u32)vdrive_g->drive.sectors);
-
-    if (vdrive_g->drive.blksize != DISK_SECTOR_SIZE) {
+    if (vdrive_g->drive.blksize > DISK_SECTOR_SIZE)
+        vdrive_g->drive.sectors >>= (__ffs(vdrive_g->drive.blksize)
+                                     - __ffs(DISK_SECTOR_SIZE));
+    if (blkemu_init(&vdrive_g->drive) < 0) {
         dprintf(1, "virtio-blk %x:%x block size %d is unsupported\n",
                 pci_bdf_to_bus(bdf), pci_bdf_to_dev(bdf),
                 vdrive_g->drive.blksize);
         goto fail;
     }
 
+    u16 blksize = vdrive_g->drive.blksize << vdrive_g->drive.blkshift;
+    vdrive_g->max_sectors = VIRTIO_BLK_MAX_SECTORS;
+    if (f & (1 << VIRTIO_BLK_F_SIZE_MAX)
+        && cfg.size_max / blksize < vdrive_g->max_sectors)
+        vdrive_g->max_sectors = cfg.size_max / blksize;
+    if (!vdrive_g->max_sectors)
+        vdrive_g->max_sectors = 1;
+    dprintf(3, "virtio-blk %x:%x blksize=%d sectors=%u reqs=%d max=%d\n",
+            pci_bdf_to_bus(bdf), pci_bdf_to_dev(bdf),
+            blksize, (u32)vdrive_g->drive.sectors,
+            vdrive_g->max_reqs, vdrive_g->max_sectors);
+
     vdrive_g->drive.pchs.cylinders = cfg.cylinders;
     vdrive_g->drive.pchs.heads = cfg.heads;
     vdrive_g->drive.pchs.spt = cfg.sectors;
@@ -146,11 +220,11 @@ init_virtio_blk(struct pci_device *pci)
 
     boot_add_hd(&vdrive_g->drive, desc, bootprio_find_pci_device(pci));
 
-    vp_set_status(ioaddr, VIRTIO_CONFIG_S_ACKNOWLEDGE |
-                  VIRTIO_CONFIG_S_DRIVER | VIRTIO_CONFIG_S_DRIVER_OK);
+    vp_set_status(vp, vp_get_status(vp) | VIRTIO_CONFIG_S_DRIVER_OK);
     return;
 
 fail:
+    free(vdrive_g->reqs);
     free(vdrive_g->vq);
     free(vdrive_g);
 }
@@ -167,7 +241,8 @@ virtio_blk_setup(void)
     struct pci_device *pci;
     foreachpci(pci) {
         if (pci->vendor != PCI_VENDOR_ID_REDHAT_QUMRANET
-            || pci->device != PCI_DEVICE_ID_VIRTIO_BLK)
+            || (pci->device != PCI_DEVICE_ID_VIRTIO_BLK
+                && pci->device != PCI_DEVICE_ID_VIRTIO_BLK_10))
             continue;
         init_virtio_blk(pci);
     }
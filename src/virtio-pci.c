@@ -19,10 +19,193 @@
 #include "virtio-pci.h"
 #include "config.h" // CONFIG_DEBUG_LEVEL
 #include "util.h" // dprintf
+#include "biosvar.h" // GET_GLOBAL
 #include "pci.h" // pci_config_readl
 #include "pci_regs.h" // PCI_BASE_ADDRESS_0
+#include "pci_ids.h" // PCI_DEVICE_ID_VIRTIO_10_FIRST
 
-int vp_find_vq(unsigned int ioaddr, int queue_index,
+/* Point the VIRTIO_PCI_CAP_PCI_CFG window at a register of a region. */
+static u32 vp_cfg_window(struct vp_device *vp, struct vp_cap *cap,
+                         u32 offset, u8 size)
+{
+    u16 bdf = GET_GLOBAL(vp->bdf);
+    u8 cfg = GET_GLOBAL(vp->cfg_off);
+
+    pci_config_writeb(bdf, cfg + offsetof(struct virtio_pci_cap, bar),
+                      GET_GLOBAL(cap->bar));
+    pci_config_writel(bdf, cfg + offsetof(struct virtio_pci_cap, offset),
+                      GET_GLOBAL(cap->offset) + offset);
+    pci_config_writel(bdf, cfg + offsetof(struct virtio_pci_cap, length),
+                      size);
+    return cfg + offsetof(struct virtio_pci_cfg_cap, pci_cfg_data);
+}
+
+u32 _vp_read(struct vp_device *vp, struct vp_cap *cap, u32 offset, u8 size)
+{
+    u32 addr = GET_GLOBAL(cap->addr) + offset;
+
+    if (GET_GLOBAL(cap->is_io)) {
+        switch (size) {
+        case 4: return inl(addr);
+        case 2: return inw(addr);
+        default: return inb(addr);
+        }
+    }
+    if (MODESEGMENT) {
+        /* mmio is out of reach from 16bit mode - use the config window */
+        u16 bdf = GET_GLOBAL(vp->bdf);
+        u32 data = vp_cfg_window(vp, cap, offset, size);
+        switch (size) {
+        case 4: return pci_config_readl(bdf, data);
+        case 2: return pci_config_readw(bdf, data);
+        default: return pci_config_readb(bdf, data);
+        }
+    }
+    switch (size) {
+    case 4: return readl((void*)addr);
+    case 2: return readw((void*)addr);
+    default: return readb((void*)addr);
+    }
+}
+
+void _vp_write(struct vp_device *vp, struct vp_cap *cap, u32 offset, u8 size,
+               u32 val)
+{
+    u32 addr = GET_GLOBAL(cap->addr) + offset;
+
+    if (GET_GLOBAL(cap->is_io)) {
+        switch (size) {
+        case 4: outl(val, addr); break;
+        case 2: outw(val, addr); break;
+        default: outb(val, addr); break;
+        }
+        return;
+    }
+    if (MODESEGMENT) {
+        /* mmio is out of reach from 16bit mode - use the config window */
+        u16 bdf = GET_GLOBAL(vp->bdf);
+        u32 data = vp_cfg_window(vp, cap, offset, size);
+        switch (size) {
+        case 4: pci_config_writel(bdf, data, val); break;
+        case 2: pci_config_writew(bdf, data, val); break;
+        default: pci_config_writeb(bdf, data, val); break;
+        }
+        return;
+    }
+    switch (size) {
+    case 4: writel((void*)addr, val); break;
+    case 2: writew((void*)addr, val); break;
+    default: writeb((void*)addr, val); break;
+    }
+}
+
+u64 vp_get_features(struct vp_device *vp)
+{
+    if (!GET_GLOBAL(vp->use_modern))
+        return _vp_read(vp, &vp->legacy, VIRTIO_PCI_HOST_FEATURES, 4);
+
+    vp_write(vp, common, virtio_pci_common_cfg, device_feature_select, 0);
+    u32 lo = vp_read(vp, common, virtio_pci_common_cfg, device_feature);
+    vp_write(vp, common, virtio_pci_common_cfg, device_feature_select, 1);
+    u32 hi = vp_read(vp, common, virtio_pci_common_cfg, device_feature);
+    return ((u64)hi << 32) | lo;
+}
+
+void vp_set_features(struct vp_device *vp, u64 features)
+{
+    if (!GET_GLOBAL(vp->use_modern)) {
+        _vp_write(vp, &vp->legacy, VIRTIO_PCI_GUEST_FEATURES, 4, features);
+        return;
+    }
+
+    vp_write(vp, common, virtio_pci_common_cfg, guest_feature_select, 0);
+    vp_write(vp, common, virtio_pci_common_cfg, guest_feature, features);
+    vp_write(vp, common, virtio_pci_common_cfg, guest_feature_select, 1);
+    vp_write(vp, common, virtio_pci_common_cfg, guest_feature, features >> 32);
+}
+
+void vp_get(struct vp_device *vp, unsigned offset, void *buf, unsigned len)
+{
+    u8 *ptr = buf;
+    unsigned i;
+
+    for (i = 0; i < len; i++) {
+        if (GET_GLOBAL(vp->use_modern))
+            ptr[i] = _vp_read(vp, &vp->device, offset + i, 1);
+        else
+            ptr[i] = _vp_read(vp, &vp->legacy,
+                              VIRTIO_PCI_CONFIG + offset + i, 1);
+    }
+}
+
+void vp_set(struct vp_device *vp, unsigned offset, void *buf, unsigned len)
+{
+    u8 *ptr = buf;
+    unsigned i;
+
+    for (i = 0; i < len; i++) {
+        if (GET_GLOBAL(vp->use_modern))
+            _vp_write(vp, &vp->device, offset + i, 1, ptr[i]);
+        else
+            _vp_write(vp, &vp->legacy,
+                      VIRTIO_PCI_CONFIG + offset + i, 1, ptr[i]);
+    }
+}
+
+u8 vp_get_status(struct vp_device *vp)
+{
+    if (GET_GLOBAL(vp->use_modern))
+        return vp_read(vp, common, virtio_pci_common_cfg, device_status);
+    return _vp_read(vp, &vp->legacy, VIRTIO_PCI_STATUS, 1);
+}
+
+void vp_set_status(struct vp_device *vp, u8 status)
+{
+    if (status == 0)        /* reset */
+        return;
+    if (GET_GLOBAL(vp->use_modern))
+        vp_write(vp, common, virtio_pci_common_cfg, device_status, status);
+    else
+        _vp_write(vp, &vp->legacy, VIRTIO_PCI_STATUS, 1, status);
+}
+
+u8 vp_get_isr(struct vp_device *vp)
+{
+    if (GET_GLOBAL(vp->use_modern))
+        return _vp_read(vp, &vp->isr, 0, 1);
+    return _vp_read(vp, &vp->legacy, VIRTIO_PCI_ISR, 1);
+}
+
+void vp_reset(struct vp_device *vp)
+{
+    if (GET_GLOBAL(vp->use_modern)) {
+        vp_write(vp, common, virtio_pci_common_cfg, device_status, 0);
+        /* the device acknowledges the reset by reading back zero */
+        u64 end = calc_future_tsc(100);
+        while (vp_read(vp, common, virtio_pci_common_cfg, device_status)) {
+            if (check_tsc(end)) {
+                warn_timeout();
+                break;
+            }
+            udelay(1);
+        }
+    } else {
+        _vp_write(vp, &vp->legacy, VIRTIO_PCI_STATUS, 1, 0);
+    }
+    vp_get_isr(vp);
+}
+
+void vp_notify(struct vp_device *vp, struct vring_virtqueue *vq)
+{
+    if (GET_GLOBAL(vp->use_modern))
+        _vp_write(vp, &vp->notify, GET_FLATPTR(vq->queue_notify_off), 2,
+                  GET_FLATPTR(vq->queue_index));
+    else
+        _vp_write(vp, &vp->legacy, VIRTIO_PCI_QUEUE_NOTIFY, 2,
+                  GET_FLATPTR(vq->queue_index));
+}
+
+int vp_find_vq(struct vp_device *vp, int queue_index,
                struct vring_virtqueue **p_vq)
 {
    u16 num;
@@ -37,29 +220,54 @@ int vp_find_vq(unsigned int ioaddr, int queue_index,
 
    /* select the queue */
 
-   outw(queue_index, ioaddr + VIRTIO_PCI_QUEUE_SEL);
+   if (vp->use_modern)
+       vp_write(vp, common, virtio_pci_common_cfg, queue_select, queue_index);
+   else
+       _vp_write(vp, &vp->legacy, VIRTIO_PCI_QUEUE_SEL, 2, queue_index);
 
    /* check if the queue is available */
 
-   num = inw(ioaddr + VIRTIO_PCI_QUEUE_NUM);
+   if (vp->use_modern)
+       num = vp_read(vp, common, virtio_pci_common_cfg, queue_size);
+   else
+       num = _vp_read(vp, &vp->legacy, VIRTIO_PCI_QUEUE_NUM, 2);
    if (!num) {
        dprintf(1, "ERROR: queue size is 0\n");
        goto fail;
    }
 
    if (num > MAX_QUEUE_NUM) {
-       dprintf(1, "ERROR: queue size %d > %d\n", num, MAX_QUEUE_NUM);
-       goto fail;
+       if (vp->use_modern) {
+           /* 1.0 devices let the driver pick a smaller queue */
+           num = MAX_QUEUE_NUM;
+           vp_write(vp, common, virtio_pci_common_cfg, queue_size, num);
+       } else {
+           dprintf(1, "ERROR: queue size %d > %d\n", num, MAX_QUEUE_NUM);
+           goto fail;
+       }
    }
 
    /* check if the queue is already active */
 
-   if (inl(ioaddr + VIRTIO_PCI_QUEUE_PFN)) {
+   if (vp->use_modern
+       ? vp_read(vp, common, virtio_pci_common_cfg, queue_enable)
+       : _vp_read(vp, &vp->legacy, VIRTIO_PCI_QUEUE_PFN, 4)) {
        dprintf(1, "ERROR: queue already active\n");
        goto fail;
    }
 
    vq->queue_index = queue_index;
+   vq->event_idx = !!(vp->features & (1 << VIRTIO_RING_F_EVENT_IDX));
+
+   /* set up the indirect descriptor pool */
+
+   if (vp->features & (1 << VIRTIO_RING_F_INDIRECT_DESC)) {
+       int i, j;
+       for (i = 0; i < VRING_INDIRECT_NUM; i++)
+           for (j = 0; j < VRING_INDIRECT_MAX - 1; j++)
+               vq->indirect[i][j].next = j + 1;
+       vq->indirect_free = (1 << VRING_INDIRECT_NUM) - 1;
+   }
 
    /* initialize the queue */
 
@@ -71,8 +279,23 @@ int vp_find_vq(unsigned int ioaddr, int queue_index,
     * NOTE: vr->desc is initialized by vring_init()
     */
 
-   outl((unsigned long)virt_to_phys(vr->desc) >> PAGE_SHIFT,
-        ioaddr + VIRTIO_PCI_QUEUE_PFN);
+   if (vp->use_modern) {
+       vp_write(vp, common, virtio_pci_common_cfg, queue_desc_lo,
+                (unsigned long)virt_to_phys(vr->desc));
+       vp_write(vp, common, virtio_pci_common_cfg, queue_desc_hi, 0);
+       vp_write(vp, common, virtio_pci_common_cfg, queue_avail_lo,
+                (unsigned long)virt_to_phys(vr->avail));
+       vp_write(vp, common, virtio_pci_common_cfg, queue_avail_hi, 0);
+       vp_write(vp, common, virtio_pci_common_cfg, queue_used_lo,
+                (unsigned long)virt_to_phys(vr->used));
+       vp_write(vp, common, virtio_pci_common_cfg, queue_used_hi, 0);
+       vq->queue_notify_off = vp->notify_off_multiplier *
+           vp_read(vp, common, virtio_pci_common_cfg, queue_notify_off);
+       vp_write(vp, common, virtio_pci_common_cfg, queue_enable, 1);
+   } else {
+       _vp_write(vp, &vp->legacy, VIRTIO_PCI_QUEUE_PFN, 4,
+                 (unsigned long)virt_to_phys(vr->desc) >> PAGE_SHIFT);
+   }
 
    return num;
 
@@ -82,13 +305,122 @@ fail:
    return -1;
 }
 
-u16 vp_init_simple(u16 bdf)
+/* Fill in a register region from a virtio vendor capability. */
+static void vp_init_cap(struct vp_device *vp, struct vp_cap *cap, u8 cap_off)
+{
+    u16 bdf = vp->bdf;
+    u8 bar = pci_config_readb(bdf, cap_off +
+                              offsetof(struct virtio_pci_cap, bar));
+    u32 offset = pci_config_readl(bdf, cap_off +
+                                  offsetof(struct virtio_pci_cap, offset));
+
+    if (cap->addr || bar >= PCI_NUM_REGIONS - 1)
+        /* only the first capability of each type is used */
+        return;
+
+    u32 addr = pci_config_readl(bdf, PCI_BASE_ADDRESS_0 + bar * 4);
+    if (addr & PCI_BASE_ADDRESS_SPACE_IO) {
+        cap->is_io = 1;
+        addr &= PCI_BASE_ADDRESS_IO_MASK;
+    } else {
+        if ((addr & PCI_BASE_ADDRESS_MEM_TYPE_64)
+            && pci_config_readl(bdf, PCI_BASE_ADDRESS_0 + bar * 4 + 4)) {
+            dprintf(1, "virtio %x:%x bar %d is above 4G\n",
+                    pci_bdf_to_bus(bdf), pci_bdf_to_dev(bdf), bar);
+            return;
+        }
+        addr &= PCI_BASE_ADDRESS_MEM_MASK;
+    }
+    if (!addr)
+        return;
+    cap->addr = addr + offset;
+    cap->offset = offset;
+    cap->bar = bar;
+}
+
+int vp_init_simple(struct vp_device *vp, struct pci_device *pci)
 {
-    u16 ioaddr = pci_config_readl(bdf, PCI_BASE_ADDRESS_0) &
-        PCI_BASE_ADDRESS_IO_MASK;
+    u16 bdf = pci->bdf;
+
+    memset(vp, 0, sizeof(*vp));
+    vp->bdf = bdf;
+
+    /* look for the virtio 1.0 register layout */
+
+    u8 cap = pci_find_capability(bdf, PCI_CAP_ID_VNDR, 0);
+    for (; cap; cap = pci_find_capability(bdf, PCI_CAP_ID_VNDR, cap)) {
+        u8 type = pci_config_readb(bdf, cap +
+                                   offsetof(struct virtio_pci_cap, cfg_type));
+        switch (type) {
+        case VIRTIO_PCI_CAP_COMMON_CFG:
+            vp_init_cap(vp, &vp->common, cap);
+            break;
+        case VIRTIO_PCI_CAP_NOTIFY_CFG:
+            if (vp->notify.addr)
+                break;
+            vp_init_cap(vp, &vp->notify, cap);
+            vp->notify_off_multiplier = pci_config_readl(
+                bdf, cap + offsetof(struct virtio_pci_notify_cap,
+                                    notify_off_multiplier));
+            break;
+        case VIRTIO_PCI_CAP_ISR_CFG:
+            vp_init_cap(vp, &vp->isr, cap);
+            break;
+        case VIRTIO_PCI_CAP_DEVICE_CFG:
+            vp_init_cap(vp, &vp->device, cap);
+            break;
+        case VIRTIO_PCI_CAP_PCI_CFG:
+            if (!vp->cfg_off)
+                vp->cfg_off = cap;
+            break;
+        }
+    }
+
+    /* Runtime (16bit) code only notifies queues and reads the isr.  If
+     * those registers are mmio, 16bit code has to go through the
+     * config window - several config space accesses per register.
+     * Transitional devices then keep using the legacy i/o bar, the
+     * window is only used for modern-only devices. */
+    int modern_only = pci->device >= PCI_DEVICE_ID_VIRTIO_10_FIRST;
+    int have_caps = (vp->common.addr && vp->notify.addr && vp->isr.addr
+                     && vp->device.addr);
+    int io_runtime = vp->notify.is_io && vp->isr.is_io;
+    if (have_caps && (io_runtime || (modern_only && vp->cfg_off))) {
+        dprintf(1, "virtio %x:%x using 1.0 transport\n",
+                pci_bdf_to_bus(bdf), pci_bdf_to_dev(bdf));
+        vp->use_modern = 1;
+    } else if (modern_only) {
+        dprintf(1, "virtio %x:%x has no usable 1.0 capabilities\n",
+                pci_bdf_to_bus(bdf), pci_bdf_to_dev(bdf));
+        return -1;
+    } else {
+        vp->legacy.addr = pci_config_readl(bdf, PCI_BASE_ADDRESS_0) &
+            PCI_BASE_ADDRESS_IO_MASK;
+        vp->legacy.is_io = 1;
+    }
+
+    vp_reset(vp);
+    u8 status = VIRTIO_CONFIG_S_ACKNOWLEDGE | VIRTIO_CONFIG_S_DRIVER;
+    vp_set_status(vp, status);
+
+    /* negotiate features */
 
-    vp_reset(ioaddr);
-    vp_set_status(ioaddr, VIRTIO_CONFIG_S_ACKNOWLEDGE |
-                  VIRTIO_CONFIG_S_DRIVER );
-    return ioaddr;
+    u64 features = vp_get_features(vp);
+    u64 wanted = VIRTIO_RING_FEATURES;
+    if (vp->use_modern)
+        wanted |= 1ULL << VIRTIO_F_VERSION_1;
+    features &= wanted;
+    vp_set_features(vp, features);
+    vp->features = features;
+    if (vp->use_modern) {
+        status |= VIRTIO_CONFIG_S_FEATURES_OK;
+        vp_set_status(vp, status);
+        if (!(vp_get_status(vp) & VIRTIO_CONFIG_S_FEATURES_OK)) {
+            dprintf(1, "virtio %x:%x rejected features\n",
+                    pci_bdf_to_bus(bdf), pci_bdf_to_dev(bdf));
+            vp_set_status(vp, status | VIRTIO_CONFIG_S_FAILED);
+            return -1;
+        }
+    }
+    return 0;
 }
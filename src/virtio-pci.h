@@ -1,6 +1,7 @@
 #ifndef _VIRTIO_PCI_H
 #define _VIRTIO_PCI_H
 
+#include "types.h" // u32
 #include "ioport.h" // inl
 
 /* A 32-bit r/o bitmask of the features supported by the host */
@@ -39,77 +40,102 @@
 /* Virtio ABI version, this must match exactly */
 #define VIRTIO_PCI_ABI_VERSION          0
 
-static inline u32 vp_get_features(unsigned int ioaddr)
-{
-   return inl(ioaddr + VIRTIO_PCI_HOST_FEATURES);
-}
-
-static inline void vp_set_features(unsigned int ioaddr, u32 features)
-{
-        outl(features, ioaddr + VIRTIO_PCI_GUEST_FEATURES);
-}
-
-static inline void vp_get(unsigned int ioaddr, unsigned offset,
-                     void *buf, unsigned len)
-{
-   u8 *ptr = buf;
-   unsigned i;
-
-   for (i = 0; i < len; i++)
-           ptr[i] = inb(ioaddr + VIRTIO_PCI_CONFIG + offset + i);
-}
-
-static inline u8 vp_get_status(unsigned int ioaddr)
-{
-   return inb(ioaddr + VIRTIO_PCI_STATUS);
-}
-
-static inline void vp_set(unsigned int ioaddr, unsigned offset,
-                     void *buf, unsigned len)
-{
-   u8 *ptr = buf;
-   unsigned i;
-
-   for (i = 0; i < len; i++)
-           outb(ioaddr + VIRTIO_PCI_CONFIG + offset + i, ptr[i]);
-}
-
-static inline void vp_set_status(unsigned int ioaddr, u8 status)
-{
-   if (status == 0)        /* reset */
-           return;
-   outb(status, ioaddr + VIRTIO_PCI_STATUS);
-}
-
-static inline u8 vp_get_isr(unsigned int ioaddr)
-{
-   return inb(ioaddr + VIRTIO_PCI_ISR);
-}
-
-static inline void vp_reset(unsigned int ioaddr)
-{
-   outb(0, ioaddr + VIRTIO_PCI_STATUS);
-   (void)inb(ioaddr + VIRTIO_PCI_ISR);
-}
-
-static inline void vp_notify(unsigned int ioaddr, int queue_index)
-{
-   outw(queue_index, ioaddr + VIRTIO_PCI_QUEUE_NOTIFY);
-}
-
-static inline void vp_del_vq(unsigned int ioaddr, int queue_index)
-{
-   /* select the queue */
-
-   outw(queue_index, ioaddr + VIRTIO_PCI_QUEUE_SEL);
-
-   /* deactivate the queue */
-
-   outl(0, ioaddr + VIRTIO_PCI_QUEUE_PFN);
-}
-
+/* Virtio 1.0 devices must negotiate this feature */
+#define VIRTIO_F_VERSION_1              32
+
+/* Virtio 1.0 vendor specific PCI capabilities */
+#define VIRTIO_PCI_CAP_COMMON_CFG       1
+#define VIRTIO_PCI_CAP_NOTIFY_CFG       2
+#define VIRTIO_PCI_CAP_ISR_CFG          3
+#define VIRTIO_PCI_CAP_DEVICE_CFG       4
+#define VIRTIO_PCI_CAP_PCI_CFG          5
+
+struct virtio_pci_cap {
+    u8 cap_vndr;
+    u8 cap_next;
+    u8 cap_len;
+    u8 cfg_type;
+    u8 bar;
+    u8 padding[3];
+    u32 offset;
+    u32 length;
+} PACKED;
+
+struct virtio_pci_notify_cap {
+    struct virtio_pci_cap cap;
+    u32 notify_off_multiplier;
+} PACKED;
+
+struct virtio_pci_cfg_cap {
+    struct virtio_pci_cap cap;
+    u8 pci_cfg_data[4];
+} PACKED;
+
+struct virtio_pci_common_cfg {
+    u32 device_feature_select;
+    u32 device_feature;
+    u32 guest_feature_select;
+    u32 guest_feature;
+    u16 msix_config;
+    u16 num_queues;
+    u8 device_status;
+    u8 config_generation;
+    u16 queue_select;
+    u16 queue_size;
+    u16 queue_msix_vector;
+    u16 queue_enable;
+    u16 queue_notify_off;
+    u32 queue_desc_lo;
+    u32 queue_desc_hi;
+    u32 queue_avail_lo;
+    u32 queue_avail_hi;
+    u32 queue_used_lo;
+    u32 queue_used_hi;
+} PACKED;
+
+/* A register region - an i/o port range or a 32bit flat mmio range */
+struct vp_cap {
+    u32 addr;
+    u32 offset;
+    u8 bar;
+    u8 is_io;
+};
+
+/* A virtio device on either the legacy or the 1.0 transport.  The
+ * struct is read with GET_GLOBAL, so it must live in the f-segment
+ * (or on the stack during 32bit init). */
+struct vp_device {
+    struct vp_cap common, notify, isr, device, legacy;
+    u32 notify_off_multiplier;
+    u64 features;
+    u16 bdf;
+    u8 cfg_off;
+    u8 use_modern;
+};
+
+u32 _vp_read(struct vp_device *vp, struct vp_cap *cap, u32 offset, u8 size);
+void _vp_write(struct vp_device *vp, struct vp_cap *cap, u32 offset, u8 size,
+               u32 val);
+
+#define vp_read(vp, cap, struct_, field)                                \
+    _vp_read((vp), &(vp)->cap, offsetof(struct struct_, field),         \
+             FIELD_SIZEOF(struct struct_, field))
+#define vp_write(vp, cap, struct_, field, val)                          \
+    _vp_write((vp), &(vp)->cap, offsetof(struct struct_, field),        \
+              FIELD_SIZEOF(struct struct_, field), (val))
+
+struct pci_device;
 struct vring_virtqueue;
-u16 vp_init_simple(u16 bdf);
-int vp_find_vq(unsigned int ioaddr, int queue_index,
+u64 vp_get_features(struct vp_device *vp);
+void vp_set_features(struct vp_device *vp, u64 features);
+void vp_get(struct vp_device *vp, unsigned offset, void *buf, unsigned len);
+void vp_set(struct vp_device *vp, unsigned offset, void *buf, unsigned len);
+u8 vp_get_status(struct vp_device *vp);
+void vp_set_status(struct vp_device *vp, u8 status);
+u8 vp_get_isr(struct vp_device *vp);
+void vp_reset(struct vp_device *vp);
+void vp_notify(struct vp_device *vp, struct vring_virtqueue *vq);
+int vp_init_simple(struct vp_device *vp, struct pci_device *pci);
+int vp_find_vq(struct vp_device *vp, int queue_index,
                struct vring_virtqueue **p_vq);
 #endif /* _VIRTIO_PCI_H_ */
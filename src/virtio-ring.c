@@ -56,6 +56,15 @@ void vring_detach(struct vring_virtqueue *vq, unsigned int head)
     struct vring_desc *desc = GET_FLATPTR(vr->desc);
     unsigned int i;
 
+    /* release indirect table, if any */
+
+    if (GET_FLATPTR(desc[head].flags) & VRING_DESC_F_INDIRECT) {
+        u32 table = ((u32)GET_FLATPTR(desc[head].addr)
+                     - (u32)virt_to_phys(vq->indirect)) / sizeof(vq->indirect[0]);
+        SET_FLATPTR(vq->indirect_free,
+                    GET_FLATPTR(vq->indirect_free) | (1 << table));
+    }
+
     /* find end of given descriptor */
 
     i = head;
@@ -94,25 +103,30 @@ int vring_get_buf(struct vring_virtqueue *vq, unsigned int *len)
 
     vring_detach(vq, id);
 
-    SET_FLATPTR(vq->last_used_idx, GET_FLATPTR(vq->last_used_idx) + 1);
+    u16 last_used_idx = GET_FLATPTR(vq->last_used_idx) + 1;
+    SET_FLATPTR(vq->last_used_idx, last_used_idx);
+    /* Keep used_event just behind the consumed entries, so that with
+     * EVENT_IDX the device never raises a used ring interrupt. */
+    struct vring_avail *avail = GET_FLATPTR(vr->avail);
+    u16 *used_event = (void*)&avail->ring[GET_FLATPTR(vr->num)];
+    SET_FLATPTR(*used_event, (u16)(last_used_idx - 1));
 
     return ret;
 }
 
-void vring_add_buf(struct vring_virtqueue *vq,
-                   struct vring_list list[],
-                   unsigned int out, unsigned int in,
-                   int index, int num_added)
-{
-    struct vring *vr = &vq->vring;
-    int i, av, head, prev;
-    struct vring_desc *desc = GET_FLATPTR(vr->desc);
-    struct vring_avail *avail = GET_FLATPTR(vr->avail);
+/*
+ * vring_fill_chain
+ *
+ * write list[] into the descriptor chain starting at desc[head] and
+ * return the index following the last descriptor used
+ */
 
-    BUG_ON(out + in == 0);
+static int vring_fill_chain(struct vring_desc *desc, int head,
+                            struct vring_list list[],
+                            unsigned int out, unsigned int in)
+{
+    int i, prev = 0;
 
-    prev = 0;
-    head = GET_FLATPTR(vq->free_head);
     for (i = head; out; i = GET_FLATPTR(desc[i].next), out--) {
         SET_FLATPTR(desc[i].flags, VRING_DESC_F_NEXT);
         SET_FLATPTR(desc[i].addr, (u64)virt_to_phys(list->addr));
@@ -130,7 +144,52 @@ void vring_add_buf(struct vring_virtqueue *vq,
     SET_FLATPTR(desc[prev].flags,
                 GET_FLATPTR(desc[prev].flags) & ~VRING_DESC_F_NEXT);
 
-    SET_FLATPTR(vq->free_head, i);
+    return i;
+}
+
+/*
+ * vring_get_indirect
+ *
+ * grab a free indirect descriptor table, or return -1
+ */
+
+static int vring_get_indirect(struct vring_virtqueue *vq, unsigned int num)
+{
+    u16 free = GET_FLATPTR(vq->indirect_free);
+
+    if (num < 2 || num > VRING_INDIRECT_MAX || !free)
+        return -1;
+    int table = __ffs(free);
+    SET_FLATPTR(vq->indirect_free, free & ~(1 << table));
+    return table;
+}
+
+void vring_add_buf(struct vring_virtqueue *vq,
+                   struct vring_list list[],
+                   unsigned int out, unsigned int in,
+                   int index, int num_added)
+{
+    struct vring *vr = &vq->vring;
+    int av, head, table;
+    struct vring_desc *desc = GET_FLATPTR(vr->desc);
+    struct vring_avail *avail = GET_FLATPTR(vr->avail);
+
+    BUG_ON(out + in == 0);
+
+    head = GET_FLATPTR(vq->free_head);
+    table = vring_get_indirect(vq, out + in);
+    if (table >= 0) {
+        /* describe the whole list with a single ring slot */
+        struct vring_desc *idesc = vq->indirect[table];
+        vring_fill_chain(idesc, 0, list, out, in);
+        SET_FLATPTR(desc[head].flags, VRING_DESC_F_INDIRECT);
+        SET_FLATPTR(desc[head].addr, (u64)virt_to_phys(idesc));
+        SET_FLATPTR(desc[head].len, (out + in) * sizeof(*idesc));
+        SET_FLATPTR(vq->free_head, GET_FLATPTR(desc[head].next));
+    } else {
+        SET_FLATPTR(vq->free_head,
+                    vring_fill_chain(desc, head, list, out, in));
+    }
 
     SET_FLATPTR(vq->vdata[head], index);
 
@@ -138,14 +197,29 @@ void vring_add_buf(struct vring_virtqueue *vq,
     SET_FLATPTR(avail->ring[av], head);
 }
 
-void vring_kick(unsigned int ioaddr, struct vring_virtqueue *vq, int num_added)
+void vring_kick(struct vp_device *vp, struct vring_virtqueue *vq, int num_added)
 {
     struct vring *vr = &vq->vring;
     struct vring_avail *avail = GET_FLATPTR(vr->avail);
+    struct vring_used *used = GET_FLATPTR(vr->used);
+    u16 old = GET_FLATPTR(avail->idx);
+    u16 new = old + num_added;
 
     /* Make sure idx update is done after ring write. */
     smp_wmb();
-    SET_FLATPTR(avail->idx, GET_FLATPTR(avail->idx) + num_added);
+    SET_FLATPTR(avail->idx, new);
+
+    /* Make sure the host sees the new idx before we check if it
+     * wants to be notified. */
+    smp_mb();
+    if (GET_FLATPTR(vq->event_idx)) {
+        u16 num = GET_FLATPTR(vr->num);
+        if (!vring_need_event(GET_FLATPTR(vring_avail_event(used, num)),
+                              new, old))
+            return;
+    } else if (GET_FLATPTR(used->flags) & VRING_USED_F_NO_NOTIFY) {
+        return;
+    }
 
-    vp_notify(ioaddr, GET_FLATPTR(vq->queue_index));
+    vp_notify(vp, vq);
 }
@@ -12,6 +12,8 @@
 /* Compiler barrier is enough as an x86 CPU does not reorder reads or writes */
 #define smp_rmb() barrier()
 #define smp_wmb() barrier()
+/* ... but stores may be reordered after later loads */
+#define smp_mb() asm volatile("lock; addl $0,0(%%esp)" : : : "memory")
 
 /* Status byte for guest to report progress, and synchronize features. */
 /* We have seen device and processed generic fields (VIRTIO_CONFIG_F_VIRTIO) */
@@ -20,13 +22,34 @@
 #define VIRTIO_CONFIG_S_DRIVER          2
 /* Driver has used its parts of the config, and is happy */
 #define VIRTIO_CONFIG_S_DRIVER_OK       4
+/* Driver has finished configuring features */
+#define VIRTIO_CONFIG_S_FEATURES_OK     8
 /* We've given up on this device. */
 #define VIRTIO_CONFIG_S_FAILED          0x80
 
 #define MAX_QUEUE_NUM      (128)
 
+/* The Guest publishes the used index for which it expects an interrupt
+ * at the end of the avail ring. Host should ignore the avail->flags field. */
+/* The Host publishes the avail index for which it expects a kick
+ * at the end of the used ring. Guest should ignore the used->flags field. */
+#define VIRTIO_RING_F_EVENT_IDX 29
+
+/* We support indirect buffer descriptors */
+#define VIRTIO_RING_F_INDIRECT_DESC 28
+
+/* Ring features supported by this implementation. */
+#define VIRTIO_RING_FEATURES   ((1 << VIRTIO_RING_F_EVENT_IDX) | \
+                                (1 << VIRTIO_RING_F_INDIRECT_DESC))
+
+/* Preallocated indirect descriptor tables per virtqueue. */
+#define VRING_INDIRECT_NUM 8
+#define VRING_INDIRECT_MAX 16
+
 #define VRING_DESC_F_NEXT  1
 #define VRING_DESC_F_WRITE 2
+/* This means the buffer contains a list of buffer descriptors. */
+#define VRING_DESC_F_INDIRECT 4
 
 #define VRING_AVAIL_F_NO_INTERRUPT 1
 
@@ -69,9 +92,20 @@ struct vring {
 
 #define vring_size(num) \
    (((((sizeof(struct vring_desc) * num) + \
-      (sizeof(struct vring_avail) + sizeof(u16) * num)) \
+      (sizeof(struct vring_avail) + sizeof(u16) * (num + 1))) \
          + PAGE_MASK) & ~PAGE_MASK) + \
-         (sizeof(struct vring_used) + sizeof(struct vring_used_elem) * num))
+         (sizeof(struct vring_used) + sizeof(struct vring_used_elem) * num \
+          + sizeof(u16)))
+
+/* Event index fields located just past the end of the rings. */
+#define vring_used_event(vr, num) (*(u16*)&(vr)->avail->ring[num])
+#define vring_avail_event(used, num) (*(u16*)&(used)->ring[num])
+
+/* Does the host want a kick after moving avail->idx from old to new_idx? */
+static inline int vring_need_event(u16 event_idx, u16 new_idx, u16 old)
+{
+   return (u16)(new_idx - event_idx - 1) < (u16)(new_idx - old);
+}
 
 typedef unsigned char virtio_queue_t[vring_size(MAX_QUEUE_NUM)];
 
@@ -81,8 +115,13 @@ struct vring_virtqueue {
    u16 free_head;
    u16 last_used_idx;
    u16 vdata[MAX_QUEUE_NUM];
+   struct vring_desc indirect[VRING_INDIRECT_NUM][VRING_INDIRECT_MAX]
+       __aligned(16);
+   u16 indirect_free;
+   u8 event_idx;
    /* PCI */
    int queue_index;
+   u32 queue_notify_off;
 };
 
 struct vring_list {
@@ -109,9 +148,15 @@ static inline void vring_init(struct vring *vr,
    /* disable interrupts */
    vr->avail->flags |= VRING_AVAIL_F_NO_INTERRUPT;
 
-   /* physical address of used must be page aligned */
+   /* with EVENT_IDX the device only interrupts once the used index
+    * passes used_event - start it just behind the (empty) ring, it is
+    * kept there as entries are consumed */
+   vring_used_event(vr, num) = 0xffff;
+
+   /* physical address of used must be page aligned (leave room for
+    * the used_event field) */
 
-   pa = virt_to_phys(&vr->avail->ring[num]);
+   pa = virt_to_phys(&vr->avail->ring[num + 1]);
    pa = (pa + PAGE_MASK) & ~PAGE_MASK;
    vr->used = phys_to_virt(pa);
 
@@ -120,12 +165,24 @@ static inline void vring_init(struct vring *vr,
    vr->desc[i].next = 0;
 }
 
+/* Number of buffers of nsegs segments that fit in the ring at once */
+static inline int vring_max_bufs(struct vring_virtqueue *vq, int nsegs)
+{
+   int num = vq->vring.num, tables = 0;
+
+   ASSERT32FLAT();
+   if (vq->indirect_free && nsegs > 1 && nsegs <= VRING_INDIRECT_MAX)
+      tables = VRING_INDIRECT_NUM < num ? VRING_INDIRECT_NUM : num;
+   return tables + (num - tables) / nsegs;
+}
+
 int vring_more_used(struct vring_virtqueue *vq);
 void vring_detach(struct vring_virtqueue *vq, unsigned int head);
 int vring_get_buf(struct vring_virtqueue *vq, unsigned int *len);
 void vring_add_buf(struct vring_virtqueue *vq, struct vring_list list[],
                    unsigned int out, unsigned int in,
                    int index, int num_added);
-void vring_kick(unsigned int ioaddr, struct vring_virtqueue *vq, int num_added);
+struct vp_device;
+void vring_kick(struct vp_device *vp, struct vring_virtqueue *vq, int num_added);
 
 #endif /* _VIRTIO_RING_H_ */
@@ -23,15 +23,16 @@
 struct virtio_lun_s {
     struct drive_s drive;
     struct pci_device *pci;
+    struct vp_device *vp;
     struct vring_virtqueue *vq;
-    u16 ioaddr;
     u16 target;
     u16 lun;
 };
 
 static int
-virtio_scsi_cmd(u16 ioaddr, struct vring_virtqueue *vq, struct disk_op_s *op,
-                void *cdbcmd, u16 target, u16 lun, u32 len)
+virtio_scsi_cmd(struct vp_device *vp, struct vring_virtqueue *vq,
+                struct disk_op_s *op, void *cdbcmd, u16 target, u16 lun,
+                u32 len)
 {
     struct virtio_scsi_req_cmd req;
     struct virtio_scsi_resp_cmd resp;
@@ -60,7 +61,7 @@ virtio_scsi_cmd(u16 ioaddr, struct vring_virtqueue *vq, struct disk_op_s *op,
 
     /* Add to virtqueue and kick host */
     vring_add_buf(vq, sg, out_num, in_num, 0, 0);
-    vring_kick(ioaddr, vq, 1);
+    vring_kick(vp, vq, 1);
 
     /* Wait for reply */
     while (!vring_more_used(vq))
@@ -72,7 +73,7 @@ virtio_scsi_cmd(u16 ioaddr, struct vring_virtqueue *vq, struct disk_op_s *op,
     /* Clear interrupt status register.  Avoid leaving interrupts stuck if
      * VRING_AVAIL_F_NO_INTERRUPT was ignored and interrupts were raised.
      */
-    vp_get_isr(ioaddr);
+    vp_get_isr(vp);
 
     if (resp.response == VIRTIO_SCSI_S_OK && resp.status == 0) {
         return DISK_RET_SUCCESS;
@@ -86,7 +87,7 @@ virtio_scsi_cmd_data(struct disk_op_s *op, void *cdbcmd, u16 blocksize)
     struct virtio_lun_s *vlun =
         container_of(op->drive_g, struct virtio_lun_s, drive);
 
-    return virtio_scsi_cmd(GET_GLOBAL(vlun->ioaddr),
+    return virtio_scsi_cmd(GLOBALFLAT2GLOBAL(GET_GLOBAL(vlun->vp)),
                            GET_GLOBAL(vlun->vq), op, cdbcmd,
                            GET_GLOBAL(vlun->target), GET_GLOBAL(vlun->lun),
                            blocksize * op->count);
@@ -103,10 +104,8 @@ setup_lun_cdrom(struct virtio_lun_s *vlun, char *desc)
 static int
 setup_lun_hd(struct virtio_lun_s *vlun, char *desc)
 {
-    if (vlun->drive.blksize != DISK_SECTOR_SIZE) {
-        dprintf(1, "Unsupported block size %d\n", vlun->drive.blksize);
+    if (blkemu_init(&vlun->drive) < 0)
         return -1;
-    }
 
     // Register with bcv system.
     int prio = bootprio_find_scsi_device(vlun->pci, vlun->target, vlun->lun);
@@ -116,7 +115,7 @@ setup_lun_hd(struct virtio_lun_s *vlun, char *desc)
 }
 
 static int
-virtio_scsi_add_lun(struct pci_device *pci, u16 ioaddr,
+virtio_scsi_add_lun(struct pci_device *pci, struct vp_device *vp,
                     struct vring_virtqueue *vq, u16 target, u16 lun)
 {
     struct virtio_lun_s *vlun = malloc_fseg(sizeof(*vlun));
@@ -128,14 +127,14 @@ virtio_scsi_add_lun(struct pci_device *pci, u16 ioaddr,
     vlun->drive.type = DTYPE_VIRTIO_SCSI;
     vlun->drive.cntl_id = pci->bdf;
     vlun->pci = pci;
-    vlun->ioaddr = ioaddr;
+    vlun->vp = vp;
     vlun->vq = vq;
     vlun->target = target;
     vlun->lun = lun;
 
     int pdt, ret;
     char *desc = NULL;
-    ret = scsi_init_drive(&vlun->drive, "virtio-scsi", &pdt, &desc);
+    ret = scsi_init_drive(&vlun->drive, "virtio-scsi", &pdt, &desc, NULL);
     if (ret)
         goto fail;
 
@@ -153,11 +152,11 @@ fail:
 }
 
 static int
-virtio_scsi_scan_target(struct pci_device *pci, u16 ioaddr,
+virtio_scsi_scan_target(struct pci_device *pci, struct vp_device *vp,
                         struct vring_virtqueue *vq, u16 target)
 {
     /* TODO: send REPORT LUNS.  For now, only LUN 0 is recognized.  */
-    int ret = virtio_scsi_add_lun(pci, ioaddr, vq, target, 0);
+    int ret = virtio_scsi_add_lun(pci, vp, vq, target, 0);
     return ret < 0 ? ret : 1;
 }
 
@@ -168,8 +167,14 @@ init_virtio_scsi(struct pci_device *pci)
     dprintf(1, "found virtio-scsi at %x:%x\n", pci_bdf_to_bus(bdf),
             pci_bdf_to_dev(bdf));
     struct vring_virtqueue *vq = NULL;
-    u16 ioaddr = vp_init_simple(bdf);
-    if (vp_find_vq(ioaddr, 2, &vq) < 0 ) {
+    struct vp_device *vp = malloc_fseg(sizeof(*vp));
+    if (!vp) {
+        warn_noalloc();
+        return;
+    }
+    if (vp_init_simple(vp, pci) < 0)
+        goto fail;
+    if (vp_find_vq(vp, 2, &vq) < 0 ) {
         if (vq) {
             dprintf(1, "fail to find vq for virtio-scsi %x:%x\n",
                     pci_bdf_to_bus(bdf), pci_bdf_to_dev(bdf));
@@ -178,24 +183,28 @@ init_virtio_scsi(struct pci_device *pci)
     }
 
     struct virtio_scsi_config cfg;
-    vp_get(ioaddr, 0, &cfg, sizeof(cfg));
+    vp_get(vp, 0, &cfg, sizeof(cfg));
     cfg.cdb_size   = VIRTIO_SCSI_CDB_SIZE;
     cfg.sense_size = VIRTIO_SCSI_SENSE_SIZE;
-    vp_set(ioaddr, 0, &cfg, sizeof(cfg));
+    vp_set(vp, 0, &cfg, sizeof(cfg));
+
+    /* The device may only be used once the driver is ready. */
+    vp_set_status(vp, vp_get_status(vp) | VIRTIO_CONFIG_S_DRIVER_OK);
 
     int i, tot;
     for (tot = 0, i = 0; i < 256; i++)
-        tot += virtio_scsi_scan_target(pci, ioaddr, vq, i);
+        tot += virtio_scsi_scan_target(pci, vp, vq, i);
 
-    if (!tot)
+    if (!tot) {
+        /* stop the device before its queue is freed */
+        vp_reset(vp);
         goto fail;
-
-    vp_set_status(ioaddr, VIRTIO_CONFIG_S_ACKNOWLEDGE |
-                  VIRTIO_CONFIG_S_DRIVER | VIRTIO_CONFIG_S_DRIVER_OK);
+    }
     return;
 
 fail:
     free(vq);
+    free(vp);
 }
 
 void
@@ -210,7 +219,8 @@ virtio_scsi_setup(void)
     struct pci_device *pci;
     foreachpci(pci) {
         if (pci->vendor != PCI_VENDOR_ID_REDHAT_QUMRANET
-            || pci->device != PCI_DEVICE_ID_VIRTIO_SCSI)
+            || (pci->device != PCI_DEVICE_ID_VIRTIO_SCSI
+                && pci->device != PCI_DEVICE_ID_VIRTIO_SCSI_10))
             continue;
         init_virtio_scsi(pci);
     }